@@ -98,7 +98,7 @@ namespace Assembler
             std::string _var;
         };
 
-        bool _displayed = false;
+        int _next = -1; // next gprintf at the same address
         uint16_t _address;
         int _lineNumber;
         std::string _lineToken;
@@ -127,6 +127,9 @@ namespace Assembler
     std::vector<std::string> _reservedWords;
     std::vector<DasmCode> _disassembledCode;
     std::vector<Gprintf> _gprintfs;
+    std::vector<int> _gprintfIndex; // first gprintf for each address, -1 for none
+    std::string _gprintfLog;
+    uint16_t _gprintfVpc = 0x0000;
 
     std::map<std::string, InstructionType> _asmOpcodes;
     std::map<uint8_t, InstructionDasm> _vcpuOpcodes;
@@ -140,6 +143,16 @@ namespace Assembler
     int getCurrDasmPageByteCount(void) {return _currDasmPageByteCount;}
     int getDisassembledCodeSize(void) {return int(_disassembledCode.size());}
     DasmCode* getDisassembledCode(int index) {return &_disassembledCode[index % _disassembledCode.size()];}
+    int getLabelsSize(void) {return int(_labels.size());}
+
+    bool getLabel(int index, uint16_t& address, std::string& name)
+    {
+        if(index < 0  ||  index >= int(_labels.size())) return false;
+
+        address = _labels[index]._address;
+        name = _labels[index]._name;
+        return true;
+    }
 
     void setIncludePath(const std::string& includePath) {_includePath = includePath;}
 
@@ -1840,7 +1853,7 @@ namespace Assembler
                         std::vector<std::string> variables = Expression::tokenise(variableText, ',');
                         parseGprintfFormat(formatText, variables, vars, subs);
 
-                        Gprintf gprintf = {false, _currentAddress, lineNumber, lineToken, formatText, vars, subs};
+                        Gprintf gprintf = {-1, _currentAddress, lineNumber, lineToken, formatText, vars, subs};
                         _gprintfs.push_back(gprintf);
                     }
 
@@ -1985,28 +1998,44 @@ namespace Assembler
         return true;
     }
 
+    void buildGprintfIndex(void)
+    {
+        _gprintfIndex.assign(RAM_SIZE_HI, -1);
+        for(int i=int(_gprintfs.size())-1; i>=0; i--)
+        {
+            _gprintfs[i]._next = _gprintfIndex[_gprintfs[i]._address];
+            _gprintfIndex[_gprintfs[i]._address] = i;
+        }
+        _gprintfVpc = Cpu::getVPC();
+    }
+
+    void flushGprintfLog(void)
+    {
+        if(_gprintfLog.size() == 0) return;
+
+        fwrite(_gprintfLog.c_str(), 1, _gprintfLog.size(), stderr);
+        _gprintfLog.clear();
+    }
+
     void printGprintfStrings(void)
     {
-        if(_gprintfs.size() == 0) return;
+        // A vCPU instruction can be dispatched more than once, (e.g. SYS calls waiting for enough ticks), so a
+        // gprintf is only formatted when vPC moves onto its address
+        uint16_t vPC = Cpu::getVPC();
+        if(vPC == _gprintfVpc) return;
+        _gprintfVpc = vPC;
 
-        for(int i=0; i<_gprintfs.size(); i++)
+        for(int i=_gprintfIndex[vPC]; i>=0; i=_gprintfs[i]._next)
         {
-            if(Cpu::getVPC() == _gprintfs[i]._address)
-            {
-                // Emulator can cycle many times for one CPU cycle, so make sure gprintf is displayed only once
-                if(!_gprintfs[i]._displayed)
-                {
-                    std::string gstring;
-                    getGprintfString(i, gstring);
-                    fprintf(stderr, "gprintf() : address $%04X : '%s'\n", _gprintfs[i]._address, gstring.c_str());
-                    _gprintfs[i]._displayed = true;
-                }
-            }
-            else
-            {
-                _gprintfs[i]._displayed = false;;
-            }
+            std::string gstring;
+            getGprintfString(i, gstring);
+
+            char header[32];
+            sprintf(header, "gprintf() : address $%04X : '", vPC);
+            _gprintfLog += header + gstring + "'\n";
         }
+
+        if(_gprintfLog.size() > GPRINTF_LOG_SIZE) flushGprintfLog();
     }
 #endif
 
@@ -2023,6 +2052,10 @@ namespace Assembler
 
 #ifndef STAND_ALONE
         Editor::clearBreakPoints();
+        Cpu::removeHook(Cpu::DispatchHook, printGprintfStrings);
+        Cpu::removeHook(Cpu::FrameHook, flushGprintfLog);
+        flushGprintfLog();
+        _gprintfIndex.clear();
 #endif
     }
 
@@ -2525,6 +2558,17 @@ namespace Assembler
         // Parse gprintf labels, equates and expressions
         if(!parseGprintfs()) return false;
 
+#ifndef STAND_ALONE
+        // Gprintfs are looked up by vPC on every vCPU instruction and their output is written out once a frame, but
+        // only while there are any
+        if(_gprintfs.size())
+        {
+            buildGprintfIndex();
+            Cpu::addHook(Cpu::DispatchHook, printGprintfStrings);
+            Cpu::addHook(Cpu::FrameHook, flushGprintfLog);
+        }
+#endif
+
         return true;
     }
 }
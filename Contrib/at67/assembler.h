@@ -46,6 +46,8 @@
 
 #define VCPU_BRANCH_OPCODE 0x35
 
+#define GPRINTF_LOG_SIZE  (64*1024) // buffered gprintf output is flushed once a frame or when it grows past this
+
 
 namespace Assembler
 {
@@ -95,6 +97,8 @@ namespace Assembler
     int getCurrDasmPageByteCount(void);
     int getDisassembledCodeSize(void);
     DasmCode* getDisassembledCode(int index);
+    int getLabelsSize(void);
+    bool getLabel(int index, uint16_t& address, std::string& name);
 
     void setIncludePath(const std::string& includePath);
 
@@ -110,6 +114,7 @@ namespace Assembler
 
 #ifndef STAND_ALONE
     void printGprintfStrings(void);
+    void flushGprintfLog(void);
 #endif
 }
 
@@ -2,6 +2,9 @@
 #include <stdlib.h>
 #include <math.h>
 #include <algorithm>
+#include <atomic>
+#include <vector>
+#include <string>
 
 #include "memory.h"
 #include "cpu.h"
@@ -10,24 +13,78 @@
 #include "editor.h"
 #include "midi/music.h"
 #include "expression.h"
+#include "spsc.h"
 #include "inih/INIReader.h"
 
 #include <SDL.h>
 
+#if defined(__SSE2__)  ||  defined(_M_X64)  ||  (defined(_M_IX86_FP)  &&  _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define AUDIO_SSE2
+#elif defined(__ARM_NEON)  ||  defined(_M_ARM64)
+#include <arm_neon.h>
+#define AUDIO_NEON
+#endif
 
 #define AUDIO_SAMPLES    (SCAN_LINES + 1)
 #define AUDIO_FREQUENCY  (SCAN_LINES*VSYNC_RATE)
+#define AUDIO_RING_SIZE  8192
+
+// The device pulls AUDIO_CALLBACK_SAMPLES at a time, the rate controller resamples the ring to keep
+// AUDIO_TARGET_FILL samples' worth of playing time in it, (the same latency the frame pacer aims for with SyncToAudio)
+#define AUDIO_CALLBACK_SAMPLES  512
+#define AUDIO_TARGET_FILL       (TIMING_AUDIO_LATENCY*AUDIO_FREQUENCY)
+#define AUDIO_RATE_KP           0.2
+#define AUDIO_RATE_KI           0.005
+#define AUDIO_RATE_MIN          0.5
+#define AUDIO_RATE_MAX          8.0
+
+// Polyphase windowed sinc resampler from AUDIO_FREQUENCY to the device's rate, AUDIO_TAPS must be a multiple of 4
+#define AUDIO_TAPS              16
+#define AUDIO_PHASES            128
+#define AUDIO_CUTOFF            0.45 // of the lower of the two rates
+
+// The two first order filters in series on the Gigatron's audio output, (see the schematics), the high pass also
+// removes the DC offset of the unsigned samples
+#define AUDIO_LOWPASS_FREQ      700.0
+#define AUDIO_HIGHPASS_FREQ     160.0
 
 
 namespace Audio
 {
     bool _realTimeAudio = true;
 
-    SDL_AudioDeviceID _audioDevice = 1;
-
     int32_t _audioIndex = 0;
     uint16_t _audioSamples[AUDIO_SAMPLES] = {0};
 
+    // Samples produced by the emulation thread and pulled by the audio device's callback, a full ring drops samples
+    Spsc::Ring<uint16_t, AUDIO_RING_SIZE> _audioRing;
+
+    // Audio thread only, apart from the counters
+    bool _primed = false;
+    double _rate = 1.0;
+    double _ratePhase = 0.0;
+    double _rateIntegral = 0.0;
+    int _outputFrequency = 48000;
+    bool _analogFilter = true;
+    double _step = 1.0;
+
+    // The newest AUDIO_TAPS filtered samples are stored twice, so that the window ending at any of them is contiguous
+    alignas(16) float _coefficients[AUDIO_PHASES][AUDIO_TAPS];
+    alignas(16) float _history[AUDIO_TAPS*2] = {0};
+    int _historyIndex = 0;
+    float _lowpass = 0.0f, _highpass = 0.0f, _highpassInput = 0.0f;
+    float _lowpassAlpha = 1.0f, _highpassAlpha = 1.0f;
+    std::atomic<uint64_t> _underruns{0};
+    std::atomic<uint64_t> _overruns{0};
+
+    // Offline recording, one sample per scan line until stopWav()
+    bool _recording = false;
+    std::string _wavFilename;
+    int _wavFrequency = 0;
+    bool _wavFilter = false;
+    std::vector<uint16_t> _wavSamples;
+
     int _scoreIndex = 0;
     uint8_t* _score[] = {(uint8_t*)musicMidi00};
     uint8_t* _scorePtr = (uint8_t*)_score[_scoreIndex];
@@ -36,6 +93,20 @@ namespace Audio
 
 
     bool getRealTimeAudio(void) {return _realTimeAudio;}
+    int32_t getAudioIndex(void) {return _audioIndex;}
+    uint16_t* getPtrToAudioSamples(int& numSamples) {numSamples = AUDIO_SAMPLES; return _audioSamples;}
+    uint64_t getUnderruns(void) {return _underruns;}
+    uint64_t getOverruns(void) {return _overruns;}
+
+    void setAudioIndex(int32_t audioIndex) {_audioIndex = audioIndex % AUDIO_SAMPLES;}
+
+    // Samples waiting in the ring for the audio device to pull them, in seconds
+    double getQueuedTime(void)
+    {
+        if(Cpu::getHeadless()) return 0.0;
+
+        return double(_audioRing.size()) / double(AUDIO_FREQUENCY);
+    }
 
     bool getKeyAsString(const std::string& sectionString, const std::string& iniKey, const std::string& defaultKey, std::string& result)
     {
@@ -45,6 +116,127 @@ namespace Audio
         return true;
     }
 
+    // Windowed sinc for each fractional position between two input samples, the window is centred half way through
+    // the taps so output lags input by AUDIO_TAPS/2 samples, (about 0.25ms)
+    void initialiseResampler(void)
+    {
+        const double pi = 3.14159265358979323846;
+
+        int outputFrequency = (_outputFrequency > 0) ? _outputFrequency : AUDIO_FREQUENCY;
+        _step = double(AUDIO_FREQUENCY) / double(outputFrequency);
+        double cutoff = AUDIO_CUTOFF * std::min(1.0, 1.0 / _step);
+
+        for(int phase=0; phase<AUDIO_PHASES; phase++)
+        {
+            double sum = 0.0;
+            double position = double(phase) / double(AUDIO_PHASES);
+            for(int tap=0; tap<AUDIO_TAPS; tap++)
+            {
+                double distance = double(AUDIO_TAPS/2 - 1 - tap) + position;
+                double x = 2.0 * cutoff * distance;
+                double sinc = (fabs(x) < 1.0e-9) ? 1.0 : sin(pi * x) / (pi * x);
+                double window = 0.42 + 0.5*cos(pi * distance / (AUDIO_TAPS/2)) + 0.08*cos(2.0 * pi * distance / (AUDIO_TAPS/2));
+                double coefficient = (fabs(distance) < AUDIO_TAPS/2) ? sinc * window : 0.0;
+                _coefficients[phase][tap] = float(coefficient);
+                sum += coefficient;
+            }
+            for(int tap=0; tap<AUDIO_TAPS; tap++) _coefficients[phase][tap] = float(_coefficients[phase][tap] / sum);
+        }
+
+        _lowpassAlpha = float(1.0 - exp(-2.0 * pi * AUDIO_LOWPASS_FREQ / AUDIO_FREQUENCY));
+        _highpassAlpha = float(1.0 / (1.0 + 2.0 * pi * AUDIO_HIGHPASS_FREQ / AUDIO_FREQUENCY));
+    }
+
+    // Audio thread, low pass then high pass, without the analog filter only the DC offset of the unsigned samples is removed
+    float filterSample(uint16_t sample)
+    {
+        float input = float(sample);
+        if(!_analogFilter) return input - float(0x0F <<8);
+
+        _lowpass += _lowpassAlpha * (input - _lowpass);
+        _highpass = _highpassAlpha * (_highpass + _lowpass - _highpassInput);
+        _highpassInput = _lowpass;
+        return _highpass;
+    }
+
+    void pushHistory(float value)
+    {
+        _history[_historyIndex] = value;
+        _history[_historyIndex + AUDIO_TAPS] = value;
+        _historyIndex = (_historyIndex + 1) % AUDIO_TAPS;
+    }
+
+    float convolve(const float* samples, const float* coefficients)
+    {
+#if defined(AUDIO_SSE2)
+        __m128 sum = _mm_setzero_ps();
+        for(int i=0; i<AUDIO_TAPS; i+=4) sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&samples[i]), _mm_load_ps(&coefficients[i])));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum);
+#elif defined(AUDIO_NEON)
+        float32x4_t sum = vdupq_n_f32(0.0f);
+        for(int i=0; i<AUDIO_TAPS; i+=4) sum = vmlaq_f32(sum, vld1q_f32(&samples[i]), vld1q_f32(&coefficients[i]));
+        float32x2_t pair = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+        return vget_lane_f32(vpadd_f32(pair, pair), 0);
+#else
+        float sum = 0.0f;
+        for(int i=0; i<AUDIO_TAPS; i++) sum += samples[i] * coefficients[i];
+        return sum;
+#endif
+    }
+
+    void pushSample(uint16_t sample)
+    {
+        if(!_audioRing.push(sample)) _overruns++;
+    }
+
+    // Audio thread, the rate controller consumes the ring faster when it fills and slower when it drains. The
+    // proportional term corrects the fill and the integral term absorbs a constant mismatch, such as an emulator running
+    // above 60Hz. With SyncToAudio the pacer already follows the device, so the ring is consumed at exactly 1:1
+    void audioCallback(void*, uint8_t* stream, int len)
+    {
+        // The fill is measured in playing time at the current rate, so an emulator running at twice the speed keeps
+        // twice the samples queued and has the same headroom against underruns
+        double fill = double(_audioRing.size()) / _rate;
+        if(!_primed  &&  fill >= AUDIO_TARGET_FILL) _primed = true;
+        if(Timing::getSyncToAudio())
+        {
+            _rate = 1.0;
+        }
+        else if(_primed)
+        {
+            double error = (fill - AUDIO_TARGET_FILL) / AUDIO_TARGET_FILL;
+            _rateIntegral = std::min(std::max(_rateIntegral + error*AUDIO_RATE_KI, AUDIO_RATE_MIN - 1.0), AUDIO_RATE_MAX - 1.0);
+            _rate = std::min(std::max(1.0 + _rateIntegral + error*AUDIO_RATE_KP, AUDIO_RATE_MIN), AUDIO_RATE_MAX);
+        }
+
+        // When the ring runs dry no more samples are taken until it has refilled to AUDIO_TARGET_FILL, the history
+        // doesn't change so the output holds, (dropping to silence would click)
+        int16_t* output = (int16_t*)stream;
+        int numSamples = len / int(sizeof(int16_t));
+        double step = _rate * _step;
+        for(int i=0; i<numSamples; i++)
+        {
+            for(_ratePhase += step; _primed  &&  _ratePhase >= 1.0; _ratePhase -= 1.0)
+            {
+                uint16_t sample;
+                if(!_audioRing.pop(sample))
+                {
+                    _underruns++;
+                    _primed = false;
+                    break;
+                }
+                pushHistory(filterSample(sample));
+            }
+            if(!_primed) _ratePhase = 0.0;
+
+            int phase = std::min(int(_ratePhase * AUDIO_PHASES), AUDIO_PHASES - 1);
+            float value = convolve(&_history[_historyIndex], _coefficients[phase]);
+            output[i] = int16_t(std::min(std::max(value, -32768.0f), 32767.0f));
+        }
+    }
+
     void initialise(void)
     {
         // Loader config
@@ -71,6 +263,12 @@ namespace Audio
                     {
                         getKeyAsString(sectionString, "RealTimeAudio", "1", result);   
                         _realTimeAudio = strtol(result.c_str(), nullptr, 10);
+                        getKeyAsString(sectionString, "SyncToAudio", "0", result);
+                        Timing::setSyncToAudio(strtol(result.c_str(), nullptr, 10) != 0);
+                        getKeyAsString(sectionString, "SampleRate", "48000", result);
+                        _outputFrequency = strtol(result.c_str(), nullptr, 10);
+                        getKeyAsString(sectionString, "AnalogFilter", "1", result);
+                        _analogFilter = strtol(result.c_str(), nullptr, 10) != 0;
                     }
                     break;
                 }
@@ -81,11 +279,22 @@ namespace Audio
             fprintf(stderr, "Loader::initialise() : couldn't find loader configuration INI file '%s' : reverting to default values.\n", AUDIO_CONFIG_INI);
         }
 
+        // Headless mode has no audio device
+        if(Cpu::getHeadless())
+        {
+            initialiseChannels();
+            return;
+        }
+
         SDL_AudioSpec audSpec;
         SDL_zero(audSpec);
-        audSpec.freq = AUDIO_FREQUENCY;
+        initialiseResampler();
+
+        audSpec.freq = (_outputFrequency > 0) ? _outputFrequency : AUDIO_FREQUENCY;
         audSpec.format = AUDIO_S16;
         audSpec.channels = 1;
+        audSpec.samples = AUDIO_CALLBACK_SAMPLES;
+        audSpec.callback = audioCallback;
 
         if(SDL_OpenAudio(&audSpec, NULL) < 0)
         {
@@ -130,25 +339,109 @@ namespace Audio
 
     void playAudioBuffer(void)
     {
-        SDL_QueueAudio(_audioDevice, &_audioSamples[0], _audioIndex <<1);
+        for(int i=0; i<_audioIndex; i++) pushSample(_audioSamples[i]);
         _audioIndex = 0;
     }
 
+    // Every scan line's sample goes into the ring, matching the device's rate is left to the audio callback
     void playSample(void)
     {
-        double ratio = 1.0;
-        if(Timing::getFrameTime()) ratio = std::max(1.0, VSYNC_TIMING_60 / std::min(Timing::getFrameTime(), VSYNC_TIMING_60));
+        pushSample((Cpu::getXOUT() & 0xf0) <<5);
+    }
+
+
+    void recordSample(void)
+    {
+        _wavSamples.push_back(uint16_t((Cpu::getXOUT() & 0xf0) <<5));
+    }
 
-        static double skip = 0.0;
-        uint64_t count = uint64_t(skip);
-        skip += 1.0 / ratio;
-        if(uint64_t(skip) > count)
+    void startWav(const std::string& filename, int outputFrequency, bool analogFilter)
+    {
+        _wavFilename = filename;
+        _wavFrequency = outputFrequency;
+        _wavFilter = analogFilter;
+        _wavSamples.clear();
+        _recording = true;
+
+        Cpu::addHook(Cpu::ScanlineHook, recordSample);
+    }
+
+    void writeLE(std::vector<uint8_t>& bytes, uint32_t value, int size)
+    {
+        for(int i=0; i<size; i++) bytes.push_back(uint8_t(value >>(i*8)));
+    }
+
+    bool stopWav(void)
+    {
+        if(!_recording) return true;
+
+        Cpu::removeHook(Cpu::ScanlineHook, recordSample);
+        _recording = false;
+
+        // Unprocessed samples are written exactly as the device used to receive them, otherwise they go through the
+        // same filters and resampler as real time audio, from a clean state so that renders are reproducible
+        std::vector<int16_t> output;
+        if(_wavFrequency == 0  &&  !_wavFilter)
         {
-            uint16_t sample = (Cpu::getXOUT() & 0xf0) <<5;
-            SDL_QueueAudio(_audioDevice, &sample, 2);
+            output.assign(_wavSamples.begin(), _wavSamples.end());
         }
-    }
+        else
+        {
+            _outputFrequency = _wavFrequency;
+            _analogFilter = _wavFilter;
+            initialiseResampler();
+            std::fill(_history, _history + AUDIO_TAPS*2, 0.0f);
+            _historyIndex = 0;
+            _lowpass = _highpass = _highpassInput = 0.0f;
+
+            double phase = 0.0;
+            size_t index = 0;
+            for(;;)
+            {
+                for(phase += _step; phase >= 1.0  &&  index < _wavSamples.size(); phase -= 1.0) pushHistory(filterSample(_wavSamples[index++]));
+                if(phase >= 1.0) break;
+
+                int phaseIndex = std::min(int(phase * AUDIO_PHASES), AUDIO_PHASES - 1);
+                float value = convolve(&_history[_historyIndex], _coefficients[phaseIndex]);
+                output.push_back(int16_t(std::min(std::max(value, -32768.0f), 32767.0f)));
+            }
+        }
+
+        uint32_t frequency = (_wavFrequency > 0) ? _wavFrequency : AUDIO_FREQUENCY;
+        uint32_t dataSize = uint32_t(output.size() * sizeof(int16_t));
+        std::vector<uint8_t> header;
+        header.insert(header.end(), {'R', 'I', 'F', 'F'});
+        writeLE(header, 36 + dataSize, 4);
+        header.insert(header.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+        writeLE(header, 16, 4);                         // fmt chunk size
+        writeLE(header, 1, 2);                          // PCM
+        writeLE(header, 1, 2);                          // mono
+        writeLE(header, frequency, 4);
+        writeLE(header, frequency * sizeof(int16_t), 4);  // bytes per second
+        writeLE(header, sizeof(int16_t), 2);            // block align
+        writeLE(header, 16, 2);                         // bits per sample
+        header.insert(header.end(), {'d', 'a', 't', 'a'});
+        writeLE(header, dataSize, 4);
+
+        std::vector<uint8_t> data;
+        data.reserve(dataSize);
+        for(size_t i=0; i<output.size(); i++) writeLE(data, uint16_t(output[i]), 2);
+
+        FILE* file = fopen(_wavFilename.c_str(), "wb");
+        if(file == nullptr)
+        {
+            fprintf(stderr, "Audio::stopWav() : failed to create '%s'\n", _wavFilename.c_str());
+            return false;
+        }
+        fwrite(header.data(), 1, header.size(), file);
+        fwrite(data.data(), 1, data.size(), file);
+        fclose(file);
+
+        fprintf(stderr, "Audio::stopWav() : wrote %0.3f seconds of %dHz audio to '%s'\n", double(output.size()) / double(frequency), frequency, _wavFilename.c_str());
+        _wavSamples.clear();
 
+        return true;
+    }
 
     void nextScore(void)
     {
@@ -1,6 +1,9 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
+#include <stdint.h>
+#include <string>
+
 
 #define GIGA_SOUND_TIMER     0x002C
 #define GIGA_SOUND_CHANNELS  4
@@ -40,6 +43,16 @@
 namespace Audio
 {
     bool getRealTimeAudio(void);
+    int32_t getAudioIndex(void);
+    uint16_t* getPtrToAudioSamples(int& numSamples);
+    double getQueuedTime(void);
+
+    // Times the device found the ring empty, (the last sample is held until it refills), and samples dropped because the
+    // ring was full
+    uint64_t getUnderruns(void);
+    uint64_t getOverruns(void);
+
+    void setAudioIndex(int32_t audioIndex);
 
     void initialise(void);
     void initialiseChannels(void);
@@ -48,6 +61,12 @@ namespace Audio
     void playAudioBuffer(void);
     void playSample(void);
 
+    // Headless, records the audio output of the calling thread's machine at one sample per scan line, as fast as it is
+    // emulated. stopWav() writes it to a 16 bit mono WAV file, resampled to outputFrequency, (0 keeps the Gigatron's
+    // 31260Hz), and through the analog filter model if asked, otherwise the samples are written untouched
+    void startWav(const std::string& filename, int outputFrequency, bool analogFilter);
+    bool stopWav(void);
+
     void playMusic(void);
     void nextScore(void);
 }
@@ -0,0 +1,540 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include "rs232/rs232.h"
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#endif
+
+#include "babelfish.h"
+
+
+#define BABELFISH_READ_SIZE  256
+#define BABELFISH_TIMEOUT    5.0  // the BabelFish gives up on a transfer after 5 seconds without data
+
+
+namespace BabelFish
+{
+    typedef std::chrono::steady_clock Clock;
+
+    std::string _device;
+    std::string _input;
+
+#if defined(_WIN32)
+    int _comPort = -1;
+#else
+    int _fd = -1;
+#if defined(__linux__)
+    int _epoll = -1;
+    uint32_t _events = 0;
+#endif
+#endif
+
+
+    double getElapsed(const Clock::time_point& start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+
+#if defined(_WIN32)
+    bool open(const std::string& device, int baudRate)
+    {
+        close();
+
+        _comPort = comFindPort(device.c_str());
+        if(_comPort < 0  ||  comOpen(_comPort, baudRate) == 0)
+        {
+            fprintf(stderr, "BabelFish::open() : couldn't open COM port '%s'\n", device.c_str());
+            _comPort = -1;
+            return false;
+        }
+
+        _device = device;
+        _input.clear();
+
+        return true;
+    }
+
+    void close(void)
+    {
+        if(_comPort >= 0) comClose(_comPort);
+        _comPort = -1;
+    }
+
+    bool isOpen(void) {return _comPort >= 0;}
+
+    int write(const uint8_t* data, int size)
+    {
+        return comWrite(_comPort, (const char*)data, size);
+    }
+
+    int read(char* buffer, int size)
+    {
+        return comRead(_comPort, buffer, size);
+    }
+
+    // rs232 has nothing to wait on, so poll it with short sleeps
+    bool wait(double timeOut, bool writing)
+    {
+        Clock::time_point start = Clock::now();
+        while(getElapsed(start) < timeOut)
+        {
+            char buffer[BABELFISH_READ_SIZE];
+            int n = read(buffer, BABELFISH_READ_SIZE);
+            if(n > 0)
+            {
+                _input.append(buffer, n);
+                return true;
+            }
+
+            if(writing) return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        return true;
+    }
+#else
+    speed_t getSpeed(int baudRate)
+    {
+        switch(baudRate)
+        {
+            case 9600:   return B9600;
+            case 19200:  return B19200;
+            case 38400:  return B38400;
+            case 57600:  return B57600;
+            case 115200: return B115200;
+            case 230400: return B230400;
+
+            default: return B115200;
+        }
+    }
+
+    bool open(const std::string& device, int baudRate)
+    {
+        close();
+
+        _fd = ::open(device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if(_fd < 0)
+        {
+            fprintf(stderr, "BabelFish::open() : couldn't open '%s' : %s\n", device.c_str(), strerror(errno));
+            return false;
+        }
+
+        // Raw 8N1, no flow control
+        struct termios config;
+        if(tcgetattr(_fd, &config) == 0)
+        {
+            config.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF);
+            config.c_oflag &= ~OPOST;
+            config.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+            config.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+            config.c_cflag |= CS8 | CLOCAL | CREAD;
+            config.c_cc[VMIN] = 1; // non blocking reads then return EAGAIN rather than 0 when empty
+            config.c_cc[VTIME] = 0;
+            cfsetispeed(&config, getSpeed(baudRate));
+            cfsetospeed(&config, getSpeed(baudRate));
+            tcsetattr(_fd, TCSANOW, &config);
+        }
+
+#if defined(__linux__)
+        _epoll = epoll_create1(0);
+        struct epoll_event event = {0};
+        event.events = _events = EPOLLIN;
+        event.data.fd = _fd;
+        if(_epoll < 0  ||  epoll_ctl(_epoll, EPOLL_CTL_ADD, _fd, &event) < 0)
+        {
+            fprintf(stderr, "BabelFish::open() : couldn't watch '%s' : %s\n", device.c_str(), strerror(errno));
+            close();
+            return false;
+        }
+#endif
+
+        _device = device;
+        _input.clear();
+
+        return true;
+    }
+
+    void close(void)
+    {
+#if defined(__linux__)
+        if(_epoll >= 0) ::close(_epoll);
+        _epoll = -1;
+#endif
+        if(_fd >= 0) ::close(_fd);
+        _fd = -1;
+    }
+
+    bool isOpen(void) {return _fd >= 0;}
+
+    int write(const uint8_t* data, int size)
+    {
+        ssize_t n = ::write(_fd, data, size);
+        if(n < 0) return (errno == EAGAIN  ||  errno == EWOULDBLOCK  ||  errno == EINTR) ? 0 : -1;
+
+        return int(n);
+    }
+
+    // Drains everything that has arrived, false once the other end has gone
+    bool drain(void)
+    {
+        for(;;)
+        {
+            char buffer[BABELFISH_READ_SIZE];
+            ssize_t n = ::read(_fd, buffer, BABELFISH_READ_SIZE);
+            if(n > 0)
+            {
+                _input.append(buffer, n);
+                continue;
+            }
+
+            if(n < 0  &&  (errno == EAGAIN  ||  errno == EWOULDBLOCK  ||  errno == EINTR)) return true;
+
+            fprintf(stderr, "BabelFish::poll() : lost '%s'\n", _device.c_str());
+            return false;
+        }
+    }
+
+    bool wait(double timeOut, bool writing)
+    {
+        int ms = std::max(int(timeOut * 1000.0 + 0.5), 0);
+
+#if defined(__linux__)
+        // Only ask for EPOLLOUT while there is something to write, a tty is almost always writable
+        uint32_t events = (writing) ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        if(events != _events)
+        {
+            struct epoll_event event = {0};
+            event.events = _events = events;
+            event.data.fd = _fd;
+            epoll_ctl(_epoll, EPOLL_CTL_MOD, _fd, &event);
+        }
+
+        struct epoll_event event;
+        int n = epoll_wait(_epoll, &event, 1, ms);
+        if(n < 0) return errno == EINTR;
+        if(n == 0) return true;
+        if(event.events & (EPOLLIN | EPOLLERR | EPOLLHUP)) return drain();
+#else
+        struct pollfd pfd = {_fd, short((writing) ? POLLIN | POLLOUT : POLLIN), 0};
+        int n = ::poll(&pfd, 1, ms);
+        if(n < 0) return errno == EINTR;
+        if(n == 0) return true;
+        if(pfd.revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL)) return drain();
+#endif
+
+        return true;
+    }
+#endif
+
+    bool poll(double timeOut, bool writing, std::vector<std::string>& lines)
+    {
+        if(!isOpen()) return false;
+
+        bool alive = wait(timeOut, writing);
+
+        // The BabelFish ends lines with "\r\n"
+        size_t eol;
+        while((eol = _input.find('\n')) != std::string::npos)
+        {
+            std::string line = _input.substr(0, eol);
+            _input.erase(0, eol + 1);
+            line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+            if(line.size()) lines.push_back(line);
+        }
+
+        return alive;
+    }
+
+
+    bool isPrompt(const std::string& line) {return line.size()  &&  line.back() == '?';}
+    bool isError(const std::string& line) {return line.size()  &&  line[0] == '!';}
+
+    // Puts lines back in front of the received bytes, for whoever reads next
+    void unread(const std::vector<std::string>& lines, int from)
+    {
+        for(int i=int(lines.size())-1; i>=from; i--) _input.insert(0, lines[i] + "\n");
+    }
+
+    bool writeAll(const uint8_t* data, int size, double timeOut)
+    {
+        Clock::time_point start = Clock::now();
+        std::vector<std::string> lines;
+        while(size)
+        {
+            int n = write(data, size);
+            if(n < 0) return false;
+            data += n;
+            size -= n;
+
+            if(size  &&  (!poll(0.01, true, lines)  ||  getElapsed(start) > timeOut)) return false;
+        }
+
+        // Lines that arrived while writing are kept for the caller
+        unread(lines, 0);
+
+        return true;
+    }
+
+    // Waits for the next "...?" prompt, error lines are reported and fail the wait
+    bool waitForPrompt(double timeOut, std::string& prompt)
+    {
+        Clock::time_point start = Clock::now();
+        std::vector<std::string> lines;
+        for(;;)
+        {
+            double remaining = timeOut - getElapsed(start);
+            if(remaining <= 0.0)
+            {
+                fprintf(stderr, "BabelFish::waitForPrompt() : timed out on '%s'\n", _device.c_str());
+                return false;
+            }
+
+            lines.clear();
+            if(!poll(remaining, false, lines)) return false;
+
+            for(int i=0; i<int(lines.size()); i++)
+            {
+                if(isError(lines[i]))
+                {
+                    fprintf(stderr, "BabelFish::waitForPrompt() : Arduino Error : '%s'\n", lines[i].c_str());
+                    return false;
+                }
+
+                if(isPrompt(lines[i]))
+                {
+                    unread(lines, i + 1);
+                    prompt = lines[i];
+                    return true;
+                }
+            }
+        }
+    }
+
+    bool command(char cmd, double timeOut)
+    {
+        uint8_t command[2] = {uint8_t(cmd), '\n'};
+        if(!writeAll(command, 2, timeOut)) return false;
+
+        std::string prompt;
+        return waitForPrompt(timeOut, prompt);
+    }
+
+
+    bool waitForCommandPrompt(double timeOut)
+    {
+        Clock::time_point start = Clock::now();
+        std::vector<std::string> lines;
+        while(getElapsed(start) < timeOut)
+        {
+            lines.clear();
+            if(!poll(0.1, false, lines)) return false;
+            for(int i=0; i<int(lines.size()); i++)
+            {
+                if(lines[i] == "Cmd?")
+                {
+                    unread(lines, i + 1);
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    // Returns to the BabelFish's command prompt after a failed transfer, it prompts by itself after an error and
+    // gives up on missing data after BABELFISH_TIMEOUT, a newline is only sent if it stays silent
+    bool recover(double timeOut)
+    {
+        if(waitForCommandPrompt(timeOut + BABELFISH_TIMEOUT)) return true;
+
+        uint8_t newline = '\n';
+        if(writeAll(&newline, 1, timeOut)  &&  waitForCommandPrompt(timeOut)) return true;
+
+        fprintf(stderr, "BabelFish::recover() : no prompt from '%s'\n", _device.c_str());
+        return false;
+    }
+
+    bool sendGt1(const std::vector<uint8_t>& gt1, int pipeline, int retries, double timeOut, Stats& stats, ProgressFunction progress)
+    {
+        stats = Stats();
+
+        // Every segment's header offset and where its data ends, the BabelFish stops reading at each end to drive the
+        // Gigatron, the terminator and start address are the last entry
+        std::vector<int> starts, ends;
+        int offset = 0;
+        for(;;)
+        {
+            if(offset + 3 > int(gt1.size()))
+            {
+                fprintf(stderr, "BabelFish::sendGt1() : truncated gt1 at offset %d\n", offset);
+                return false;
+            }
+
+            starts.push_back(offset);
+
+            // The first segment is always a segment, even at zero page
+            if(starts.size() > 1  &&  gt1[offset] == 0)
+            {
+                ends.push_back(offset + 3);
+                break;
+            }
+
+            int size = (gt1[offset + 2]) ? gt1[offset + 2] : 256;
+            offset += 3 + size;
+            ends.push_back(offset);
+        }
+
+        int streamEnd = ends.back();
+        int segment = 0;
+        int failedSegment = -1;
+        int attempts = 0;
+        Clock::time_point begin = Clock::now();
+
+        double latencyTotal = 0.0;
+        int latencyCount = 0;
+
+        for(;;)
+        {
+            // Each attempt restarts the transfer at the first segment that hasn't been acknowledged
+            int asked = starts[segment];
+            int sent = asked;
+            int current = segment;
+            bool loading = false;
+            bool satisfied = false;
+            bool failed = false;
+            Clock::time_point satisfiedTime;
+            Clock::time_point activity = Clock::now();
+
+            uint8_t command[2] = {'U', '\n'};
+            if(!writeAll(command, 2, timeOut)) return false;
+
+            std::vector<std::string> lines;
+            while(!failed)
+            {
+                // Bytes may run ahead of the prompts but never past the segment the BabelFish is reading
+                while(current < int(ends.size()) - 1  &&  ends[current] < asked) current++;
+                int allowed = std::min(asked + pipeline, ends[current]);
+                if(sent < allowed)
+                {
+                    int n = write(&gt1[sent], allowed - sent);
+                    if(n < 0) return false;
+                    sent += n;
+                }
+                if(!satisfied  &&  sent >= asked)
+                {
+                    satisfied = true;
+                    satisfiedTime = Clock::now();
+                }
+
+                lines.clear();
+                double remaining = timeOut - getElapsed(activity);
+                if(remaining <= 0.0)
+                {
+                    fprintf(stderr, "BabelFish::sendGt1() : timed out on '%s' at offset %d\n", _device.c_str(), asked);
+                    failed = true;
+                    break;
+                }
+                if(!poll(std::min(remaining, 0.1), sent < allowed, lines)) return false;
+                if(lines.size()) activity = Clock::now();
+
+                for(int i=0; i<int(lines.size())  &&  !failed; i++)
+                {
+                    const std::string& line = lines[i];
+                    if(isError(line))
+                    {
+                        fprintf(stderr, "BabelFish::sendGt1() : Arduino Error : '%s'\n", line.c_str());
+                        unread(lines, i + 1);
+                        failed = true;
+                    }
+                    else if(line.compare(0, 8, ":Loading") == 0)
+                    {
+                        loading = true;
+                    }
+                    else if(isPrompt(line))
+                    {
+                        if(!isdigit((unsigned char)line[0]))
+                        {
+                            // Back at the command prompt, done if everything was asked for
+                            if(asked == streamEnd  &&  sent == streamEnd)
+                            {
+                                stats._bytes += streamEnd - starts[segment];
+                                stats._elapsed = getElapsed(begin);
+                                if(latencyCount) stats._latencyMean = latencyTotal / double(latencyCount);
+                                if(progress) progress(1.0f);
+                                return true;
+                            }
+
+                            fprintf(stderr, "BabelFish::sendGt1() : transfer ended early at offset %d\n", asked);
+                            failed = true;
+                            break;
+                        }
+
+                        Clock::time_point now = Clock::now();
+                        if(satisfied)
+                        {
+                            double latency = std::chrono::duration<double>(now - satisfiedTime).count();
+                            stats._latencyMin = (latencyCount) ? std::min(stats._latencyMin, latency) : latency;
+                            stats._latencyMax = std::max(stats._latencyMax, latency);
+                            latencyTotal += latency;
+                            latencyCount++;
+                        }
+
+                        // The prompt after ":Loading" acknowledges the segment
+                        if(loading)
+                        {
+                            stats._bytes += ends[segment] - starts[segment];
+                            segment++;
+                            loading = false;
+                            if(progress) progress(float(stats._bytes) / float(streamEnd));
+                        }
+
+                        asked += strtol(line.c_str(), nullptr, 10);
+                        stats._requests++;
+                        satisfied = false;
+                        if(asked > streamEnd)
+                        {
+                            fprintf(stderr, "BabelFish::sendGt1() : asked for %d bytes past the end of the gt1\n", asked - streamEnd);
+                            failed = true;
+                        }
+                    }
+                }
+            }
+
+            // Retries are per segment, a long gt1 over a noisy link may need many in total
+            attempts = (segment == failedSegment) ? attempts + 1 : 1;
+            failedSegment = segment;
+            if(attempts > retries)
+            {
+                fprintf(stderr, "BabelFish::sendGt1() : giving up on offset %d after %d retries\n", starts[segment], retries);
+                return false;
+            }
+            stats._retries++;
+
+            if(!recover(timeOut)) return false;
+
+            // A new transfer always loads its first segment, so the terminator can't lead it, resend the last segment
+            if(segment == int(starts.size()) - 1)
+            {
+                segment--;
+                stats._bytes -= ends[segment] - starts[segment];
+            }
+            fprintf(stderr, "BabelFish::sendGt1() : retrying from offset %d\n", starts[segment]);
+        }
+    }
+}
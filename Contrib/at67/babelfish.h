@@ -0,0 +1,53 @@
+#ifndef BABELFISH_H
+#define BABELFISH_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+#define BABELFISH_PIPELINE  259  // a whole segment and its header
+#define BABELFISH_RETRIES   3
+
+
+namespace BabelFish
+{
+    struct Stats
+    {
+        int _bytes = 0;        // gt1 bytes the BabelFish accepted, (retried bytes count once)
+        int _requests = 0;     // "n?" prompts answered
+        int _retries = 0;
+        double _elapsed = 0.0; // seconds from the 'U' command to the final prompt
+
+        // Seconds from the bytes of one request being written to the next request, (includes the BabelFish
+        // driving the Gigatron, a segment of n bytes takes ceil(n/60) + 1 frames)
+        double _latencyMin = 0.0, _latencyMean = 0.0, _latencyMax = 0.0;
+    };
+
+    typedef void (*ProgressFunction)(float progress);
+
+
+    // A path on Linux and MacOS, (e.g. /dev/ttyACM0 or a pseudo terminal), or an rs232 port name on Windows, the
+    // port is non blocking and waits on epoll on Linux, poll on MacOS and short sleeps on Windows
+    bool open(const std::string& device, int baudRate);
+    void close(void);
+    bool isOpen(void);
+
+    // Writes as much as the port accepts without blocking, returns the number of bytes written
+    int write(const uint8_t* data, int size);
+
+    // Waits up to timeOut seconds for received bytes, (or until the port can take more when writing is true), and
+    // appends every completed line to lines, returns false if the port failed
+    bool poll(double timeOut, bool writing, std::vector<std::string>& lines);
+
+    // Sends a one letter command and waits for the BabelFish's "Cmd?" prompt, false on an error line or a time out
+    bool command(char cmd, double timeOut);
+
+    // Streams a gt1 file through the 'U' command. The BabelFish asks for every header and segment with an "n?"
+    // prompt, up to pipeline bytes are sent ahead of each prompt but never past the end of the segment being read,
+    // (while the BabelFish drives the Gigatron its receive buffer overflows). A segment that fails or times out is
+    // retried with a new 'U' command from that segment on, up to retries times per segment.
+    bool sendGt1(const std::vector<uint8_t>& gt1, int pipeline, int retries, double timeOut, Stats& stats, ProgressFunction progress=nullptr);
+}
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+
+#include <SDL.h>
+#include "memory.h"
+#include "cpu.h"
+#include "machine.h"
+#include "hle.h"
+#include "timing.h"
+#include "batch.h"
+#include "snapshot.h"
+#include "loader.h"
+#include "inih/INIReader.h"
+
+
+namespace Batch
+{
+    struct Job
+    {
+        std::string _name;
+        int _romIndex = NUM_INT_ROMS - 1;
+        int _sizeRAM = RAM_SIZE_LO;
+        int64_t _exitFrames = -1;
+        int64_t _exitClocks = -1;
+        int32_t _exitVpc = -1;
+        uint32_t _seed = 0;
+        std::string _state;
+        std::string _gt1;
+
+        // Results
+        bool _passed = false;
+        uint64_t _frames = 0;
+        int64_t _clocks = 0;
+        uint16_t _vPC = 0x0000;
+        uint32_t _hash = 0;
+        uint64_t _verifyErrors = 0;
+        double _elapsed = 0.0;
+    };
+
+
+    // Every section is a job, e.g.
+    // [ROMv4_boot]
+    // Rom    = 3      ; index into the ROM list, 0 to 3 are the internal ROMv1 to ROMv4, external ROMs follow
+    // Ram    = 32     ; 32 or 64 Kbytes
+    // Frames = 600    ; exit conditions, at least one is required, a job with a Vpc fails if it never reaches it
+    // Clocks = 0
+    // Vpc    = 0x0200
+    // State  = msbasic.gtstate ; optional snapshot to start from, Frames and Clocks count from the snapshot
+    // Seed   = 0      ; optional, seeds the power on RAM and undefined bus values, the same job always gives the same run
+    // Gt1    = Apps/Tetronis/Tetronis.gt1 ; optional, written straight into RAM and started at the ROM's menu, (as --gt1)
+    bool parseJobs(const std::string& filename, std::vector<Job>& jobs)
+    {
+        INIReader iniReader(filename);
+        if(iniReader.ParseError() != 0)
+        {
+            fprintf(stderr, "Batch::parseJobs() : couldn't parse INI file '%s'\n", filename.c_str());
+            return false;
+        }
+
+        for(auto section : iniReader.Sections())
+        {
+            Job job;
+            job._name = section;
+            job._romIndex = int(iniReader.GetInteger(section, "Rom", NUM_INT_ROMS - 1));
+            job._sizeRAM = (iniReader.GetInteger(section, "Ram", 32) == 64) ? RAM_SIZE_HI : RAM_SIZE_LO;
+            job._exitFrames = int64_t(iniReader.GetReal(section, "Frames", -1));
+            job._exitClocks = int64_t(iniReader.GetReal(section, "Clocks", -1));
+            std::string vpc = iniReader.Get(section, "Vpc", "");
+            if(vpc.size()) job._exitVpc = int32_t(strtol(vpc.c_str(), nullptr, 16) & 0xFFFF);
+            job._state = iniReader.Get(section, "State", "");
+            job._gt1 = iniReader.Get(section, "Gt1", "");
+            job._seed = uint32_t(strtoul(iniReader.Get(section, "Seed", "0").c_str(), nullptr, 0));
+
+            if(job._romIndex < 0  ||  job._romIndex >= Cpu::getNumRoms())
+            {
+                fprintf(stderr, "Batch::parseJobs() : job '%s' : ROM %d doesn't exist\n", section.c_str(), job._romIndex);
+                return false;
+            }
+            if(job._exitFrames < 0  &&  job._exitClocks < 0)
+            {
+                fprintf(stderr, "Batch::parseJobs() : job '%s' : needs a Frames or Clocks limit\n", section.c_str());
+                return false;
+            }
+
+            jobs.push_back(job);
+        }
+
+        return true;
+    }
+
+    void runJob(Job& job)
+    {
+        Gigatron::Machine* machine = Cpu::createMachine(job._romIndex, job._sizeRAM, job._seed);
+        if((job._state.size()  &&  !Snapshot::loadFile(job._state))  ||  (job._gt1.size()  &&  !Loader::uploadGt1OnBoot(job._gt1)))
+        {
+            job._passed = false;
+            Cpu::destroyMachine(machine);
+            return;
+        }
+        uint64_t startFrames = Cpu::getFrameCount();
+        int64_t startClocks = Cpu::getClock();
+        Cpu::setExitFrames((job._exitFrames >= 0) ? job._exitFrames + int64_t(startFrames) : -1);
+        Cpu::setExitClocks((job._exitClocks >= 0) ? job._exitClocks + startClocks : -1);
+        Cpu::setExitVpc(job._exitVpc);
+
+        uint64_t verifyErrors = Hle::getVerifyErrors();
+        uint64_t startCounter = SDL_GetPerformanceCounter();
+
+        while(Cpu::process());
+
+        job._elapsed = double(SDL_GetPerformanceCounter() - startCounter) / double(SDL_GetPerformanceFrequency());
+        job._frames = Cpu::getFrameCount() - startFrames;
+        job._clocks = Cpu::getClock() - startClocks;
+        job._vPC = Cpu::getVPC();
+        job._verifyErrors = Hle::getVerifyErrors() - verifyErrors;
+        job._passed = (job._exitVpc < 0  ||  Cpu::getExitVpcReached())  &&  job._verifyErrors == 0;
+
+        // FNV-1a of RAM
+        int ramSize = 0;
+        uint8_t* ram = Cpu::getPtrToRAM(ramSize);
+        job._hash = 0x811C9DC5;
+        for(int i=0; i<ramSize; i++) job._hash = (job._hash ^ ram[i]) * 0x01000193;
+
+        Cpu::destroyMachine(machine);
+    }
+
+    bool run(const std::string& filename, int numThreads)
+    {
+        std::vector<Job> jobs;
+        if(!parseJobs(filename, jobs)) return false;
+
+        if(numThreads <= 0) numThreads = int(std::thread::hardware_concurrency());
+        numThreads = std::max(1, std::min(numThreads, int(jobs.size())));
+
+        // Workers pull the next job until there are none left
+        std::atomic<int> nextJob(0);
+        std::vector<std::thread> workers;
+        uint64_t startCounter = SDL_GetPerformanceCounter();
+        for(int i=0; i<numThreads; i++)
+        {
+            workers.push_back(std::thread([&jobs, &nextJob]()
+            {
+                for(int j=nextJob++; j<int(jobs.size()); j=nextJob++) runJob(jobs[j]);
+            }));
+        }
+        for(int i=0; i<int(workers.size()); i++) workers[i].join();
+        double elapsed = double(SDL_GetPerformanceCounter() - startCounter) / double(SDL_GetPerformanceFrequency());
+
+        bool passed = true;
+        int64_t clocks = 0;
+        for(int i=0; i<int(jobs.size()); i++)
+        {
+            const Job& job = jobs[i];
+            if(!job._passed) passed = false;
+            clocks += job._clocks;
+            fprintf(stderr, "Batch::run() : %-24s : ROM %d : frames %" PRIu64 " : clocks %" PRId64 " : vPC 0x%04x : RAM 0x%08x : %0.3fs : %s\n", job._name.c_str(), job._romIndex,
+                            job._frames, job._clocks, job._vPC, job._hash, job._elapsed, (job._passed) ? "passed" : "FAILED");
+        }
+
+        fprintf(stderr, "Batch::run() : %d jobs on %d threads : elapsed %0.3fs : %0.2fMHz aggregate : %s\n", int(jobs.size()), numThreads, elapsed,
+                        double(clocks) / elapsed / 1.0e6, (passed) ? "all passed" : "FAILURES");
+
+        return passed;
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+
+
+namespace Batch
+{
+    // Runs every job in an INI file on its own headless machine, spread across numThreads worker threads, (0 uses one
+    // thread per hardware thread), returns false if the file can't be parsed or any job fails
+    bool run(const std::string& filename, int numThreads);
+}
+
+#endif
@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <signal.h>
+#endif
+
+#include "cpu.h"
+#include "machine.h"
+#include "timing.h"
+#include "graphics.h"
+#include "expression.h"
+#include "spsc.h"
+#include "capture.h"
+
+
+#define CAPTURE_IDLE_TIME  0.001
+
+
+namespace Capture
+{
+    struct Frame
+    {
+        uint64_t _number;
+        uint32_t _pixels[GIGA_WIDTH * GIGA_HEIGHT];
+    };
+
+    bool _enabled = false;
+    Format _format = Raw;
+    int _every = 1;
+    std::string _filename;
+    FILE* _file = nullptr;
+
+    // Frames cycle from the free ring to the emulation thread, through the full ring to the writer thread and back
+    Frame _frames[CAPTURE_QUEUE_FRAMES];
+    Spsc::Ring<int, CAPTURE_QUEUE_FRAMES> _freeFrames;
+    Spsc::Ring<int, CAPTURE_QUEUE_FRAMES> _fullFrames;
+    int _current = -1;
+    int _currentRows = 0;
+    bool _capturing = false;
+
+    std::thread _writer;
+    std::atomic<bool> _stopping(false);
+    std::atomic<uint64_t> _framesWritten(0);
+    std::atomic<uint64_t> _framesDropped(0);
+    std::atomic<bool> _writeFailed(false);
+
+    uint32_t _crcTable[256];
+
+
+    bool getEnabled(void) {return _enabled;}
+    uint64_t getFramesWritten(void) {return _framesWritten;}
+    uint64_t getFramesDropped(void) {return _framesDropped;}
+
+    bool getFormat(const std::string& name, Format& format)
+    {
+        static const char* names[NumFormats] = {"RAW", "Y4M", "PNG"};
+
+        std::string upper = name;
+        Expression::strToUpper(upper);
+        for(int i=0; i<NumFormats; i++)
+        {
+            if(upper == names[i])
+            {
+                format = Format(i);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+
+    bool writeRaw(const Frame& frame)
+    {
+        uint8_t rgba[GIGA_WIDTH * GIGA_HEIGHT * 4];
+        for(int i=0; i<GIGA_WIDTH*GIGA_HEIGHT; i++)
+        {
+            uint32_t pixel = frame._pixels[i];
+            rgba[i*4 + 0] = uint8_t(pixel >>16);
+            rgba[i*4 + 1] = uint8_t(pixel >>8);
+            rgba[i*4 + 2] = uint8_t(pixel);
+            rgba[i*4 + 3] = 0xFF;
+        }
+        return fwrite(rgba, 1, sizeof rgba, _file) == sizeof rgba;
+    }
+
+    // Full range BT.601, (as used by JPEG), chroma is the average of each 2x2 block
+    bool writeY4m(const Frame& frame)
+    {
+        uint8_t y[GIGA_WIDTH * GIGA_HEIGHT];
+        uint8_t u[GIGA_WIDTH/2 * GIGA_HEIGHT/2];
+        uint8_t v[GIGA_WIDTH/2 * GIGA_HEIGHT/2];
+        for(int i=0; i<GIGA_WIDTH*GIGA_HEIGHT; i++)
+        {
+            uint32_t pixel = frame._pixels[i];
+            int r = (pixel >>16) & 0xFF, g = (pixel >>8) & 0xFF, b = pixel & 0xFF;
+            y[i] = uint8_t((19595*r + 38470*g + 7471*b + 32768) >>16);
+        }
+        for(int j=0; j<GIGA_HEIGHT/2; j++)
+        {
+            for(int i=0; i<GIGA_WIDTH/2; i++)
+            {
+                int r = 0, g = 0, b = 0;
+                for(int k=0; k<4; k++)
+                {
+                    uint32_t pixel = frame._pixels[(i*2 + (k & 1))  +  (j*2 + (k >>1))*GIGA_WIDTH];
+                    r += (pixel >>16) & 0xFF, g += (pixel >>8) & 0xFF, b += pixel & 0xFF;
+                }
+                u[i + j*GIGA_WIDTH/2] = uint8_t(128 + ((-11059*r - 21709*g + 32768*b + 131072) >>18));
+                v[i + j*GIGA_WIDTH/2] = uint8_t(128 + (( 32768*r - 27439*g -  5329*b + 131072) >>18));
+            }
+        }
+
+        return fputs("FRAME\n", _file) >= 0  &&  fwrite(y, 1, sizeof y, _file) == sizeof y  &&
+               fwrite(u, 1, sizeof u, _file) == sizeof u  &&  fwrite(v, 1, sizeof v, _file) == sizeof v;
+    }
+
+    uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size)
+    {
+        crc = ~crc;
+        for(size_t i=0; i<size; i++) crc = _crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >>8);
+        return ~crc;
+    }
+
+    bool writeChunk(FILE* file, const char* type, const std::vector<uint8_t>& data)
+    {
+        uint8_t header[8] = {uint8_t(data.size() >>24), uint8_t(data.size() >>16), uint8_t(data.size() >>8), uint8_t(data.size())};
+        memcpy(&header[4], type, 4);
+        uint32_t crc = crc32(crc32(0, &header[4], 4), data.data(), data.size());
+        uint8_t footer[4] = {uint8_t(crc >>24), uint8_t(crc >>16), uint8_t(crc >>8), uint8_t(crc)};
+
+        return fwrite(header, 1, sizeof header, file) == sizeof header  &&  fwrite(data.data(), 1, data.size(), file) == data.size()  &&
+               fwrite(footer, 1, sizeof footer, file) == sizeof footer;
+    }
+
+    // 8 bit RGB, the image is stored in uncompressed deflate blocks, a screen is small enough that it isn't worth
+    // depending on zlib for
+    bool writePng(const Frame& frame)
+    {
+        std::string base = _filename;
+        std::string extension = (base.size() > 4) ? base.substr(base.size() - 4) : "";
+        if(Expression::strToUpper(extension) == ".PNG") base.erase(base.size() - 4);
+        char number[32];
+        sprintf(number, "_%06llu.png", (unsigned long long)frame._number);
+
+        FILE* file = fopen((base + number).c_str(), "wb");
+        if(file == nullptr)
+        {
+            fprintf(stderr, "Capture::writePng() : failed to create '%s'\n", (base + number).c_str());
+            return false;
+        }
+
+        // Every row is filter type 0 followed by its pixels
+        const int rowSize = 1 + GIGA_WIDTH*3;
+        std::vector<uint8_t> image(rowSize * GIGA_HEIGHT);
+        for(int j=0; j<GIGA_HEIGHT; j++)
+        {
+            uint8_t* row = &image[j*rowSize];
+            row[0] = 0;
+            for(int i=0; i<GIGA_WIDTH; i++)
+            {
+                uint32_t pixel = frame._pixels[i + j*GIGA_WIDTH];
+                row[1 + i*3 + 0] = uint8_t(pixel >>16);
+                row[1 + i*3 + 1] = uint8_t(pixel >>8);
+                row[1 + i*3 + 2] = uint8_t(pixel);
+            }
+        }
+
+        std::vector<uint8_t> ihdr = {uint8_t(GIGA_WIDTH >>24), uint8_t(GIGA_WIDTH >>16), uint8_t(GIGA_WIDTH >>8), uint8_t(GIGA_WIDTH),
+                                     uint8_t(GIGA_HEIGHT >>24), uint8_t(GIGA_HEIGHT >>16), uint8_t(GIGA_HEIGHT >>8), uint8_t(GIGA_HEIGHT),
+                                     8, 2, 0, 0, 0};
+
+        // zlib header, stored blocks of at most 65535 bytes and the adler32 of the image
+        std::vector<uint8_t> idat = {0x78, 0x01};
+        uint32_t a = 1, b = 0;
+        for(size_t offset=0; offset<image.size(); offset+=65535)
+        {
+            size_t size = std::min(image.size() - offset, size_t(65535));
+            bool last = (offset + size == image.size());
+            idat.push_back(uint8_t(last));
+            idat.push_back(uint8_t(size)), idat.push_back(uint8_t(size >>8));
+            idat.push_back(uint8_t(~size)), idat.push_back(uint8_t(~size >>8));
+            idat.insert(idat.end(), image.data() + offset, image.data() + offset + size);
+            for(size_t i=offset; i<offset+size; i++)
+            {
+                a = (a + image[i]) % 65521;
+                b = (b + a) % 65521;
+            }
+        }
+        uint32_t adler = (b <<16) | a;
+        idat.push_back(uint8_t(adler >>24)), idat.push_back(uint8_t(adler >>16)), idat.push_back(uint8_t(adler >>8)), idat.push_back(uint8_t(adler));
+
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        bool written = fwrite(signature, 1, sizeof signature, file) == sizeof signature  &&  writeChunk(file, "IHDR", ihdr)  &&
+                       writeChunk(file, "IDAT", idat)  &&  writeChunk(file, "IEND", std::vector<uint8_t>());
+        return (fclose(file) == 0)  &&  written;
+    }
+
+    // Writer thread, runs until stop() has been called and the queue is empty
+    void writeFrames(void)
+    {
+        for(;;)
+        {
+            // Read before popping, so that once stopping is seen every frame queued before it is too
+            bool stopping = _stopping;
+
+            int index;
+            if(!_fullFrames.pop(index))
+            {
+                if(stopping) break;
+
+                std::this_thread::sleep_for(std::chrono::duration<double>(CAPTURE_IDLE_TIME));
+                continue;
+            }
+
+            // Once a write has failed, (e.g. the encoder on the other end of a pipe has gone), frames are only recycled
+            if(!_writeFailed)
+            {
+                bool written = false;
+                switch(_format)
+                {
+                    case Raw: written = writeRaw(_frames[index]); break;
+                    case Y4m: written = writeY4m(_frames[index]); break;
+                    case Png: written = writePng(_frames[index]); break;
+
+                    default: break;
+                }
+                if(written) _framesWritten++;
+                else _writeFailed = true;
+            }
+
+            _freeFrames.push(index);
+        }
+    }
+
+
+    // Scanline hook, the first of every four VGA lines holds the Gigatron's pixels whatever the scanline mode
+    void captureScanline(void)
+    {
+        const Gigatron::Machine& m = Cpu::getMachine();
+        if(!_capturing  ||  m._vgaY < 0  ||  m._vgaY >= SCREEN_HEIGHT  ||  (m._vgaY & 3)) return;
+
+        const uint32_t* colours = Graphics::getColours();
+        uint32_t* pixels = &_frames[_current]._pixels[(m._vgaY >>2) * GIGA_WIDTH];
+        for(int i=0; i<GIGA_WIDTH; i++) pixels[i] = colours[m._scanline[i] & (COLOUR_PALETTE-1)];
+        _currentRows++;
+    }
+
+    // Frame hook, hands the frame that just ended to the writer and takes a free one for the frame that's starting
+    void captureFrame(void)
+    {
+        const Gigatron::Machine& m = Cpu::getMachine();
+
+        // Partial frames, (the first one or after a reset), are never written, the frame is kept and reused, (only the
+        // writer thread returns frames to the free ring)
+        if(_capturing  &&  _currentRows == GIGA_HEIGHT)
+        {
+            _fullFrames.push(_current);
+            _current = -1;
+        }
+        _capturing = false;
+
+        if((m._frameCount % uint64_t(_every)) != 0) return;
+
+        int index;
+        if(_current == -1)
+        {
+            if(!_freeFrames.pop(index))
+            {
+                _framesDropped++;
+                return;
+            }
+            _current = index;
+        }
+
+        _capturing = true;
+        _currentRows = 0;
+        _frames[_current]._number = m._frameCount;
+    }
+
+
+    bool start(const std::string& filename, Format format, int every)
+    {
+        if(_enabled) stop();
+
+        _format = format;
+        _every = std::max(every, 1);
+        _filename = filename;
+
+        if(format != Png)
+        {
+            if(filename == "-")
+            {
+#if defined(_WIN32)
+                _setmode(_fileno(stdout), _O_BINARY);
+#else
+                // A closed pipe is reported as a failed write instead of killing the emulator
+                signal(SIGPIPE, SIG_IGN);
+#endif
+                _file = stdout;
+            }
+            else
+            {
+                _file = fopen(filename.c_str(), "wb");
+                if(_file == nullptr)
+                {
+                    fprintf(stderr, "Capture::start() : failed to create '%s'\n", filename.c_str());
+                    return false;
+                }
+            }
+
+            if(format == Y4m)
+            {
+                fprintf(_file, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg\n", GIGA_WIDTH, GIGA_HEIGHT, VSYNC_RATE, _every);
+            }
+        }
+
+        for(uint32_t i=0; i<256; i++)
+        {
+            uint32_t crc = i;
+            for(int j=0; j<8; j++) crc = (crc & 1) ? 0xEDB88320 ^ (crc >>1) : crc >>1;
+            _crcTable[i] = crc;
+        }
+
+        int index;
+        while(_fullFrames.pop(index));
+        while(_freeFrames.pop(index));
+        for(int i=0; i<CAPTURE_QUEUE_FRAMES; i++) _freeFrames.push(i);
+        _current = -1;
+        _capturing = false;
+        _framesWritten = 0;
+        _framesDropped = 0;
+        _writeFailed = false;
+
+        _stopping = false;
+        _writer = std::thread(writeFrames);
+
+        Cpu::addHook(Cpu::ScanlineHook, captureScanline);
+        Cpu::addHook(Cpu::FrameHook, captureFrame);
+        _enabled = true;
+
+        return true;
+    }
+
+    bool stop(void)
+    {
+        if(!_enabled) return true;
+
+        Cpu::removeHook(Cpu::ScanlineHook, captureScanline);
+        Cpu::removeHook(Cpu::FrameHook, captureFrame);
+        _enabled = false;
+
+        _stopping = true;
+        _writer.join();
+
+        if(_file)
+        {
+            int result = (_file != stdout) ? fclose(_file) : fflush(_file);
+            if(result != 0) _writeFailed = true;
+            _file = nullptr;
+        }
+
+        fprintf(stderr, "Capture::stop() : frames written %" PRIu64 " : frames dropped %" PRIu64 "\n", uint64_t(_framesWritten), uint64_t(_framesDropped));
+        if(_writeFailed)
+        {
+            fprintf(stderr, "Capture::stop() : write to '%s' failed, capture stopped after %" PRIu64 " frames\n", _filename.c_str(), uint64_t(_framesWritten));
+            return false;
+        }
+
+        return true;
+    }
+}
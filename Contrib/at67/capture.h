@@ -0,0 +1,35 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <string>
+
+
+#define CAPTURE_QUEUE_FRAMES  64 // power of two, frames waiting for the writer thread
+
+
+namespace Capture
+{
+    enum Format {Raw=0, Y4m, Png, NumFormats};
+
+    bool getEnabled(void);
+    uint64_t getFramesWritten(void);
+    uint64_t getFramesDropped(void);
+
+    // "raw", "y4m" or "png", returns false for anything else
+    bool getFormat(const std::string& name, Format& format);
+
+    // Starts capturing the calling thread's machine at the Gigatron's native 160x120, every nth frame is written:
+    // Raw  RGBA bytes, frame after frame, to filename, ("-" is stdout)
+    // Y4m  a YUV4MPEG2 stream with 4:2:0 full range BT.601 chroma to filename, ("-" is stdout), for piping into an encoder
+    // Png  <filename>_<frame>.png, (filename's .png extension is optional)
+    // Frames are written on a background thread through a bounded queue, when the writer falls behind frames are
+    // dropped rather than stalling emulation
+    bool start(const std::string& filename, Format format, int every);
+
+    // Waits for the queued frames to be written and closes the output, false if a write failed, (frames are no longer
+    // written after the first failure)
+    bool stop(void);
+}
+
+#endif
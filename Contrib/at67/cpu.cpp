@@ -1,13 +1,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <string.h>
 #include <fstream>
 #include <iomanip>
 #include <vector>
 #include <algorithm>
+#include <array>
+#include <utility>
 
 #include "memory.h"
 #include "cpu.h"
+#include "machine.h"
 
 #ifndef STAND_ALONE
 #include <SDL.h>
@@ -16,6 +20,9 @@
 #include "editor.h"
 #include "timing.h"
 #include "graphics.h"
+#include "hle.h"
+#include "rewind.h"
+#include "profiler.h"
 #include "gigatron_0x1c.h"
 #include "gigatron_0x20.h"
 #include "gigatron_0x28.h"
@@ -36,65 +43,48 @@
 namespace Cpu
 {
     int _numRoms = 0;
-    int _romIndex = 0;
-    int _vCpuInstPerFrame = 0;
-    int _vCpuInstPerFrameMax = 0;
-    float _vCpuUtilisation = 0.0;
 
-    bool _isInReset = false;
-    bool _checkRomType = true;
     bool _debugging = false;
     bool _initAudio = true;
+    bool _exitRequested = false;
+    bool _seedSet = false;
+    uint32_t _seed = 0;
 
-    std::vector<uint8_t> _RAM;
-    uint8_t _ROM[ROM_SIZE][2];
     std::vector<uint8_t*> _romFiles;
-    RomType _romType = ROMERR;
-
-    std::vector<uint8_t> _scanlinesRom0;
-    std::vector<uint8_t> _scanlinesRom1;
-    int _scanlineMode = ScanlineMode::Normal;
 
     std::vector<InternalGt1> _internalGt1s;
 
-    int getNumRoms(void) {return _numRoms;}
-    uint8_t* getPtrToROM(int& romSize) {romSize = sizeof _ROM; return (uint8_t*)_ROM;}
-    RomType getRomType(void) {return _romType;}
+    // The main machine is the one the window, audio and editor belong to, every thread starts out bound to it
+    Gigatron::Machine _mainMachine;
+    thread_local Gigatron::Machine* _machine = &_mainMachine;
 
+    int getNumRoms(void) {return _numRoms;}
+    const uint8_t* getRomFile(int index) {return _romFiles[index % _numRoms];}
+    uint8_t* getPtrToROM(int& romSize) {romSize = sizeof _machine->_ROM; return (uint8_t*)_machine->_ROM;}
+    RomType getRomType(void) {return _machine->_romType;}
+    Gigatron::Machine& getMachine(void) {return *_machine;}
 
-//#define COLLECT_INST_STATS
-#if defined(COLLECT_INST_STATS)
-    struct InstCount
+    void setMachine(Gigatron::Machine* machine)
     {
-        uint8_t _inst = 0;
-        uint64_t _count = 0;
-    };
+        _machine = machine;
+#ifndef STAND_ALONE
+        Hle::detectRom();
+#endif
+    }
 
-    uint64_t _totalCount = 0;
-    float _totalPercent = 0.0f;
-    std::vector<InstCount> _instCounts(256);
+#ifndef STAND_ALONE
+    void setMemoryModel(Gigatron::Machine& m, int sizeRAM);
+    void vCpuUsageHook(void);
+#endif
 
-    void displayInstCounts(void)
+    // Every ROM write goes through here so that the HLE signatures stay coherent
+    void writeROM(uint16_t address, int page, uint8_t data)
     {
-        std::sort(_instCounts.begin(), _instCounts.end(), [](const InstCount& a, const InstCount& b)
-        {
-            return (a._count > b._count);
-        });
-
-        for(int i=0; i<_instCounts.size(); i++)
-        {
-            float percent = float(_instCounts[i]._count)/float(_totalCount)*100.0f;
-            if(percent > 1.0f)
-            {
-                _totalPercent += percent;
-                fprintf(stderr, "inst:%02x count:%012lld %.1f%%\n", _instCounts[i]._inst, _instCounts[i]._count, percent);
-            }
-        }
-
-        fprintf(stderr, "Total instructions:%lld\n", _totalCount);
-        fprintf(stderr, "Total percentage:%f\n", _totalPercent);
-    }
+        _machine->_ROM[address][page & 0x01] = data;
+#ifndef STAND_ALONE
+        Hle::romWritten(address);
 #endif
+    }
 
 
     void initialiseInternalGt1s(void)
@@ -120,84 +110,84 @@ namespace Cpu
 
     void patchSYS_Exec_88(void)
     {
-        _ROM[0x00AD][ROM_INST] = 0x00;
-        _ROM[0x00AD][ROM_DATA] = 0x00;
+        writeROM(0x00AD, ROM_INST, 0x00);
+        writeROM(0x00AD, ROM_DATA, 0x00);
 
-        _ROM[0x00AF][ROM_INST] = 0x00;
-        _ROM[0x00AF][ROM_DATA] = 0x67;
+        writeROM(0x00AF, ROM_INST, 0x00);
+        writeROM(0x00AF, ROM_DATA, 0x67);
 
-        _ROM[0x00B5][ROM_INST] = 0xDC;
-        _ROM[0x00B5][ROM_DATA] = 0xCF;
+        writeROM(0x00B5, ROM_INST, 0xDC);
+        writeROM(0x00B5, ROM_DATA, 0xCF);
 
-        _ROM[0x00B6][ROM_INST] = 0x80;
-        _ROM[0x00B6][ROM_DATA] = 0x23;
+        writeROM(0x00B6, ROM_INST, 0x80);
+        writeROM(0x00B6, ROM_DATA, 0x23);
 
-        _ROM[0x00BB][ROM_INST] = 0x80;
-        _ROM[0x00BB][ROM_DATA] = 0x00;
+        writeROM(0x00BB, ROM_INST, 0x80);
+        writeROM(0x00BB, ROM_DATA, 0x00);
     }
 
     void patchScanlineModeVideoB(void)
     {
-        _ROM[0x01C2][ROM_INST] = 0x14;
-        _ROM[0x01C2][ROM_DATA] = 0x01;
+        writeROM(0x01C2, ROM_INST, 0x14);
+        writeROM(0x01C2, ROM_DATA, 0x01);
 
-        _ROM[0x01C9][ROM_INST] = 0x01;
-        _ROM[0x01C9][ROM_DATA] = 0x09;
+        writeROM(0x01C9, ROM_INST, 0x01);
+        writeROM(0x01C9, ROM_DATA, 0x09);
 
-        _ROM[0x01CA][ROM_INST] = 0x90;
-        _ROM[0x01CA][ROM_DATA] = 0x01;
+        writeROM(0x01CA, ROM_INST, 0x90);
+        writeROM(0x01CA, ROM_DATA, 0x01);
 
-        _ROM[0x01CB][ROM_INST] = 0x01;
-        _ROM[0x01CB][ROM_DATA] = 0x0A;
+        writeROM(0x01CB, ROM_INST, 0x01);
+        writeROM(0x01CB, ROM_DATA, 0x0A);
 
-        _ROM[0x01CC][ROM_INST] = 0x8D;
-        _ROM[0x01CC][ROM_DATA] = 0x00;
+        writeROM(0x01CC, ROM_INST, 0x8D);
+        writeROM(0x01CC, ROM_DATA, 0x00);
 
-        _ROM[0x01CD][ROM_INST] = 0xC2;
-        _ROM[0x01CD][ROM_DATA] = 0x0A;
+        writeROM(0x01CD, ROM_INST, 0xC2);
+        writeROM(0x01CD, ROM_DATA, 0x0A);
 
-        _ROM[0x01CE][ROM_INST] = 0x00;
-        _ROM[0x01CE][ROM_DATA] = 0xD4;
+        writeROM(0x01CE, ROM_INST, 0x00);
+        writeROM(0x01CE, ROM_DATA, 0xD4);
 
-        _ROM[0x01CF][ROM_INST] = 0xFC;
-        _ROM[0x01CF][ROM_DATA] = 0xFD;
+        writeROM(0x01CF, ROM_INST, 0xFC);
+        writeROM(0x01CF, ROM_DATA, 0xFD);
 
-        _ROM[0x01D0][ROM_INST] = 0xC2;
-        _ROM[0x01D0][ROM_DATA] = 0x0C;
+        writeROM(0x01D0, ROM_INST, 0xC2);
+        writeROM(0x01D0, ROM_DATA, 0x0C);
 
-        _ROM[0x01D1][ROM_INST] = 0x02;
-        _ROM[0x01D1][ROM_DATA] = 0x00;
+        writeROM(0x01D1, ROM_INST, 0x02);
+        writeROM(0x01D1, ROM_DATA, 0x00);
 
-        _ROM[0x01D2][ROM_INST] = 0x02;
-        _ROM[0x01D2][ROM_DATA] = 0x00;
+        writeROM(0x01D2, ROM_INST, 0x02);
+        writeROM(0x01D2, ROM_DATA, 0x00);
 
-        _ROM[0x01D3][ROM_INST] = 0x02;
-        _ROM[0x01D3][ROM_DATA] = 0x00;
+        writeROM(0x01D3, ROM_INST, 0x02);
+        writeROM(0x01D3, ROM_DATA, 0x00);
     }
 
     void patchScanlineModeVideoC(void)
     {
-        _ROM[0x01DA][ROM_INST] = 0xFC;
-        _ROM[0x01DA][ROM_DATA] = 0xFD;
+        writeROM(0x01DA, ROM_INST, 0xFC);
+        writeROM(0x01DA, ROM_DATA, 0xFD);
 
-        _ROM[0x01DB][ROM_INST] = 0xC2;
-        _ROM[0x01DB][ROM_DATA] = 0x0C;
+        writeROM(0x01DB, ROM_INST, 0xC2);
+        writeROM(0x01DB, ROM_DATA, 0x0C);
 
-        _ROM[0x01DC][ROM_INST] = 0x02;
-        _ROM[0x01DC][ROM_DATA] = 0x00;
+        writeROM(0x01DC, ROM_INST, 0x02);
+        writeROM(0x01DC, ROM_DATA, 0x00);
 
-        _ROM[0x01DD][ROM_INST] = 0x02;
-        _ROM[0x01DD][ROM_DATA] = 0x00;
+        writeROM(0x01DD, ROM_INST, 0x02);
+        writeROM(0x01DD, ROM_DATA, 0x00);
 
-        _ROM[0x01DE][ROM_INST] = 0x02;
-        _ROM[0x01DE][ROM_DATA] = 0x00;
+        writeROM(0x01DE, ROM_INST, 0x02);
+        writeROM(0x01DE, ROM_DATA, 0x00);
     }
 
     void patchTitleIntoRom(const std::string& title)
     {
         int minLength = std::min(int(title.size()), MAX_TITLE_CHARS);
-        for(int i=0; i<minLength; i++) _ROM[ROM_TITLE_ADDRESS + i][ROM_DATA] = title[i];
-        for(int i=minLength; i<MAX_TITLE_CHARS; i++) _ROM[ROM_TITLE_ADDRESS + i][ROM_DATA] = ' ';
+        for(int i=0; i<minLength; i++) writeROM(ROM_TITLE_ADDRESS + i, ROM_DATA, title[i]);
+        for(int i=minLength; i<MAX_TITLE_CHARS; i++) writeROM(ROM_TITLE_ADDRESS + i, ROM_DATA, ' ');
     }
 
     char filebuffer[RAM_SIZE_HI];
@@ -224,7 +214,7 @@ namespace Cpu
             fprintf(stderr, "Cpu::patchSplitGt1IntoRom() : failed to read %s ROM file.\n", std::string(splitGt1path + "_ti").c_str());
             return false;
         }
-        for(int i=0; i<filelength; i++) _ROM[startAddress + i][ROM_INST] = filebuffer[i];
+        for(int i=0; i<filelength; i++) writeROM(startAddress + i, ROM_INST, filebuffer[i]);
 
         // Data ROM
         std::ifstream romfile_td(splitGt1path + "_td", std::ios::binary | std::ios::in);
@@ -245,61 +235,69 @@ namespace Cpu
             fprintf(stderr, "Cpu::patchSplitGt1IntoRom() : failed to read %s ROM file.\n", std::string(splitGt1path + "_td").c_str());
             return false;
         }
-        for(int i=0; i<filelength; i++) _ROM[startAddress + i][ROM_DATA] = filebuffer[i];
+        for(int i=0; i<filelength; i++) writeROM(startAddress + i, ROM_DATA, filebuffer[i]);
 
         // Replace internal gt1 menu option with split gt1
-        _ROM[_internalGt1s[gt1Id]._patch + 0][ROM_DATA] = LO_BYTE(startAddress);
-        _ROM[_internalGt1s[gt1Id]._patch + 1][ROM_DATA] = HI_BYTE(startAddress);
+        writeROM(_internalGt1s[gt1Id]._patch + 0, ROM_DATA, LO_BYTE(startAddress));
+        writeROM(_internalGt1s[gt1Id]._patch + 1, ROM_DATA, HI_BYTE(startAddress));
 
         // Replace internal gt1 menu option name with split gt1 name
         int minLength = std::min(uint8_t(splitGt1name.size()), _internalGt1s[gt1Id]._length);
-        for(int i=0; i<minLength; i++) _ROM[_internalGt1s[gt1Id]._string + i][ROM_DATA] = splitGt1name[i];
-        for(int i=minLength; i<_internalGt1s[gt1Id]._length; i++) _ROM[_internalGt1s[gt1Id]._string + i][ROM_DATA] = ' ';
+        for(int i=0; i<minLength; i++) writeROM(_internalGt1s[gt1Id]._string + i, ROM_DATA, splitGt1name[i]);
+        for(int i=minLength; i<_internalGt1s[gt1Id]._length; i++) writeROM(_internalGt1s[gt1Id]._string + i, ROM_DATA, ' ');
 
         return true;
     }
 
 
 #ifndef STAND_ALONE
-    int _vgaX = 0, _vgaY = 0;
-    int _hSync = 0, _vSync = 0;
-    int64_t _clockStall = CLOCK_RESET;
-    int64_t _clock = CLOCK_RESET;
-    uint8_t _IN = 0xFF, _XOUT = 0x00;
-    uint16_t _vPC = 0x0200;
-    State _stateS, _stateT;
-
-    bool getIsInReset(void) {return _isInReset;}
-    State& getStateS(void) {return _stateS;}
-    State& getStateT(void) {return _stateT;}
-    int64_t getClock(void) {return _clock;}
-    uint8_t getIN(void) {return _IN;}
-    uint8_t getXOUT(void) {return _XOUT;}
-    uint16_t getVPC(void) {return _vPC;}
-    uint8_t getRAM(uint16_t address) {return _RAM[address & (Memory::getSizeRAM()-1)];}
-    uint8_t getROM(uint16_t address, int page) {return _ROM[address & (ROM_SIZE-1)][page & 0x01];}
-    uint16_t getRAM16(uint16_t address) {return _RAM[address & (Memory::getSizeRAM()-1)] | (_RAM[(address+1) & (Memory::getSizeRAM()-1)]<<8);}
-    uint16_t getROM16(uint16_t address, int page) {return _ROM[address & (ROM_SIZE-1)][page & 0x01] | (_ROM[(address+1) & (ROM_SIZE-1)][page & 0x01]<<8);}
-    float getvCpuUtilisation(void) {return _vCpuUtilisation;}
-
-
-    void setIsInReset(bool isInReset) {_isInReset = isInReset;}
-    void setClock(int64_t clock) {_clock = clock;}
-    void setIN(uint8_t in) {_IN = in;}
-    void setXOUT(uint8_t xout) {_XOUT = xout;}
+    bool getHeadless(void) {return _machine->_headless;}
+    bool getExitVpcReached(void) {return _machine->_exitVpcReached;}
+    uint64_t getFrameCount(void) {return _machine->_frameCount;}
+    int64_t getExitFrames(void) {return _machine->_exitFrames;}
+    int64_t getExitClocks(void) {return _machine->_exitClocks;}
+    bool getIsInReset(void) {return _machine->_isInReset;}
+    State& getStateS(void) {return _machine->_stateS;}
+    State& getStateT(void) {return _machine->_stateT;}
+    int64_t getClock(void) {return _machine->_clock;}
+    uint8_t getIN(void) {return _machine->_IN;}
+    uint8_t getXOUT(void) {return _machine->_XOUT;}
+    uint16_t getVPC(void) {return _machine->_vPC;}
+    uint8_t* getPtrToRAM(int& ramSize) {ramSize = _machine->_sizeRAM; return _machine->_RAM;}
+    uint8_t getRAM(uint16_t address) {return _machine->_RAM[address & (_machine->_sizeRAM-1)];}
+    uint8_t getROM(uint16_t address, int page) {return _machine->_ROM[address & (ROM_SIZE-1)][page & 0x01];}
+    uint16_t getRAM16(uint16_t address) {return getRAM(address) | (getRAM(address+1) <<8);}
+    uint16_t getROM16(uint16_t address, int page) {return getROM(address, page) | (getROM(address+1, page) <<8);}
+    float getvCpuUtilisation(void) {return _machine->_vCpuUtilisation;}
+    bool getDebugging(void) {return _debugging;}
+    bool getExitRequested(void) {return _exitRequested;}
+
+
+    void setHeadless(bool headless) {_machine->_headless = headless;}
+    void setExitFrames(int64_t frames) {_machine->_exitFrames = frames;}
+    void setExitClocks(int64_t clocks) {_machine->_exitClocks = clocks;}
+    void setExitVpc(int32_t vPC) {_machine->_exitVpc = vPC;}
+    void setIsInReset(bool isInReset) {_machine->_isInReset = isInReset;}
+    void setClock(int64_t clock) {_machine->_clock = clock;}
+    void setIN(uint8_t in) {_machine->_IN = in;}
+    void setXOUT(uint8_t xout) {_machine->_XOUT = xout;}
+    void setDebugging(bool debugging) {_debugging = debugging;}
+    void setExitRequested(bool exitRequested) {_exitRequested = exitRequested;}
+    void setSeed(uint32_t seed) {_seed = seed; _seedSet = true;}
 
     void setRAM(uint16_t address, uint8_t data)
     {
         // Constant "0" and "1" are stored here
         if(address == ZERO_CONST_ADDRESS  ||  address == ONE_CONST_ADDRESS) return;
 
-        _RAM[address & (Memory::getSizeRAM()-1)] = data;
+        _machine->_RAM[address & (_machine->_sizeRAM-1)] = data;
+        Gigatron::markDirty(*_machine, address & (_machine->_sizeRAM-1));
     }
 
     void setROM(uint16_t base, uint16_t address, uint8_t data)
     {
         uint16_t offset = (address - base) / 2;
-        _ROM[base + offset][address & 0x01] = data;
+        writeROM(base + offset, address & 0x01, data);
     }
 
     void setRAM16(uint16_t address, uint16_t data)
@@ -308,35 +306,38 @@ namespace Cpu
         if(address == 0x0000) return;
         if(address == 0x0080) return;
 
-        _RAM[address & (Memory::getSizeRAM()-1)] = uint8_t(LO_BYTE(data));
-        _RAM[(address+1) & (Memory::getSizeRAM()-1)] = uint8_t(HI_BYTE(data));
+        _machine->_RAM[address & (_machine->_sizeRAM-1)] = uint8_t(LO_BYTE(data));
+        _machine->_RAM[(address+1) & (_machine->_sizeRAM-1)] = uint8_t(HI_BYTE(data));
+        Gigatron::markDirty(*_machine, address & (_machine->_sizeRAM-1));
+        Gigatron::markDirty(*_machine, (address+1) & (_machine->_sizeRAM-1));
     }
 
     void setROM16(uint16_t base, uint16_t address, uint16_t data)
     {
         uint16_t offset = (address - base) / 2;
-        _ROM[base + offset][address & 0x01] = uint8_t(LO_BYTE(data));
-        _ROM[base + offset][(address+1) & 0x01] = uint8_t(HI_BYTE(data));
+        writeROM(base + offset, address & 0x01, uint8_t(LO_BYTE(data)));
+        writeROM(base + offset, (address+1) & 0x01, uint8_t(HI_BYTE(data)));
     }
 
     void setRomType(void)
     {
-        if(!_checkRomType) return;
-        _checkRomType = false;
+        Gigatron::Machine& m = *_machine;
+        if(!m._checkRomType) return;
+        m._checkRomType = false;
 
         uint8_t romType = getRAM(ROM_TYPE) & ROM_TYPE_MASK;
         switch((RomType)romType)
         {
             case ROMv1:
             {
-                _romType = (RomType)romType;
+                m._romType = (RomType)romType;
 
                 // Patches SYS_Exec_88 loader to accept page0 segments as the first segment and works with 64KB SRAM hardware
                 patchSYS_Exec_88();
 
                 saveScanlineModes();
                 setRAM(VIDEO_MODE_D, 0xF3);
-                _scanlineMode = ScanlineMode::Normal;
+                m._scanlineMode = ScanlineMode::Normal;
             }
             break;
 
@@ -345,7 +346,7 @@ namespace Cpu
             case ROMv4:  
             case DEVROM: 
             {
-                _romType = (RomType)romType;
+                m._romType = (RomType)romType;
                 setRAM(VIDEO_MODE_D, 0xEC);
                 setRAM(VIDEO_MODE_B, 0x0A);
                 setRAM(VIDEO_MODE_C, 0x0A);
@@ -360,32 +361,38 @@ namespace Cpu
             }
             break;
         }
-        //fprintf(stderr, "Cpu::setRomType() : ROM Type = 0x%02x\n", _romType);
+        //fprintf(stderr, "Cpu::setRomType() : ROM Type = 0x%02x\n", m._romType);
     }
 
     void saveScanlineModes(void)
     {
+        // Only the first save is ever restored
+        Gigatron::Machine& m = *_machine;
+        if(m._scanlinesRom0.size()) return;
+
         for(int i=0x01C2; i<=0x01DE; i++)
         {
-            _scanlinesRom0.push_back(_ROM[i][ROM_INST]);
-            _scanlinesRom1.push_back(_ROM[i][ROM_DATA]);
+            m._scanlinesRom0.push_back(m._ROM[i][ROM_INST]);
+            m._scanlinesRom1.push_back(m._ROM[i][ROM_DATA]);
         }
     }
 
     void restoreScanlineModes(void)
     {
+        Gigatron::Machine& m = *_machine;
         for(int i=0x01C2; i<=0x01DE; i++)
         {
-            _ROM[i][ROM_INST] = _scanlinesRom0[i - 0x01C2];
-            _ROM[i][ROM_DATA] = _scanlinesRom1[i - 0x01C2];
+            writeROM(i, ROM_INST, m._scanlinesRom0[i - 0x01C2]);
+            writeROM(i, ROM_DATA, m._scanlinesRom1[i - 0x01C2]);
         }
     }
 
     void swapScanlineMode(void)
     {
-        if(++_scanlineMode == ScanlineMode::NumScanlineModes-1) _scanlineMode = ScanlineMode::Normal;
+        int& scanlineMode = _machine->_scanlineMode;
+        if(++scanlineMode == ScanlineMode::NumScanlineModes-1) scanlineMode = ScanlineMode::Normal;
 
-        switch(_scanlineMode)
+        switch(scanlineMode)
         {
             case Normal:  restoreScanlineModes();                               break;
             case VideoB:  patchScanlineModeVideoB();                            break;
@@ -394,9 +401,26 @@ namespace Cpu
         }
     }
 
-    void garble(uint8_t* mem, int len)
+    void seedRandom(uint32_t seed)
     {
-        for(int i=0; i<len; i++) mem[i] = rand();
+        // Spread small seeds across the state, xorshift32 must never be zero
+        _machine->_random = (seed ^ 0x5EED5EED) * 0x9E3779B1;
+        if(_machine->_random == 0) _machine->_random = 1;
+    }
+
+    uint8_t nextRandom(Gigatron::Machine& m)
+    {
+        uint32_t x = m._random;
+        x ^= x <<13;
+        x ^= x >>17;
+        x ^= x <<5;
+        m._random = x;
+        return uint8_t(x >>24);
+    }
+
+    void garble(Gigatron::Machine& m, uint8_t* mem, int len)
+    {
+        for(int i=0; i<len; i++) mem[i] = nextRandom(m);
     }
 
     void createRomHeader(const uint8_t* rom, const std::string& filename, const std::string& name, int length)
@@ -429,16 +453,16 @@ namespace Cpu
 
     void loadRom(int index)
     {
-        _romIndex = index % _numRoms;
-        memcpy(_ROM, _romFiles[_romIndex], sizeof _ROM);
+        Gigatron::Machine& m = *_machine;
+        m._romIndex = index % _numRoms;
+        memcpy(m._ROM, _romFiles[m._romIndex], sizeof m._ROM);
+        Hle::detectRom();
         reset(true);
     }
 
     void swapRom(void)
     {
-        _romIndex = (_romIndex + 1) % _numRoms;
-        memcpy(_ROM, _romFiles[_romIndex], sizeof _ROM);
-        reset(true);
+        loadRom(_machine->_romIndex + 1);
     }
 
 
@@ -475,13 +499,14 @@ namespace Cpu
         setbuf(stdout, NULL);
 #endif    
 
-        _RAM.resize(Memory::getSizeRAM());
+        Gigatron::Machine& m = *_machine;
 
         // Memory
-        srand((unsigned int)time(NULL)); // Initialize with randomized data
-        garble((uint8_t*)_ROM, sizeof _ROM);
-        garble(&_RAM[0], Memory::getSizeRAM());
-        garble((uint8_t*)&_stateS, sizeof _stateS);
+        seedRandom((_seedSet) ? _seed : uint32_t(time(NULL))); // Initialize with randomized data
+        garble(m, (uint8_t*)m._ROM, sizeof m._ROM);
+        garble(m, m._RAM, sizeof m._RAM);
+        setMemoryModel(m, Memory::getSizeRAM());
+        garble(m, (uint8_t*)&m._stateS, sizeof m._stateS);
 
         // Internal ROMS
         _romFiles.push_back(_gigatron_0x1c_rom);
@@ -506,7 +531,7 @@ namespace Cpu
             else
             {
                 // Load ROM file
-                uint8_t* rom = new uint8_t[sizeof _ROM];
+                uint8_t* rom = new uint8_t[ROM_SIZE*2];
                 if(!rom)
                 {
                     // This is fairly pointless as the code does not have any exception handling for the many std:: memory allocations that occur
@@ -516,7 +541,7 @@ namespace Cpu
                     _EXIT_(EXIT_FAILURE);
                 }
 
-                file.read((char *)rom, sizeof _ROM);
+                file.read((char *)rom, ROM_SIZE*2);
                 if(file.bad() || file.fail())
                 {
                     fprintf(stderr, "Cpu::initialise() : failed to read ROM file : %s\n", name.c_str());
@@ -531,13 +556,14 @@ namespace Cpu
 
         // Switchable ROMS
         _numRoms = int(_romFiles.size());
-        _romIndex = _numRoms - 1;
-        memcpy(_ROM, _romFiles[_romIndex], sizeof _ROM);
+        m._romIndex = _numRoms - 1;
+        memcpy(m._ROM, _romFiles[m._romIndex], sizeof m._ROM);
+        Hle::detectRom();
 
 //#define CREATE_ROM_HEADER
 #ifdef CREATE_ROM_HEADER
         // Create a header file representation of a ROM, (match the ROM type number with the ROM file before enabling and running this code)
-        createRomHeader((uint8_t *)_ROM, "gigatron_xxxx.h", "_gigatron_xxxx_rom", sizeof _ROM);
+        createRomHeader((uint8_t *)m._ROM, "gigatron_xxxx.h", "_gigatron_xxxx_rom", sizeof m._ROM);
 #endif
 
 //#define CUSTOM_ROM
@@ -560,22 +586,134 @@ namespace Cpu
 #endif
 #endif
 
-        // SDL initialisation
+        // SDL initialisation, headless mode never touches video or audio
+        if(m._headless) return;
         if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_EVENTS) < 0)
         {
             fprintf(stderr, "Cpu::initialise() : failed to initialise SDL.\n");
             _EXIT_(EXIT_FAILURE);
         }
+
+        addHook(FrameHook, vCpuUsageHook);
+    }
+
+    // Every opcode is a separate template instantiation, ins, mod and bus are compile time constants so the
+    // decoder, the data bus select and the destination register all fold away, leaving only the work that opcode does
+    template<int RAM_SIZE, uint8_t IR> void execute(Gigatron::Machine& m, const State& S, State& T)
+    {
+        const int ins = IR >> 5;       // Instruction
+        const int mod = (IR >> 2) & 7; // Addressing mode (or condition)
+        const int bus = IR & 3;        // Busmode
+        const bool W = (ins == 6);     // Write instruction?
+        const bool J = (ins == 7);     // Jump instruction?
+
+        uint8_t lo = (J || (mod != 1  &&  mod != 3  &&  mod != 7)) ? S._D : S._X;
+        uint8_t hi = (J || (mod != 2  &&  mod != 3  &&  mod != 7)) ? 0 : S._Y;
+        uint16_t addr = (hi << 8) | lo;
+
+        uint8_t B = S._undef; // Data Bus
+        switch(bus)
+        {
+            case 0: B = S._D;                                               break;
+            case 1: if(!W) B = m._RAM[addr & (RAM_SIZE-1)];                break;
+            case 2: B = S._AC;                                              break;
+            case 3: B = m._IN;                                              break;
+        }
+
+        if(W)
+        {
+            m._RAM[addr & (RAM_SIZE-1)] = B; // Random Access Memory
+            Gigatron::markDirty(m, addr & (RAM_SIZE-1));
+        }
+
+        uint8_t ALU = 0; // Arithmetic and Logic Unit
+        switch(ins)
+        {
+            case 0: ALU =         B; break; // LD
+            case 1: ALU = S._AC & B; break; // ANDA
+            case 2: ALU = S._AC | B; break; // ORA
+            case 3: ALU = S._AC ^ B; break; // XORA
+            case 4: ALU = S._AC + B; break; // ADDA
+            case 5: ALU = S._AC - B; break; // SUBA
+            case 6: ALU = S._AC;     break; // ST
+            case 7: ALU = -S._AC;    break; // Bcc/JMP
+        }
+
+        T._PC = S._PC + 1; // Next instruction
+        if(J)
+        {
+            if(mod != 0) // Conditional branch within page
+            {
+                int cond = (S._AC>>7) + 2*(S._AC==0);
+                if(mod & (1 << cond)) T._PC = (S._PC & 0xff00) | B; // 74153
+            }
+            else
+            {
+                T._PC = (S._Y << 8) | B; // Unconditional far jump
+            }
+
+            return;
+        }
+
+        // Load value into register, _AC and _OUT loading is disabled during _RAM write
+        switch(mod)
+        {
+            case 0: case 1: case 2: case 3: if(!W) T._AC = ALU;            break;
+            case 4:                         T._X = ALU;                    break;
+            case 5:                         T._Y = ALU;                    break;
+            case 6:                         if(!W) T._OUT = ALU;           break;
+            case 7:                         if(!W) T._OUT = ALU; T._X++;   break;
+        }
+    }
+
+    using Gigatron::OpcodeHandler;
+
+    template<int RAM_SIZE, size_t... IR> constexpr std::array<OpcodeHandler, 256> makeOpcodeTable(std::index_sequence<IR...>)
+    {
+        return {{&execute<RAM_SIZE, uint8_t(IR)>...}};
+    }
+
+    // One table per memory model, the RAM mask is a constant in every handler
+    const std::array<OpcodeHandler, 256> _opcodeTableLo = makeOpcodeTable<RAM_SIZE_LO>(std::make_index_sequence<256>());
+    const std::array<OpcodeHandler, 256> _opcodeTableHi = makeOpcodeTable<RAM_SIZE_HI>(std::make_index_sequence<256>());
+
+    // Switches a machine's memory model, which selects the opcode handlers for that size
+    void setMemoryModel(Gigatron::Machine& m, int sizeRAM)
+    {
+        // Expansion RAM powers up empty
+        if(sizeRAM > m._sizeRAM) memset(&m._RAM[m._sizeRAM], 0, sizeRAM - m._sizeRAM);
+
+        m._sizeRAM = sizeRAM;
+        m._opcodeTable = (sizeRAM == RAM_SIZE_HI) ? &_opcodeTableHi[0] : &_opcodeTableLo[0];
+    }
+
+    inline void cycle(Gigatron::Machine& m, const State& S, State& T)
+    {
+        // New state is old state unless something changes
+        T = S;
+    
+        // Instruction Fetch
+        T._IR = m._ROM[S._PC][ROM_INST]; 
+        T._D  = m._ROM[S._PC][ROM_DATA];
+
+        // Execute, no decode at run time
+        m._opcodeTable[S._IR](m, S, T);
     }
 
     void cycle(const State& S, State& T)
+    {
+        cycle(*_machine, S, T);
+    }
+
+    // Reference decoder, used by benchmark() to measure and verify the opcode table
+    template<int RAM_SIZE> void cycleDecode(Gigatron::Machine& m, const State& S, State& T)
     {
         // New state is old state unless something changes
         T = S;
     
         // Instruction Fetch
-        T._IR = _ROM[S._PC][ROM_INST]; 
-        T._D  = _ROM[S._PC][ROM_DATA];
+        T._IR = m._ROM[S._PC][ROM_INST]; 
+        T._D  = m._ROM[S._PC][ROM_DATA];
 
         // Adapted from https://github.com/kervinck/gigatron-rom/blob/master/Contrib/dhkolf/libgtemu/gtemu.c
         // Optimise for the statistically most common instructions
@@ -584,7 +722,7 @@ namespace Cpu
             case 0x5D: // ora [Y,X++],OUT
             {
                 uint16_t addr = MAKE_ADDR(S._Y, S._X);
-                T._OUT = _RAM[addr & (Memory::getSizeRAM()-1)] | S._AC;
+                T._OUT = m._RAM[addr & (RAM_SIZE-1)] | S._AC;
                 T._X++;
                 T._PC = S._PC + 1;
                 return;
@@ -593,7 +731,8 @@ namespace Cpu
 
             case 0xC2: // st [D]
             {
-                _RAM[S._D & (Memory::getSizeRAM()-1)] = S._AC;
+                m._RAM[S._D & (RAM_SIZE-1)] = S._AC;
+                Gigatron::markDirty(m, S._D & (RAM_SIZE-1));
                 T._PC = S._PC + 1;
                 return;
             }
@@ -601,7 +740,7 @@ namespace Cpu
 
             case 0x01: // ld [D]
             {
-                T._AC = _RAM[S._D & (Memory::getSizeRAM()-1)];
+                T._AC = m._RAM[S._D & (RAM_SIZE-1)];
                 T._PC = S._PC + 1;
                 return;
             }
@@ -634,7 +773,7 @@ namespace Cpu
             case 0x0D: // ld [Y,X]
             {
                 uint16_t addr = MAKE_ADDR(S._Y, S._X);
-                T._AC = _RAM[addr & (Memory::getSizeRAM()-1)];
+                T._AC = m._RAM[addr & (RAM_SIZE-1)];
                 T._PC = S._PC + 1;
                 return;
             }
@@ -657,7 +796,7 @@ namespace Cpu
 
             case 0x81: // adda [D]
             {
-                T._AC += _RAM[S._D & (Memory::getSizeRAM()-1)];
+                T._AC += m._RAM[S._D & (RAM_SIZE-1)];
                 T._PC = S._PC + 1;
                 return;
             }
@@ -666,7 +805,7 @@ namespace Cpu
             case 0x89: // adda [Y,D]
             {
                 uint16_t addr = MAKE_ADDR(S._Y, S._D);
-                T._AC += _RAM[addr & (Memory::getSizeRAM()-1)];
+                T._AC += m._RAM[addr & (RAM_SIZE-1)];
                 T._PC = S._PC + 1;
                 return;
             }
@@ -719,12 +858,16 @@ namespace Cpu
         switch(bus)
         {
             case 0: B=S._D;                                            break;
-            case 1: if (!W) B = _RAM[addr & (Memory::getSizeRAM()-1)]; break;
+            case 1: if (!W) B = m._RAM[addr & (RAM_SIZE-1)]; break;
             case 2: B=S._AC;                                           break;
-            case 3: B=_IN;                                             break;
+            case 3: B=m._IN;                                             break;
         }
 
-        if(W) _RAM[addr & (Memory::getSizeRAM()-1)] = B; // Random Access Memory
+        if(W)
+        {
+            m._RAM[addr & (RAM_SIZE-1)] = B; // Random Access Memory
+            Gigatron::markDirty(m, addr & (RAM_SIZE-1));
+        }
 
         uint8_t ALU = 0; // Arithmetic and Logic Unit
         switch(ins)
@@ -760,9 +903,103 @@ namespace Cpu
         }
     }
 
+    // Cycle function is a template parameter so both decoders are inlined into the benchmark loop
+    template<void (*CYCLE)(Gigatron::Machine& m, const State& S, State& T)> double benchmarkClocks(Gigatron::Machine& m, int64_t clocks, State& S)
+    {
+        State T = S;
+        uint64_t startCounter = SDL_GetPerformanceCounter();
+        for(int64_t c=0; c<clocks; c++)
+        {
+            CYCLE(m, S, T);
+            S = T;
+        }
+        double elapsed = double(SDL_GetPerformanceCounter() - startCounter) / double(SDL_GetPerformanceFrequency());
+
+        return double(clocks) / elapsed / 1.0e6;
+    }
+
+    void benchmarkHook(void)
+    {
+    }
+
+    // Runs the whole of process() on the current ROM, with the exit conditions replaced by a clock count
+    double benchmarkProcess(Gigatron::Machine& m, int64_t clocks)
+    {
+        int64_t exitFrames = m._exitFrames, exitClocks = m._exitClocks;
+        int32_t exitVpc = m._exitVpc;
+        m._exitFrames = -1, m._exitVpc = -1;
+        m._exitClocks = m._clock + clocks;
+
+        uint64_t startCounter = SDL_GetPerformanceCounter();
+        while(process());
+        double elapsed = double(SDL_GetPerformanceCounter() - startCounter) / double(SDL_GetPerformanceFrequency());
+
+        m._exitFrames = exitFrames, m._exitClocks = exitClocks, m._exitVpc = exitVpc;
+
+        return double(clocks) / elapsed / 1.0e6;
+    }
+
+    // Runs every internal ROM for the same number of clocks through the reference decoder and through the opcode table,
+    // reports emulated MHz for both and verifies they finish in lockstep, (same state and same RAM), then times
+    // process() with every hook trigger idle against an empty hook registered on every trigger
+    bool benchmark(int64_t clocks)
+    {
+        std::string names[NUM_INT_ROMS] = {"ROMv1", "ROMv2", "ROMv3", "ROMv4"};
+
+        Gigatron::Machine& m = *_machine;
+        bool lockstep = true;
+        for(int i=0; i<NUM_INT_ROMS; i++)
+        {
+            double mhz[2];
+            uint32_t hash[2];
+            for(int j=0; j<2; j++)
+            {
+                memcpy(m._ROM, _romFiles[i], sizeof m._ROM);
+                Hle::detectRom();
+                seedRandom(0x5EED);
+                garble(m, m._RAM, m._sizeRAM);
+                m._IN = 0xFF;
+
+                State S = {0};
+                if(m._sizeRAM == RAM_SIZE_HI)
+                {
+                    mhz[j] = (j == 0) ? benchmarkClocks<cycleDecode<RAM_SIZE_HI>>(m, clocks, S) : benchmarkClocks<cycle>(m, clocks, S);
+                }
+                else
+                {
+                    mhz[j] = (j == 0) ? benchmarkClocks<cycleDecode<RAM_SIZE_LO>>(m, clocks, S) : benchmarkClocks<cycle>(m, clocks, S);
+                }
+
+                // FNV-1a of RAM and CPU state
+                hash[j] = 2166136261u;
+                uint8_t regs[] = {uint8_t(S._PC), uint8_t(S._PC >>8), S._IR, S._D, S._AC, S._X, S._Y, S._OUT};
+                for(int k=0; k<int(sizeof regs); k++) hash[j] = (hash[j] ^ regs[k]) * 16777619u;
+                for(int k=0; k<m._sizeRAM; k++) hash[j] = (hash[j] ^ m._RAM[k]) * 16777619u;
+            }
+
+            if(hash[0] != hash[1]) lockstep = false;
+            std::string result = (hash[0] == hash[1]) ? "lockstep" : "MISMATCH";
+            fprintf(stderr, "Cpu::benchmark() : %s : %" PRId64 " clocks : decoder %0.2fMHz : opcode table %0.2fMHz : %0.2fx : %s\n", names[i].c_str(), clocks, mhz[0], mhz[1], mhz[1]/mhz[0], result.c_str());
+        }
+
+        loadRom(m._romIndex);
+
+        double mhz[2];
+        for(int j=0; j<2; j++)
+        {
+            for(int k=0; k<NumHookTriggers; k++) setHook(HookTrigger(k), benchmarkHook, j == 1);
+            mhz[j] = benchmarkProcess(m, clocks);
+        }
+        for(int k=0; k<NumHookTriggers; k++) removeHook(HookTrigger(k), benchmarkHook);
+        fprintf(stderr, "Cpu::benchmark() : process() : %" PRId64 " clocks : hooks idle %0.2fMHz : hooks registered %0.2fMHz : %0.2fx\n", clocks, mhz[0], mhz[1], mhz[0]/mhz[1]);
+
+        return lockstep;
+    }
+
     void reset(bool coldBoot)
     {
-        _checkRomType = true;
+        Gigatron::Machine& m = *_machine;
+        m._checkRomType = true;
 
         // Cold boot
         if(coldBoot)
@@ -771,10 +1008,13 @@ namespace Cpu
             //setRAM(BOOT_CHECK, 0xA6);
         }
 
-        Graphics::resetVTable();
+        if(!m._headless)
+        {
+            Graphics::resetVTable();
+            Editor::setSingleStepAddress(VIDEO_Y_ADDRESS);
+        }
         setRAM(ZERO_CONST_ADDRESS, 0x00);
         setRAM(ONE_CONST_ADDRESS, 0x01);
-        Editor::setSingleStepAddress(VIDEO_Y_ADDRESS);
         setClock(CLOCK_RESET);
     }
 
@@ -783,176 +1023,291 @@ namespace Cpu
         Loader::setCurrentGame(std::string(""));
     }
 
-    void swapMemoryModel(void)
+    void setSizeRAM(int sizeRAM)
     {
-        (Memory::getSizeRAM() == RAM_SIZE_LO) ? Memory::setSizeRAM(RAM_SIZE_HI) : Memory::setSizeRAM(RAM_SIZE_LO);
-        _RAM.resize(Memory::getSizeRAM());
+        setMemoryModel(*_machine, sizeRAM);
+
+        // The memory allocator belongs to the main machine
+        if(_machine != &_mainMachine) return;
+        Memory::setSizeRAM(sizeRAM);
         Memory::intitialise();
+    }
+
+    void swapMemoryModel(void)
+    {
+        setSizeRAM((_machine->_sizeRAM == RAM_SIZE_LO) ? RAM_SIZE_HI : RAM_SIZE_LO);
         reset(false);
     }
 
+    // Creates a headless machine cold booted on ROM romIndex and binds it to the calling thread, which must be the only
+    // thread that runs it, RAM and the CPU state are garbled the same way as the main machine's, from seed, so the same
+    // job always produces the same run
+    Gigatron::Machine* createMachine(int romIndex, int sizeRAM, uint32_t seed)
+    {
+        Gigatron::Machine* machine = new Gigatron::Machine;
+        machine->_headless = true;
+
+        _machine = machine; // loadRom() re-detects the HLE interpreter
+        seedRandom(seed);
+        garble(*machine, machine->_RAM, sizeof machine->_RAM);
+        garble(*machine, (uint8_t*)&machine->_stateS, sizeof machine->_stateS);
+        setMemoryModel(*machine, sizeRAM);
+
+        loadRom(romIndex);
+
+        return machine;
+    }
+
+    void destroyMachine(Gigatron::Machine* machine)
+    {
+        if(machine == &_mainMachine) return;
+        if(_machine == machine) setMachine(&_mainMachine);
+        delete machine;
+    }
+
     // Counts maximum and used vCPU instruction slots available per frame
+    void addHook(HookTrigger trigger, HookFunction hook)
+    {
+        std::vector<HookFunction>& hooks = _machine->_hooks[trigger];
+        if(std::find(hooks.begin(), hooks.end(), hook) == hooks.end()) hooks.push_back(hook);
+    }
+
+    void removeHook(HookTrigger trigger, HookFunction hook)
+    {
+        std::vector<HookFunction>& hooks = _machine->_hooks[trigger];
+        auto it = std::find(hooks.begin(), hooks.end(), hook);
+        if(it != hooks.end()) hooks.erase(it);
+    }
+
+    void setHook(HookTrigger trigger, HookFunction hook, bool enable)
+    {
+        (enable) ? addHook(trigger, hook) : removeHook(trigger, hook);
+    }
+
+    // A hook may remove itself, the hook that moves into its slot then waits for the next trigger
+    void runHooks(Gigatron::Machine& m, HookTrigger trigger)
+    {
+        std::vector<HookFunction>& hooks = m._hooks[trigger];
+        for(size_t i=0; i<hooks.size(); i++) hooks[i]();
+    }
+
+    void vCpuDispatch(uint16_t vPC)
+    {
+        Gigatron::Machine& m = *_machine;
+        m._vPC = vPC;
+
+        // Headless exit address
+        if(m._vPC == m._exitVpc  &&  !m._isInReset) m._exitVpcReached = true;
+
+        if(!m._hooks[DispatchHook].empty()) runHooks(m, DispatchHook);
+        if(m._headless) return;
+
+        if(m._vPC < Editor::getCpuUsageAddressA()  ||  m._vPC > Editor::getCpuUsageAddressB()) m._vCpuInstPerFrame++;
+        m._vCpuInstPerFrameMax++;
+
+        // Soft reset
+        if(m._vPC == 0x01F0) softReset();
+    }
+
+    // Frame hook, vCPU utilisation is measured per emulated frame
+    void vCpuUsageHook(void)
+    {
+        Gigatron::Machine& m = *_machine;
+
+        // TODO: this is a bit of a hack, but it's emulation only so...
+        // Check for magic cookie that defines a CpuUsageAddressA and CpuUsageAddressB sequence
+        uint16_t magicWord0 = (getRAM(0x7F99) <<8) | getRAM(0x7F98);
+        uint16_t magicWord1 = (getRAM(0x7F9B) <<8) | getRAM(0x7F9A);
+        uint16_t cpuUsageAddressA = (getRAM(0x7F9D) <<8) | getRAM(0x7F9C);
+        uint16_t cpuUsageAddressB = (getRAM(0x7F9F) <<8) | getRAM(0x7F9E);
+        if(magicWord0 == 0xDEAD  &&  magicWord1 == 0xBEEF)
+        {
+            Editor::setCpuUsageAddressA(cpuUsageAddressA);
+            Editor::setCpuUsageAddressB(cpuUsageAddressB);
+        }
+
+        m._vCpuUtilisation = (m._vCpuInstPerFrameMax) ? float(m._vCpuInstPerFrame) / float(m._vCpuInstPerFrameMax) : 0.0f;
+        m._vCpuInstPerFrame = 0;
+        m._vCpuInstPerFrameMax = 0;
+    }
+
     void vCpuUsage(const State& S, const State& T)
     {
         // All ROM's so far v1 through v4 use the same vCPU dispatch address!
-        if(S._PC == ROM_VCPU_DISPATCH)
-        {
-            _vPC = (getRAM(0x0017) <<8) | getRAM(0x0016);
-            if(_vPC < Editor::getCpuUsageAddressA()  ||  _vPC > Editor::getCpuUsageAddressB()) _vCpuInstPerFrame++;
-            _vCpuInstPerFrameMax++;
-
-            // Soft reset
-            if(_vPC == 0x01F0) softReset();
-
-            static uint64_t prevFrameCounter = 0;
-            double frameTime = double(SDL_GetPerformanceCounter() - prevFrameCounter) / double(SDL_GetPerformanceFrequency());
-            if(frameTime > VSYNC_TIMING_60)
-            {
-                // TODO: this is a bit of a hack, but it's emulation only so...
-                // Check for magic cookie that defines a CpuUsageAddressA and CpuUsageAddressB sequence
-                uint16_t magicWord0 = (getRAM(0x7F99) <<8) | getRAM(0x7F98);
-                uint16_t magicWord1 = (getRAM(0x7F9B) <<8) | getRAM(0x7F9A);
-                uint16_t cpuUsageAddressA = (getRAM(0x7F9D) <<8) | getRAM(0x7F9C);
-                uint16_t cpuUsageAddressB = (getRAM(0x7F9F) <<8) | getRAM(0x7F9E);
-                if(magicWord0 == 0xDEAD  &&  magicWord1 == 0xBEEF)
-                {
-                    Editor::setCpuUsageAddressA(cpuUsageAddressA);
-                    Editor::setCpuUsageAddressB(cpuUsageAddressB);
-                }
+        if(S._PC == ROM_VCPU_DISPATCH) vCpuDispatch((getRAM(0x0017) <<8) | getRAM(0x0016));
+    }
 
-                prevFrameCounter = SDL_GetPerformanceCounter();
-                _vCpuUtilisation = (_vCpuInstPerFrameMax) ? float(_vCpuInstPerFrame) / float(_vCpuInstPerFrameMax) : 0.0f;
-                _vCpuInstPerFrame = 0;
-                _vCpuInstPerFrameMax = 0;
-            }
+    // Headless exit conditions, the main machine only stops when it's window is closed
+    bool processExit(Gigatron::Machine& m)
+    {
+        if(m._headless)
+        {
+            if(m._exitVpcReached) return false;
+            if(m._exitClocks >= 0  &&  m._clock >= m._exitClocks) return false;
+            if(m._exitFrames >= 0  &&  int64_t(m._frameCount) >= m._exitFrames) return false;
         }
+        else if(_exitRequested)
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    // Runs a whole vCPU instruction in C++, the clocks it would have taken natively are accounted for as if they had been
+    // executed, OUT can't change inside the interpreter so the only per clock work left is the pixel output
+    bool hleStep(Gigatron::Machine& m)
+    {
+        uint16_t vPC;
+        int cycles = Hle::vCpuStep(m._stateS, vPC);
+        if(cycles == 0) return false;
+
+        vCpuDispatch(vPC);
+        if(m._romCounts) Profiler::sampleHle(m, vPC, cycles);
+
+        // The pixels covered are a single run of the current OUT
+        int x0 = std::max(m._vgaX + 1 - HPIXELS_START, 0);
+        int x1 = std::min(m._vgaX + cycles + 1 - HPIXELS_START, HPIXELS_END - HPIXELS_START);
+        if(x1 > x0) memset(&m._scanline[x0], m._stateS._OUT, x1 - x0);
+
+        m._vgaX += cycles;
+        m._clock += cycles;
+
+        return true;
     }
 
     bool process(void)
     {
+        Gigatron::Machine& m = *_machine;
+
         // MCP100 Power-On Reset
-        if(_clock < 0)
+        if(m._clock < 0)
         {
-            _stateS._PC = 0; 
-            _initAudio = true;
-            _isInReset = true;
-            Loader::setCurrentGame(std::string(""));
+            m._stateS._PC = 0; 
+            m._isInReset = true;
+            if(!m._headless)
+            {
+                _initAudio = true;
+                Loader::setCurrentGame(std::string(""));
+            }
         }
 
-        // Update CPU
-        cycle(_stateS, _stateT);
+        // vCPU high level emulation, falls through to the native code for anything it doesn't handle, per clock hooks
+        // such as the debugger need every native clock
+        if(m._stateS._PC == VCPU_NEXT_EXEC  &&  Hle::getActive()  &&  !_debugging  &&  m._hooks[CycleHook].empty()  &&  hleStep(m))
+        {
+            return processExit(m);
+        }
+
+        // Update CPU, every fetch is executed so counting fetches counts instructions
+        cycle(m, m._stateS, m._stateT);
+        if(m._romCounts) Profiler::sample(m);
 
         // vCPU instruction slot utilisation
-        vCpuUsage(_stateS, _stateT);
+        vCpuUsage(m._stateS, m._stateT);
 
-        _hSync = (_stateT._OUT & 0x40) - (_stateS._OUT & 0x40);
-        _vSync = (_stateT._OUT & 0x80) - (_stateS._OUT & 0x80);
+        m._hSync = (m._stateT._OUT & 0x40) - (m._stateS._OUT & 0x40);
+        m._vSync = (m._stateT._OUT & 0x80) - (m._stateS._OUT & 0x80);
     
         // Falling vSync edge
-        if(_vSync < 0)
+        bool frameStart = (m._vSync < 0);
+        if(frameStart)
         {
-            _clockStall = _clock;
-            _vgaY = VSYNC_START;
+            m._clockStall = m._clock;
+            m._vgaY = VSYNC_START;
+            m._frameCount++;
+            if(!m._hooks[FrameHook].empty()) runHooks(m, FrameHook);
 
             // Input and graphics
-            if(!_debugging)
+            if(!_debugging  &&  !m._headless)
             {
                 Editor::handleInput();
                 Graphics::render();
             }
         }
 
-        // Pixel
-        if(_vgaX++ < HLINE_END)
-        {
-            if(_vgaY >= 0  &&  _vgaY < SCREEN_HEIGHT  &&  _vgaX >=HPIXELS_START  &&  _vgaX < HPIXELS_END)
-            {
-                Graphics::refreshPixel(_stateS, _vgaX-HPIXELS_START, _vgaY, _debugging);
-            }
-        }
-
-#if defined(COLLECT_INST_STATS)
-        _totalCount++;
-        _instCounts[_stateT._IR]._count++;
-        _instCounts[_stateT._IR]._inst = _stateT._IR;
-        if(_clock > STARTUP_DELAY_CLOCKS * 500.0)
-        {
-            displayInstCounts();
-            _EXIT_(0);
-        }
-#endif        
+        // Pixel, pixel x is at vgaX HPIXELS_START+x once vgaX has been incremented
+        unsigned pixelX = unsigned(m._vgaX++ + 1 - HPIXELS_START);
+        if(pixelX < HPIXELS_END - HPIXELS_START) m._scanline[pixelX] = m._stateS._OUT;
 
         // RomType and Watchdog
-        if(_clock > STARTUP_DELAY_CLOCKS)
+        if(m._clock > STARTUP_DELAY_CLOCKS)
         {
-            if(_isInReset)
+            if(m._isInReset)
             {
                 setRomType();
-                _isInReset = false;
+                m._isInReset = false;
             }
 
-            if(_initAudio  &&  _clock > STARTUP_DELAY_CLOCKS*10.0)
+            if(!m._headless  &&  _initAudio  &&  m._clock > STARTUP_DELAY_CLOCKS*10.0)
             {
                 _initAudio = false;
                 Audio::initialiseChannels();
             }
 
-            if(!_debugging  &&  _clock - _clockStall > CPU_STALL_CLOCKS)
+            if(!_debugging  &&  m._clock - m._clockStall > CPU_STALL_CLOCKS)
             {
-                _clockStall = CLOCK_RESET;
+                m._clockStall = CLOCK_RESET;
                 reset(true);
-                _vgaX = 0, _vgaY = 0;
-                _hSync = 0, _vSync = 0;
-                fprintf(stderr, "main(): CPU stall for %" PRId64 " clocks : rebooting.\n", _clock - _clockStall);
+                m._vgaX = 0, m._vgaY = 0;
+                m._hSync = 0, m._vSync = 0;
+                fprintf(stderr, "main(): CPU stall for %" PRId64 " clocks : rebooting.\n", m._clock - m._clockStall);
             }
         }
 
         // Rising hSync edge
-        if(_hSync > 0)
+        if(m._hSync > 0)
         {
-            setXOUT(_stateT._AC);
+            setXOUT(m._stateT._AC);
         
             // Audio
-            if(Audio::getRealTimeAudio())
+            if(!m._headless)
             {
-                Audio::playSample();
-            }
-            else
-            {
-                Audio::fillAudioBuffer();
-                if(_vgaY == SCREEN_HEIGHT+4) Audio::playAudioBuffer();
+                if(Audio::getRealTimeAudio())
+                {
+                    Audio::playSample();
+                }
+                else
+                {
+                    Audio::fillAudioBuffer();
+                    if(m._vgaY == SCREEN_HEIGHT+4) Audio::playAudioBuffer();
+                }
             }
 
             // Loader
-            Loader::upload(_vgaY);
+            if(!m._hooks[ScanlineHook].empty()) runHooks(m, ScanlineHook);
+
+            // Pixels
+            if(!m._headless  &&  m._vgaY >= 0  &&  m._vgaY < SCREEN_HEIGHT) Graphics::refreshScanline(m._scanline, m._vgaY, _debugging);
 
             // Horizontal timing errors
-            if(_vgaY >= 0  &&  _vgaY < SCREEN_HEIGHT)
+            if(m._vgaY >= 0  &&  m._vgaY < SCREEN_HEIGHT)
             {
-                static uint32_t colour = 0xFF220000;
-                if((_vgaY % 4) == 0) colour = 0xFF220000;
-                if(_vgaX != 200  &&  _vgaX != 400) // Support for 6.25Mhz and 12.5MHz
+                static thread_local uint32_t colour = 0xFF220000;
+                if((m._vgaY % 4) == 0) colour = 0xFF220000;
+                if(m._vgaX != 200  &&  m._vgaX != 400) // Support for 6.25Mhz and 12.5MHz
                 {
                     colour = 0xFFFF0000;
-                    fprintf(stderr, "main(): Horizontal timing error : vgaX %03d : vgaY %03d : xout %02x : time %0.3f\n", _vgaX, _vgaY, _stateT._AC, float(_clock)/float(CLOCK_FREQ));
+                    fprintf(stderr, "main(): Horizontal timing error : vgaX %03d : vgaY %03d : xout %02x : time %0.3f\n", m._vgaX, m._vgaY, m._stateT._AC, float(m._clock)/float(CLOCK_FREQ));
                 }
-                if((_vgaY % 4) == 3) Graphics::refreshTimingPixel(_stateS, GIGA_WIDTH, _vgaY / 4, colour, _debugging);
+                if(!m._headless  &&  (m._vgaY % 4) == 3) Graphics::refreshTimingPixel(m._stateS, GIGA_WIDTH, m._vgaY / 4, colour, _debugging);
             }
 
-            _vgaX = 0;
-            _vgaY++;
+            m._vgaX = 0;
+            m._vgaY++;
 
             // Change this once in a while
-            _stateT._undef = rand() & 0xff;
+            m._stateT._undef = nextRandom(m);
         }
 
-        // Debugger
-        _debugging = Editor::handleDebugger();
+        // Rewind history and debugger, rewinding restores a capture taken at exactly this point
+        if(frameStart  &&  !m._headless) Rewind::capture();
+        if(!m._hooks[CycleHook].empty()) runHooks(m, CycleHook);
 
-        _stateS = _stateT;
-        _clock++;
+        m._stateS = m._stateT;
+        m._clock++;
 
-        return true;
+        return processExit(m);
     }
 
 #endif
@@ -48,12 +48,23 @@
 #endif
 
 
+namespace Gigatron
+{
+    struct Machine;
+}
+
 namespace Cpu
 {
     enum RomType {ROMERR=0x00, ROMv1=0x1c, ROMv2=0x20, ROMv3=0x28, ROMv4=0x38, DEVROM=0xf8};
     enum ScanlineMode {Normal=0, VideoB, VideoC, VideoBC, NumScanlineModes};
     enum InternalGt1Id {SnakeGt1=0, RacerGt1=1, MandelbrotGt1=2, PicturesGt1=3, CreditsGt1=4, LoaderGt1=5, NumInternalGt1s};
 
+    // Event hooks, CycleHook runs after every native clock, DispatchHook on every vCPU instruction, (vPC matches and
+    // RAM watches), FrameHook on the falling vSync edge and ScanlineHook on every rising hSync edge, a trigger with
+    // nothing registered costs a single test
+    enum HookTrigger {CycleHook=0, DispatchHook, FrameHook, ScanlineHook, NumHookTriggers};
+    using HookFunction = void (*)(void);
+
     struct State
     {
         uint16_t _PC;
@@ -70,13 +81,22 @@ namespace Cpu
 
 
     uint8_t* getPtrToROM(int& romSize);
+    int getNumRoms(void);
+    const uint8_t* getRomFile(int index);
     RomType getRomType(void);
+    Gigatron::Machine& getMachine(void);
+
+    // Binds a machine to the calling thread, every other function in this namespace operates on the bound machine
+    void setMachine(Gigatron::Machine* machine);
     
     void loadRom(int index);
     void swapRom(void);
 
     void initialiseInternalGt1s(void);
 
+    // Every ROM write goes through here so that the HLE signatures stay coherent
+    void writeROM(uint16_t address, int page, uint8_t data);
+
     void patchSYS_Exec_88(void);
     void patchScanlineModeVideoB(void);
     void patchScanlineModeVideoC(void);
@@ -84,6 +104,11 @@ namespace Cpu
     bool patchSplitGt1IntoRom(const std::string& splitGt1path, const std::string& splitGt1name, uint16_t startAddress, InternalGt1Id gt1Id);
 
 #ifndef STAND_ALONE
+    bool getHeadless(void);
+    bool getExitVpcReached(void);
+    uint64_t getFrameCount(void);
+    int64_t getExitFrames(void);
+    int64_t getExitClocks(void);
     bool getIsInReset(void);
     State& getStateS(void);
     State& getStateT(void);
@@ -91,16 +116,26 @@ namespace Cpu
     uint8_t getIN(void);
     uint8_t getXOUT(void);
     uint16_t getVPC(void);
+    uint8_t* getPtrToRAM(int& ramSize);
     uint8_t getRAM(uint16_t address);
     uint8_t getROM(uint16_t address, int page);
     uint16_t getRAM16(uint16_t address);
     uint16_t getROM16(uint16_t address, int page);
     float getvCpuUtilisation(void);
-
+    bool getDebugging(void);
+    bool getExitRequested(void);
+
+    void setHeadless(bool headless);
+    void setSeed(uint32_t seed);
+    void setExitFrames(int64_t frames);
+    void setExitClocks(int64_t clocks);
+    void setExitVpc(int32_t vPC);
     void setIsInReset(bool isInReset);
     void setClock(int64_t clock);
     void setIN(uint8_t in);
     void setXOUT(uint8_t xout);
+    void setDebugging(bool debugging);
+    void setExitRequested(bool exitRequested);
     void setRAM(uint16_t address, uint8_t data);
     void setROM(uint16_t base, uint16_t address, uint8_t data);
     void setRAM16(uint16_t address, uint16_t data);
@@ -111,13 +146,28 @@ namespace Cpu
     void restoreScanlineModes(void);
     void swapScanlineMode(void);
 
+    // Seeds the calling thread's machine's generator, the main machine is seeded from the time unless setSeed() was
+    // called before initialise()
+    void seedRandom(uint32_t seed);
+    uint8_t nextRandom(Gigatron::Machine& m);
+
     void initialise(void);
     void shutdown(void);
     void cycle(const State& S, State& T);
+    bool benchmark(int64_t clocks);
     void reset(bool coldBoot=false);
     void softReset(void);
+    void setSizeRAM(int sizeRAM);
     void swapMemoryModel(void);
+    Gigatron::Machine* createMachine(int romIndex, int sizeRAM, uint32_t seed);
+    void destroyMachine(Gigatron::Machine* machine);
     void vCpuUsage(const State& S, const State& T);
+
+    // Hooks belong to the calling thread's machine, adding a hook twice or removing one that isn't there does nothing
+    void addHook(HookTrigger trigger, HookFunction hook);
+    void removeHook(HookTrigger trigger, HookFunction hook);
+    void setHook(HookTrigger trigger, HookFunction hook, bool enable);
+
     bool process(void);
 #endif
 }
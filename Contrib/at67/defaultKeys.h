@@ -14,6 +14,9 @@ std::vector<std::string> _defaultKeys =
     "Disassembler = CTRL+D    ; disassembler, (vCPU or Native based on MemoryMode)   ",
     "ScanlineMode = CTRL+S    ; toggles scanline modes, Normal, VideoB and VideoBC   ",
     "Reset        = CTRL+F1   ; emulator reset                                       ",
+    "SaveState    = CTRL+F2   ; saves a snapshot of the emulator                     ",
+    "LoadState    = CTRL+F4   ; loads the last saved snapshot                        ",
+    "Profile      = CTRL+P    ; starts/stops the profiler, writes profile_native.txt ",
     "Execute      = CTRL+F5   ; executes whatever code is present at the load address",
     "Help         = CTRL+H    ; toggles help screen on and off                       ",
     "Quit         = CTRL+Q    ; instant quit                                         ",
@@ -41,5 +44,6 @@ std::vector<std::string> _defaultKeys =
     "StepVpc      = CTRL+F8   ; single steps debugger based on vPC                   ",
     "StepWatch    = CTRL+F9   ; single steps debugger based on a watched variable    ",
     "                         ; by default is videoY which changes once per scanline ",
+    "StepBack     = CTRL+BACKSPACE ; rewinds to the start of the previous frame      ",
     "                                                                                "
 };
\ No newline at end of file
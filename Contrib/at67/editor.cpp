@@ -24,8 +24,12 @@
 #include "loader.h"
 #include "timing.h"
 #include "graphics.h"
+#include "snapshot.h"
+#include "profiler.h"
+#include "rewind.h"
 #include "assembler.h"
 #include "expression.h"
+#include "spsc.h"
 #include "inih/INIReader.h"
 
 
@@ -45,6 +49,13 @@ namespace Editor
         std::string _name;
     };
 
+    // SDL events are polled by the main thread and handled by the emulation thread, the mouse state travels with them
+    struct InputEvent
+    {
+        SDL_Event _event;
+        MouseState _mouseState;
+    };
+
 
     int _cursorX = 0;
     int _cursorY = 0;
@@ -72,6 +83,7 @@ namespace Editor
     std::string _filePath = "";
 
     MouseState _mouseState;
+    Spsc::Ring<InputEvent, 256> _inputEvents;
     MemoryMode _memoryMode = RAM;
     EditorMode _editorMode = Hex;
     EditorMode _editorModePrev = Hex;
@@ -244,29 +256,9 @@ namespace Editor
     }
 
 
-    // Attempt to solve Window's Non Client Area process starvation
-    int eventFilter(void* data, SDL_Event *event)
-    {
-        if(event->type == SDL_WINDOWEVENT  ||  event->type == SDL_SYSWMEVENT)
-        {
-            if(event->window.event == SDL_WINDOWEVENT_SIZE_CHANGED  ||  event->window.event == SDL_WINDOWEVENT_MOVED)
-            {
-                SDL_RenderSetViewport(Graphics::getRenderer(), NULL);
-                //Graphics::refreshScreen();
-                //Graphics::render();
-                //fprintf(stderr, "%08x\n", event->window.event);
-                for(int i=0; i<CLOCK_FREQ/600; i++) Cpu::process();
-            }
-        }
-
-        return 1;
-    }
-
     void initialise(void)
     {
-        //SDL_SetEventFilter(eventFilter, NULL);
-
-        SDL_StartTextInput();
+        if(!Cpu::getHeadless()) SDL_StartTextInput();
 
         // Current working directory
         char cwdPath[FILENAME_MAX];
@@ -411,6 +403,9 @@ namespace Editor
         _emulator["Disassembler"] = {SDLK_d, KMOD_LCTRL};
         _emulator["ScanlineMode"] = {SDLK_s, KMOD_LCTRL};
         _emulator["Reset"]        = {SDLK_F1, KMOD_LCTRL};
+        _emulator["SaveState"]    = {SDLK_F2, KMOD_LCTRL};
+        _emulator["LoadState"]    = {SDLK_F4, KMOD_LCTRL};
+        _emulator["Profile"]      = {SDLK_p, KMOD_LCTRL};
         _emulator["Execute"]      = {SDLK_F5, KMOD_LCTRL};
         _emulator["Help"]         = {SDLK_h, KMOD_LCTRL};
         _emulator["Quit"]         = {SDLK_q, KMOD_LCTRL};
@@ -437,6 +432,7 @@ namespace Editor
         _debugger["RunToBrk"]  = {SDLK_F7, KMOD_LCTRL};
         _debugger["StepVpc"]   = {SDLK_F8, KMOD_LCTRL};
         _debugger["StepWatch"] = {SDLK_F9, KMOD_LCTRL};
+        _debugger["StepBack"]  = {SDLK_BACKSPACE, KMOD_LCTRL};
 
         // Input configuration
         INIReader iniReader(INPUT_CONFIG_INI);
@@ -474,6 +470,9 @@ namespace Editor
                     scanCodeFromIniKey(sectionString, "Disassembler", "CTRL+D",   _emulator["Disassembler"]);
                     scanCodeFromIniKey(sectionString, "ScanlineMode", "CTRL+S",   _emulator["ScanlineMode"]);
                     scanCodeFromIniKey(sectionString, "Reset",        "CTRL+F1",  _emulator["Reset"]);
+                    scanCodeFromIniKey(sectionString, "SaveState",    "CTRL+F2",  _emulator["SaveState"]);
+                    scanCodeFromIniKey(sectionString, "LoadState",    "CTRL+F4",  _emulator["LoadState"]);
+                    scanCodeFromIniKey(sectionString, "Profile",      "CTRL+P",   _emulator["Profile"]);
                     scanCodeFromIniKey(sectionString, "Execute",      "CTRL+F5",  _emulator["Execute"]);
                     scanCodeFromIniKey(sectionString, "Help",         "CTRL+H",   _emulator["Help"]);
                     scanCodeFromIniKey(sectionString, "Quit",         "CTRL+Q",   _emulator["Quit"]);
@@ -509,6 +508,7 @@ namespace Editor
                     scanCodeFromIniKey(sectionString, "RunToBrk",  "CTRL+F7", _debugger["RunToBrk"]);
                     scanCodeFromIniKey(sectionString, "StepVpc",   "CTRL+F8", _debugger["StepVpc"]);
                     scanCodeFromIniKey(sectionString, "StepWatch", "CTRL+F9", _debugger["StepWatch"]);
+                    scanCodeFromIniKey(sectionString, "StepBack",  "CTRL+BACKSPACE", _debugger["StepBack"]);
                 }
                 break;
             }
@@ -850,6 +850,19 @@ namespace Editor
         }
     }
 
+    // The debugger only costs the CPU a per clock hook while it is paused or stepping
+    void debuggerHook(void)
+    {
+        Cpu::setDebugging(handleDebugger());
+    }
+
+    void updateDebuggerHook(void)
+    {
+        bool active = _singleStep  ||  _singleStepEnabled;
+        Cpu::setHook(Cpu::CycleHook, debuggerHook, active);
+        if(!active) Cpu::setDebugging(false);
+    }
+
     void startDebugger(void)
     {
         _singleStep = false;
@@ -858,6 +871,8 @@ namespace Editor
 
         _hexBaseAddress = (_memoryMode == RAM) ? Cpu::getVPC() : Cpu::getStateS()._PC;
         _vpcBaseAddress = _hexBaseAddress;
+
+        updateDebuggerHook();
     }
 
     void resetDebugger(void)
@@ -865,6 +880,8 @@ namespace Editor
         _singleStep = false;
         _singleStepEnabled = false;
         _singleStepMode = RunToBrk;
+
+        updateDebuggerHook();
     }
 
     // PS2 Keyboard emulation mode
@@ -946,15 +963,23 @@ namespace Editor
     {
         //fprintf(stderr, "Editor::handleKeyDown() : key=%d : mod=%04x\n", _sdlKeyScanCode, _sdlKeyModifier);
 
+        // Same as closing the window, main joins the emulation thread and shuts down
         if(_sdlKeyScanCode == _emulator["Quit"].scanCode  &&  _sdlKeyModifier == _emulator["Quit"].modifier)
         {
-            Cpu::shutdown();
-            exit(0);
+            Cpu::setExitRequested(true);
+            return;
         }
 
         // Emulator reset
         else if(_sdlKeyScanCode == _emulator["Reset"].scanCode  &&  _sdlKeyModifier == _emulator["Reset"].modifier) {resetDebugger(); Cpu::reset(); return;}
 
+        // Save states
+        else if(_sdlKeyScanCode == _emulator["SaveState"].scanCode  &&  _sdlKeyModifier == _emulator["SaveState"].modifier) {Snapshot::saveFile(Snapshot::getQuickFilename()); return;}
+        else if(_sdlKeyScanCode == _emulator["LoadState"].scanCode  &&  _sdlKeyModifier == _emulator["LoadState"].modifier) {Snapshot::loadFile(Snapshot::getQuickFilename()); return;}
+
+        // Native profiler
+        else if(_sdlKeyScanCode == _emulator["Profile"].scanCode  &&  _sdlKeyModifier == _emulator["Profile"].modifier) {Profiler::toggle("profile"); return;}
+
         // Hardware reset
         else if(_sdlKeyScanCode == _hardware["Reset"].scanCode  &&  _sdlKeyModifier == _hardware["Reset"].modifier) {Loader::sendCommandToGiga('R', false); return;}
 
@@ -1186,11 +1211,13 @@ namespace Editor
     }
 
 
-    void handleGuiEvents(SDL_Event& event)
+    // Main thread, window events are handled here, everything else is queued for the emulation thread
+    void pollEvents(void)
     {
-        switch(event.type)
+        SDL_Event event;
+        while(SDL_PollEvent(&event))
         {
-            case SDL_WINDOWEVENT:
+            if(event.type == SDL_WINDOWEVENT)
             {
                 switch(event.window.event)
                 {
@@ -1201,14 +1228,40 @@ namespace Editor
                     }
                     break;
                 }
+
+                continue;
             }
-            break;
 
+            InputEvent inputEvent;
+            inputEvent._event = event;
+            inputEvent._mouseState._state = SDL_GetMouseState(&inputEvent._mouseState._x, &inputEvent._mouseState._y);
+
+            // Input is dropped if the emulation thread falls a whole queue behind, but quitting has to get through
+            while(!_inputEvents.push(inputEvent)  &&  event.type == SDL_QUIT) SDL_Delay(1);
+        }
+    }
+
+    // Emulation thread
+    bool popEvent(SDL_Event& event)
+    {
+        InputEvent inputEvent;
+        if(!_inputEvents.pop(inputEvent)) return false;
+
+        event = inputEvent._event;
+        _mouseState = inputEvent._mouseState;
+        return true;
+    }
+
+    void handleGuiEvents(SDL_Event& event)
+    {
+        switch(event.type)
+        {
+            // The main thread waits for Cpu::process() to return before shutting down
             case SDL_QUIT: 
             {
-                Cpu::shutdown();
-                exit(0);
+                Cpu::setExitRequested(true);
             }
+            break;
         }
     }
 
@@ -1219,14 +1272,13 @@ namespace Editor
         _singleStepEnabled = true;
         _hexBaseAddress = address;
         _vpcBaseAddress = address;
+
+        updateDebuggerHook();
     }
 
     // Debug mode, handles it's own input and rendering
     bool handleDebugger(void)
     {
-        // Gprintfs
-        Assembler::printGprintfStrings();
-
         // Debug
         static uint16_t vPC = Cpu::getVPC();
         if(_singleStep)
@@ -1280,7 +1332,7 @@ namespace Editor
         }
 
         // Pause simulation and handle debugging keys
-        while(_singleStepEnabled)
+        while(_singleStepEnabled  &&  !Cpu::getExitRequested())
         {
             // Update graphics but only once every 16.66667ms
             static uint64_t prevFrameCounter = 0;
@@ -1290,6 +1342,7 @@ namespace Editor
             if(frameTime > VSYNC_TIMING_60)
             {
                 _onVarType = updateOnVarType();
+                Assembler::flushGprintfLog();
 
                 prevFrameCounter = SDL_GetPerformanceCounter();
                 Timing::setFrameUpdate(true);
@@ -1298,11 +1351,10 @@ namespace Editor
             }
 
             SDL_Event event;
-            while(SDL_PollEvent(&event))
+            while(popEvent(event))
             {
                 _sdlKeyScanCode = event.key.keysym.sym;
                 _sdlKeyModifier = event.key.keysym.mod & (KMOD_LCTRL | KMOD_LALT);
-                _mouseState._state = SDL_GetMouseState(&_mouseState._x, &_mouseState._y);
 
                 handleGuiEvents(event);
 
@@ -1365,6 +1417,11 @@ namespace Editor
                             _singleStepTicks = SDL_GetTicks();
                             _singleStepValue = Cpu::getRAM(_singleStepAddress);
                         }
+                        // Rewind to the start of the previous frame and stay paused
+                        else if(_sdlKeyScanCode == _debugger["StepBack"].scanCode  &&  _sdlKeyModifier == _debugger["StepBack"].modifier)
+                        {
+                            if(Rewind::stepBack()) singleStep((_memoryMode == RAM) ? Cpu::getVPC() : Cpu::getStateS()._PC);
+                        }
                         else
                         {
                             handleKeyDown();
@@ -1373,6 +1430,9 @@ namespace Editor
                     break;
                 }
             }
+
+            // Paused, so there's no point in spinning on the input queue
+            SDL_Delay(1);
         }
 
         return _singleStep;
@@ -1388,11 +1448,10 @@ namespace Editor
         _onVarType = updateOnVarType();
 
         SDL_Event event;
-        while(SDL_PollEvent(&event))
+        while(popEvent(event))
         {
             _sdlKeyScanCode = event.key.keysym.sym;
             _sdlKeyModifier = event.key.keysym.mod & (KMOD_LCTRL | KMOD_LALT);
-            _mouseState._state = SDL_GetMouseState(&_mouseState._x, &_mouseState._y);
 
             handleGuiEvents(event);
 
@@ -128,6 +128,7 @@ namespace Editor
     void browseDirectory(void);
 
 #ifndef STAND_ALONE
+    void pollEvents(void);
     void handleGuiEvents(SDL_Event& event);
 #endif
     bool handleDebugger(void);
@@ -1,4 +1,6 @@
+#include <string.h>
 #include <string>
+#include <vector>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -12,19 +14,44 @@
 #include "loader.h"
 #include "assembler.h"
 #include "expression.h"
+#include "machine.h"
+#include "spsc.h"
 #include "inih/INIReader.h"
 #include "defaultKeys.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define GRAPHICS_AVX2
+#elif defined(__SSE2__)  ||  defined(_M_X64)  ||  (defined(_M_IX86_FP)  &&  _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GRAPHICS_SSE2
+#elif defined(__ARM_NEON)  ||  defined(_M_ARM64)
+#include <arm_neon.h>
+#define GRAPHICS_NEON
+#endif
+
 // Use this if you ever want to change the default font, but it better be 6x8 per char or otherwise you will be in a world of hurt
 //#define CREATE_FONT_HEADER
 #ifndef CREATE_FONT_HEADER
 #include "emuFont96x48.h"
 #endif
 
+#define FONT_CHARS        (CHARS_PER_ROW * (FONT_BMP_HEIGHT/FONT_HEIGHT))
+#define TEXT_CELLS_X      (NATIVE_WIDTH*3) // text to the right of the Gigatron's pixels is cached
+#define TEXT_CELLS_WIDTH  (SCREEN_WIDTH - TEXT_CELLS_X)
+
 
 namespace Graphics
 {
-    int _width, _height;
+    struct Frame
+    {
+        uint32_t _pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
+        uint32_t _native[NATIVE_WIDTH * SCREEN_HEIGHT];
+    };
+
+
+    // Resized by the main thread's window events, read by the emulation thread's mouse handling
+    std::atomic<int> _width(640), _height(480);
     int _posX = 0, _posY = 0;
 
     float _aspect = 0.0f;
@@ -38,30 +65,51 @@ namespace Graphics
 
     int _filter = 0;
 
-    bool _displayHelpScreen = false;
+    // 0 expands the Gigatron's pixels into the 640x480 framebuffer, 1 keeps them at 160x480 and 2 at 160x120 in a native
+    // framebuffer that SDL scales when presenting, either way the menu is still drawn into the 640x480 framebuffer
+    int _nativeRes = 0;
+    bool _scanlineGap = true;
+
+    std::atomic<bool> _displayHelpScreen(false);
     uint8_t _displayHelpScreenAlpha = 0;
 
-    std::atomic<bool> _enableUploadBar = false;
-    std::atomic<int> _uploadCursorY = -1;
-    std::atomic<float> _uploadPercentage = 0.0f;
+    std::atomic<bool> _enableUploadBar(false);
+    std::atomic<int> _uploadCursorY(-1);
+    std::atomic<float> _uploadPercentage(0.0f);
     std::string _uploadFilename;
 
     uint32_t _pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
     uint32_t _colours[COLOUR_PALETTE];
     uint32_t _hlineTiming[GIGA_HEIGHT];
+    uint32_t _native[NATIVE_WIDTH * SCREEN_HEIGHT];
+
+    // Completed frames, composed by the emulation thread and presented by the main thread
+    Spsc::TripleBuffer<Frame> _frames;
 
     SDL_Window* _window = NULL;
     SDL_Renderer* _renderer = NULL;
     SDL_Texture* _screenTexture = NULL;
+    SDL_Texture* _nativeTexture = NULL;
     SDL_Texture* _helpTexture = NULL;
     SDL_Surface* _helpSurface = NULL;
     SDL_Surface* _fontSurface = NULL;
 
+    // One FONT_WIDTH bit mask per glyph row, pre-rasterised from the font surface
+    uint8_t _glyphs[FONT_CHARS][FONT_HEIGHT];
+
+    // Menu text cells indexed by glyph origin, a cell packs colour <<8 | (chr+1) <<1 | invert and 0 is empty, shown is
+    // what is in _pixels and next is what has been drawn since the last flush, only cells that differ are blitted
+    uint32_t _cellsShown[SCREEN_HEIGHT][TEXT_CELLS_WIDTH];
+    uint32_t _cellsNext[SCREEN_HEIGHT][TEXT_CELLS_WIDTH];
+    int _cellsPerRow[SCREEN_HEIGHT];
+    std::vector<int> _cellsTouched;
+
     INIReader _configIniReader;
 
     int getWidth(void) {return _width;}
     int getHeight(void) {return _height;}
 
+    int getNativeRes(void) {return _nativeRes;}
     uint32_t* getPixels(void) {return _pixels;}
     uint32_t* getColours(void) {return _colours;}
 
@@ -231,6 +279,24 @@ namespace Graphics
         return true;
     }
 
+    void createGlyphAtlas(void)
+    {
+        uint32_t* fontPixels = (uint32_t*)_fontSurface->pixels;
+        for(int chr=0; chr<FONT_CHARS; chr++)
+        {
+            int srcx = (chr % CHARS_PER_ROW)*FONT_WIDTH, srcy = (chr / CHARS_PER_ROW)*FONT_HEIGHT;
+            for(int k=0; k<FONT_HEIGHT; k++)
+            {
+                uint8_t mask = 0;
+                for(int j=0; j<FONT_WIDTH; j++)
+                {
+                    if(fontPixels[(srcx + j)  +  (srcy + k)*FONT_BMP_WIDTH] & 0x00FFFFFF) mask |= 1 <<j;
+                }
+                _glyphs[chr][k] = mask;
+            }
+        }
+    }
+
     void initialise(void)
     {
         // HLINE sync error bar
@@ -254,6 +320,9 @@ namespace Graphics
             _colours[i] = p;
         }
 
+        // Headless mode renders into _pixels only, no window, renderer or texture
+        if(Cpu::getHeadless()) return;
+
         // Safe resolution by default
         SDL_DisplayMode DM;
         SDL_GetCurrentDisplayMode(0, &DM);
@@ -312,6 +381,12 @@ namespace Graphics
                         _filter = strtol(result.c_str(), nullptr, 10);
                         _filter = (_filter<0 || _filter>2) ? 0 : _filter;
 
+                        getKeyAsString(sectionString, "NativeRes", "0", result);
+                        _nativeRes = strtol(result.c_str(), nullptr, 10);
+                        _nativeRes = (_nativeRes<0 || _nativeRes>2) ? 0 : _nativeRes;
+                        getKeyAsString(sectionString, "ScanlineGap", "1", result);
+                        _scanlineGap = strtol(result.c_str(), nullptr, 10);
+
                         getKeyAsString(sectionString, "Width", "640", result);
                         _width = (result == "DESKTOP") ? DM.w : _width = std::strtol(result.c_str(), nullptr, 10);
                         getKeyAsString(sectionString, "Height", "480", result);
@@ -396,6 +471,18 @@ namespace Graphics
             _EXIT_(EXIT_FAILURE);
         }
 
+        // Native texture
+        if(_nativeRes)
+        {
+            _nativeTexture = SDL_CreateTexture(_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, NATIVE_WIDTH, SCREEN_HEIGHT);
+            if(_nativeTexture == NULL)
+            {
+                Cpu::shutdown();
+                fprintf(stderr, "Graphics::initialise() :  failed to create SDL native texture.\n");
+                _EXIT_(EXIT_FAILURE);
+            }
+        }
+
 #ifdef CREATE_FONT_HEADER
         // Load font file
         SDL_Surface* fontSurface = SDL_LoadBMP("EmuFont-96x48.bmp");
@@ -419,6 +506,7 @@ namespace Graphics
         _fontSurface = createSurface(FONT_BMP_WIDTH, FONT_BMP_HEIGHT);
         writeToSurface(_fontSurface, _emuFont96x48, FONT_BMP_WIDTH, FONT_BMP_HEIGHT);
 #endif
+        createGlyphAtlas();
 
         // Help screen
         _helpSurface = createSurface(SCREEN_WIDTH, SCREEN_HEIGHT);
@@ -434,12 +522,33 @@ namespace Graphics
         }
     }
 
+    // Native framebuffer equivalent of a 3x4 screen pixel, (the 4th line is always blank)
+    void refreshNativePixel(int x, int y, uint32_t colour)
+    {
+        if(_nativeRes == 2)
+        {
+            _native[x + y*NATIVE_WIDTH] = colour;
+            return;
+        }
+
+        _native[x + (y*4 + 0)*NATIVE_WIDTH] = colour;
+        _native[x + (y*4 + 1)*NATIVE_WIDTH] = colour;
+        _native[x + (y*4 + 2)*NATIVE_WIDTH] = colour;
+        _native[x + (y*4 + 3)*NATIVE_WIDTH] = 0x00;
+    }
+
     void refreshTimingPixel(const Cpu::State& S, int vgaX, int pixelY, uint32_t colour, bool debugging)
     {
         _hlineTiming[pixelY % GIGA_HEIGHT] = colour;
 
         if(debugging) return;
 
+        if(_nativeRes)
+        {
+            refreshNativePixel(vgaX % NATIVE_WIDTH, pixelY % GIGA_HEIGHT, colour);
+            return;
+        }
+
         uint32_t screen = (vgaX % (GIGA_WIDTH+1))*3 + (pixelY % GIGA_HEIGHT)*4*SCREEN_WIDTH;
         _pixels[screen + 0 + 0*SCREEN_WIDTH] = colour; _pixels[screen + 1 + 0*SCREEN_WIDTH] = colour; _pixels[screen + 2 + 0*SCREEN_WIDTH] = colour;
         _pixels[screen + 0 + 1*SCREEN_WIDTH] = colour; _pixels[screen + 1 + 1*SCREEN_WIDTH] = colour; _pixels[screen + 2 + 1*SCREEN_WIDTH] = colour;
@@ -447,35 +556,131 @@ namespace Graphics
         _pixels[screen + 0 + 3*SCREEN_WIDTH] = 0x00;   _pixels[screen + 1 + 3*SCREEN_WIDTH] = 0x00;   _pixels[screen + 2 + 3*SCREEN_WIDTH] = 0x00;
     }
 
-    void refreshPixel(const Cpu::State& S, int vgaX, int vgaY, bool debugging)
+    // Palette expands GIGA_WIDTH OUT bytes into GIGA_WIDTH*3 pixels, each Gigatron pixel is three screen pixels wide
+    void expandScanline(const uint8_t* scanline, uint32_t* pixels)
+    {
+#if defined(GRAPHICS_AVX2)
+        // Gathers eight colours at a time and permutes them into three runs of eight pixels
+        const __m256i mask = _mm256_set1_epi32(COLOUR_PALETTE-1);
+        const __m256i run0 = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+        const __m256i run1 = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+        const __m256i run2 = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+        for(int x=0; x<GIGA_WIDTH; x+=8)
+        {
+            __m256i index = _mm256_and_si256(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&scanline[x])), mask);
+            __m256i colours = _mm256_i32gather_epi32((const int*)_colours, index, 4);
+            _mm256_storeu_si256((__m256i*)&pixels[x*3 + 0],  _mm256_permutevar8x32_epi32(colours, run0));
+            _mm256_storeu_si256((__m256i*)&pixels[x*3 + 8],  _mm256_permutevar8x32_epi32(colours, run1));
+            _mm256_storeu_si256((__m256i*)&pixels[x*3 + 16], _mm256_permutevar8x32_epi32(colours, run2));
+        }
+#elif defined(GRAPHICS_SSE2)
+        // Looks up four colours at a time and shuffles them into three runs of four pixels
+        for(int x=0; x<GIGA_WIDTH; x+=4)
+        {
+            __m128i colours = _mm_setr_epi32(_colours[scanline[x + 0] & (COLOUR_PALETTE-1)], _colours[scanline[x + 1] & (COLOUR_PALETTE-1)],
+                                             _colours[scanline[x + 2] & (COLOUR_PALETTE-1)], _colours[scanline[x + 3] & (COLOUR_PALETTE-1)]);
+            _mm_storeu_si128((__m128i*)&pixels[x*3 + 0], _mm_shuffle_epi32(colours, _MM_SHUFFLE(1, 0, 0, 0)));
+            _mm_storeu_si128((__m128i*)&pixels[x*3 + 4], _mm_shuffle_epi32(colours, _MM_SHUFFLE(2, 2, 1, 1)));
+            _mm_storeu_si128((__m128i*)&pixels[x*3 + 8], _mm_shuffle_epi32(colours, _MM_SHUFFLE(3, 3, 3, 2)));
+        }
+#elif defined(GRAPHICS_NEON)
+        // Looks up four colours at a time, a three way interleaved store of the same vector triples each one
+        for(int x=0; x<GIGA_WIDTH; x+=4)
+        {
+            uint32_t lookup[4] = {_colours[scanline[x + 0] & (COLOUR_PALETTE-1)], _colours[scanline[x + 1] & (COLOUR_PALETTE-1)],
+                                  _colours[scanline[x + 2] & (COLOUR_PALETTE-1)], _colours[scanline[x + 3] & (COLOUR_PALETTE-1)]};
+            uint32x4_t colours = vld1q_u32(lookup);
+            uint32x4x3_t runs = {{colours, colours, colours}};
+            vst3q_u32(&pixels[x*3], runs);
+        }
+#else
+        for(int x=0; x<GIGA_WIDTH; x++)
+        {
+            uint32_t colour = _colours[scanline[x] & (COLOUR_PALETTE-1)];
+            pixels[x*3 + 0] = colour;
+            pixels[x*3 + 1] = colour;
+            pixels[x*3 + 2] = colour;
+        }
+#endif
+    }
+
+    // Palette looks up GIGA_WIDTH OUT bytes into GIGA_WIDTH native pixels
+    void lookupScanline(const uint8_t* scanline, uint32_t* pixels)
+    {
+#if defined(GRAPHICS_AVX2)
+        const __m256i mask = _mm256_set1_epi32(COLOUR_PALETTE-1);
+        for(int x=0; x<GIGA_WIDTH; x+=8)
+        {
+            __m256i index = _mm256_and_si256(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&scanline[x])), mask);
+            _mm256_storeu_si256((__m256i*)&pixels[x], _mm256_i32gather_epi32((const int*)_colours, index, 4));
+        }
+#else
+        for(int x=0; x<GIGA_WIDTH; x++) pixels[x] = _colours[scanline[x] & (COLOUR_PALETTE-1)];
+#endif
+    }
+
+    void refreshScanline(const uint8_t* scanline, int vgaY, bool debugging)
     {
         if(debugging) return;
 
-        uint32_t colour = _colours[S._OUT & (COLOUR_PALETTE-1)];
-        uint32_t address = (vgaX % GIGA_WIDTH)*3 + (vgaY % SCREEN_HEIGHT)*SCREEN_WIDTH;
-        _pixels[address + 0] = colour;
-        _pixels[address + 1] = colour;
-        _pixels[address + 2] = colour;
+        switch(_nativeRes)
+        {
+            case 0: expandScanline(scanline, &_pixels[(vgaY % SCREEN_HEIGHT)*SCREEN_WIDTH]); break;
+            case 1: lookupScanline(scanline, &_native[(vgaY % SCREEN_HEIGHT)*NATIVE_WIDTH]);  break;
+
+            // De-duplicated, the first line of every four is always the one with pixels in it, whatever the scanline mode
+            case 2: if((vgaY & 3) == 0) lookupScanline(scanline, &_native[(vgaY/4 % GIGA_HEIGHT)*NATIVE_WIDTH]); break;
+        }
     }
 
+    // Rebuilds the screen from RAM while the CPU is paused, each vTable row is resolved once and its GIGA_WIDTH bytes,
+    // which wrap within their page, are copied as at most two spans and expanded by the scanline kernels
     void refreshScreen(void)
     {
+        const Gigatron::Machine& m = Cpu::getMachine();
+        uint16_t mask = uint16_t(m._sizeRAM - 1);
+        uint8_t scanline[GIGA_WIDTH];
         uint8_t offsetx = 0;
 
         for(int y=0; y<GIGA_HEIGHT; y++)
         {
-            offsetx += Cpu::getRAM(GIGA_VTABLE + 1 + y*2);
-    
-            for(int x=0; x<=GIGA_WIDTH; x++)
+            offsetx += m._RAM[(GIGA_VTABLE + 1 + y*2) & mask];
+            const uint8_t* row = &m._RAM[(m._RAM[(GIGA_VTABLE + y*2) & mask] <<8) & mask];
+
+            int span = std::min(GIGA_WIDTH, 256 - offsetx);
+            memcpy(scanline, &row[offsetx], span);
+            memcpy(&scanline[span], row, GIGA_WIDTH - span);
+
+            switch(_nativeRes)
             {
-                uint16_t address = (Cpu::getRAM(GIGA_VTABLE + y*2) <<8) + ((offsetx + x) & 0xFF);
-                uint32_t colour = (x < GIGA_WIDTH) ? _colours[Cpu::getRAM(address) & (COLOUR_PALETTE-1)] : _hlineTiming[y];
-                uint32_t screen = (y*4 % SCREEN_HEIGHT)*SCREEN_WIDTH  +  (x*3 % SCREEN_WIDTH);
-
-                _pixels[screen + 0 + 0*SCREEN_WIDTH] = colour; _pixels[screen + 1 + 0*SCREEN_WIDTH] = colour; _pixels[screen + 2 + 0*SCREEN_WIDTH] = colour;
-                _pixels[screen + 0 + 1*SCREEN_WIDTH] = colour; _pixels[screen + 1 + 1*SCREEN_WIDTH] = colour; _pixels[screen + 2 + 1*SCREEN_WIDTH] = colour;
-                _pixels[screen + 0 + 2*SCREEN_WIDTH] = colour; _pixels[screen + 1 + 2*SCREEN_WIDTH] = colour; _pixels[screen + 2 + 2*SCREEN_WIDTH] = colour;
-                _pixels[screen + 0 + 3*SCREEN_WIDTH] = 0x00;   _pixels[screen + 1 + 3*SCREEN_WIDTH] = 0x00;   _pixels[screen + 2 + 3*SCREEN_WIDTH] = 0x00;
+                case 0:
+                {
+                    uint32_t* pixels = &_pixels[y*4*SCREEN_WIDTH];
+                    expandScanline(scanline, pixels);
+                    for(int i=0; i<3; i++) pixels[GIGA_WIDTH*3 + i] = _hlineTiming[y];
+                    memcpy(&pixels[1*SCREEN_WIDTH], pixels, NATIVE_WIDTH*3 * sizeof(uint32_t));
+                    memcpy(&pixels[2*SCREEN_WIDTH], pixels, NATIVE_WIDTH*3 * sizeof(uint32_t));
+                    memset(&pixels[3*SCREEN_WIDTH], 0, NATIVE_WIDTH*3 * sizeof(uint32_t));
+                }
+                break;
+
+                case 1:
+                {
+                    uint32_t* pixels = &_native[y*4*NATIVE_WIDTH];
+                    lookupScanline(scanline, pixels);
+                    pixels[GIGA_WIDTH] = _hlineTiming[y];
+                    memcpy(&pixels[1*NATIVE_WIDTH], pixels, NATIVE_WIDTH * sizeof(uint32_t));
+                    memcpy(&pixels[2*NATIVE_WIDTH], pixels, NATIVE_WIDTH * sizeof(uint32_t));
+                    memset(&pixels[3*NATIVE_WIDTH], 0, NATIVE_WIDTH * sizeof(uint32_t));
+                }
+                break;
+
+                case 2:
+                {
+                    lookupScanline(scanline, &_native[y*NATIVE_WIDTH]);
+                    _native[GIGA_WIDTH + y*NATIVE_WIDTH] = _hlineTiming[y];
+                }
+                break;
             }
         }
     }
@@ -503,7 +708,73 @@ namespace Graphics
         }
     }
 
-    // Simple text routine, font is a non proportional 6*8 font loaded from a 96*48 BMP file
+    void blitGlyph(uint32_t* pixels, int x, int y, uint8_t chr, uint32_t colour, bool invert, bool colourKey)
+    {
+        for(int k=0; k<FONT_HEIGHT; k++)
+        {
+            uint8_t mask = _glyphs[chr][k] ^ (invert ? (1 <<FONT_WIDTH) - 1 : 0);
+            uint32_t* row = &pixels[x + (y + k)*SCREEN_WIDTH];
+            for(int j=0; j<FONT_WIDTH; j++)
+            {
+                if((mask >>j) & 1)
+                {
+                    row[j] = 0xFF000000 | colour;
+                }
+                else
+                {
+                    if(!colourKey) row[j] = 0xFF000000;
+                }
+            }
+        }
+    }
+
+    // Forgets every shown cell overlapping the rectangle, so that it is blitted again the next time it is drawn
+    void invalidateText(int x, int y, int w, int h)
+    {
+        int x0 = std::max(x - FONT_WIDTH + 1, TEXT_CELLS_X), x1 = std::min(x + w, SCREEN_WIDTH);
+        int y0 = std::max(y - FONT_HEIGHT + 1, 0), y1 = std::min(y + h, SCREEN_HEIGHT);
+        for(int cy=y0; cy<y1; cy++)
+        {
+            if(_cellsPerRow[cy] == 0) continue;
+
+            for(int cx=x0; cx<x1; cx++)
+            {
+                uint32_t& shown = _cellsShown[cy][cx - TEXT_CELLS_X];
+                if(shown) {shown = 0; _cellsPerRow[cy]--;}
+            }
+        }
+    }
+
+    void queueGlyph(int x, int y, uint32_t cell)
+    {
+        uint32_t& next = _cellsNext[y][x - TEXT_CELLS_X];
+        if(next == 0) _cellsTouched.push_back(x + y*SCREEN_WIDTH);
+        next = cell;
+    }
+
+    // Blits the cells drawn since the last flush that differ from what is already in _pixels, must be called before
+    // anything else draws over the menu so that it stays on top of the text
+    void flushText(void)
+    {
+        for(int i=0; i<int(_cellsTouched.size()); i++)
+        {
+            int x = _cellsTouched[i] % SCREEN_WIDTH, y = _cellsTouched[i] / SCREEN_WIDTH;
+            uint32_t& next = _cellsNext[y][x - TEXT_CELLS_X];
+            uint32_t& shown = _cellsShown[y][x - TEXT_CELLS_X];
+            if(next != shown)
+            {
+                invalidateText(x, y, FONT_WIDTH, FONT_HEIGHT);
+                blitGlyph(_pixels, x, y, uint8_t(((next >>1) & 0x7F) - 1), next >>8, next & 1, false);
+                shown = next;
+                _cellsPerRow[y]++;
+            }
+            next = 0;
+        }
+        _cellsTouched.clear();
+    }
+
+    // Simple text routine, font is a non proportional 6*8 font loaded from a 96*48 BMP file, opaque text in the menu is
+    // queued as cells and only blitted by flushText() when it changes
     bool drawText(const std::string& text, uint32_t* pixels, int x, int y, uint32_t colour, bool invert, int invertSize, bool colourKey, int size, bool fullscreen, uint32_t commentColour, uint32_t sectionColour)
     {
         if(!fullscreen)
@@ -513,7 +784,6 @@ namespace Graphics
         }
         if(x<0 || x>=SCREEN_WIDTH || y<0 || y>=SCREEN_HEIGHT) return false;
 
-        uint32_t* fontPixels = (uint32_t*)_fontSurface->pixels;
         size = (size == -1) ? int(text.size()) : size;
         for(int i=0; i<size; i++)
         {
@@ -534,32 +804,24 @@ namespace Graphics
             }
 
             uint8_t chr = text.c_str()[i] - 32;
-            uint8_t row = chr % CHARS_PER_ROW;
-            uint8_t col = chr / CHARS_PER_ROW;
-
-            int srcx = row*FONT_WIDTH, srcy = col*FONT_HEIGHT;
-            if(srcx+FONT_WIDTH-1>=FONT_BMP_WIDTH || srcy+FONT_HEIGHT-1>=FONT_BMP_HEIGHT) return false;
+            if(chr >= FONT_CHARS) return false;
 
             int dstx = x + i*FONT_WIDTH, dsty = y;
             if(dstx+FONT_WIDTH-1>=SCREEN_WIDTH-FONT_WIDTH || dsty+FONT_HEIGHT-1>=SCREEN_HEIGHT) return false;
 
-            for(int j=0; j<FONT_WIDTH; j++)
+            bool inverted = invert  &&  i<invertSize;
+            if(pixels == _pixels  &&  !colourKey  &&  dstx >= TEXT_CELLS_X)
             {
-                for(int k=0; k<FONT_HEIGHT; k++)
-                {
-                    int fontAddress = (srcx + j)  +  (srcy + k)*FONT_BMP_WIDTH;
-                    int pixelAddress = (dstx + j)  +  (dsty + k)*SCREEN_WIDTH;
-                    uint32_t fontPixel = fontPixels[fontAddress] & 0x00FFFFFF;
-                    if((invert  &&  i<invertSize) ? !fontPixel : fontPixel)
-                    {
-                        pixels[pixelAddress] = 0xFF000000 | colour;
-                    }
-                    else
-                    {
-                        if(!colourKey) pixels[pixelAddress] = 0xFF000000;
-                    }
-                }
+                queueGlyph(dstx, dsty, ((colour & 0x00FFFFFF) <<8) | ((chr + 1) <<1) | uint32_t(inverted));
+                continue;
+            }
+
+            if(pixels == _pixels)
+            {
+                flushText();
+                invalidateText(dstx, dsty, FONT_WIDTH, FONT_HEIGHT);
             }
+            blitGlyph(pixels, dstx, dsty, chr, colour, inverted, colourKey);
         }
 
         return true;
@@ -573,6 +835,9 @@ namespace Graphics
 
         uint32_t pixelAddress = x + digit*FONT_WIDTH + y*SCREEN_WIDTH;
 
+        flushText();
+        invalidateText(x + digit*FONT_WIDTH, y + FONT_HEIGHT-1, FONT_WIDTH, 1);
+
         pixelAddress += (FONT_HEIGHT-1)*SCREEN_WIDTH;
         for(int i=0; i<FONT_WIDTH; i++) _pixels[pixelAddress+i] = colour;
 
@@ -612,6 +877,9 @@ namespace Graphics
         x += MENU_START_X;
         y += MENU_START_Y;
 
+        flushText();
+        invalidateText(x, y, w, h);
+
         for(int j=y; j<(y + h); j++)
         {
             for(int i=x; i<(x + ww); i++)
@@ -692,6 +960,16 @@ namespace Graphics
         }
     }
 
+    // Same as sprintf(str, "%02X ", value), without the cost of sprintf for every byte of the monitor
+    void hexByte(char* str, uint8_t value)
+    {
+        static const char hexDigits[] = "0123456789ABCDEF";
+        str[0] = hexDigits[value >>4];
+        str[1] = hexDigits[value & 0x0F];
+        str[2] = ' ';
+        str[3] = 0;
+    }
+
     int renderHexMonitor(bool onHex)
     {
         char str[32] = "";
@@ -718,7 +996,7 @@ namespace Graphics
                     case Editor::ROM0: value = Cpu::getROM(hexAddress, 0); break;
                     case Editor::ROM1: value = Cpu::getROM(hexAddress, 1); break;
                 }
-                sprintf(str, "%02X ", value);
+                hexByte(str, value);
                 bool onCursor = (i == Editor::getCursorX()  &&  j == Editor::getCursorY());
                 if(onCursor) hexDigitIndex = j*HEX_CHARS_X + i;
                 uint32_t colour = (Editor::getHexEdit() && Editor::getMemoryMode() == Editor::RAM && onCursor) ? 0xFF00FF00 : 0xFFB0B0B0;
@@ -927,7 +1205,7 @@ namespace Graphics
             {
                 for(int i=0; i<HEX_CHARS_X; i++)
                 {
-                    sprintf(str, "%02X ", Cpu::getRAM(varsAddress++));
+                    hexByte(str, Cpu::getRAM(varsAddress++));
                     drawText(std::string(str), _pixels, HEX_START_X + i*HEX_CHAR_WIDE, int(FONT_CELL_Y*4.25) + FONT_CELL_Y*HEX_CHARS_Y + j*(FONT_HEIGHT+FONT_GAP_Y), 0xFF00FFFF, false, 0);
                 }
             }
@@ -975,17 +1253,87 @@ namespace Graphics
         }
     }
 
+    // Emulation thread, composes the overlays and publishes the frame, presenting it is left to the main thread
     void render(bool synchronise)
     {
         drawLeds();
         renderText();
         renderTextWindow();
+        flushText();
+
+        Frame& frame = _frames.back();
+        if(_nativeRes)
+        {
+            // Only the menu is left in the screen framebuffer
+            int height = (_nativeRes == 1) ? SCREEN_HEIGHT : GIGA_HEIGHT;
+            memcpy(frame._native, _native, NATIVE_WIDTH*height * sizeof(uint32_t));
+            for(int y=0; y<SCREEN_HEIGHT; y++)
+            {
+                memcpy(&frame._pixels[NATIVE_WIDTH*3 + y*SCREEN_WIDTH], &_pixels[NATIVE_WIDTH*3 + y*SCREEN_WIDTH], (SCREEN_WIDTH - NATIVE_WIDTH*3) * sizeof(uint32_t));
+            }
+        }
+        else
+        {
+            memcpy(frame._pixels, _pixels, sizeof _pixels);
+        }
+        _frames.publish();
+        if(synchronise) Timing::synchronise();
+    }
+
+    // The native framebuffer is scaled into the screen area and the menu is copied next to it, the renderer's coordinates
+    // are the window's, or it's logical size if it has one
+    void presentNative(const Frame& frame)
+    {
+        int width, height;
+        SDL_RenderGetLogicalSize(_renderer, &width, &height);
+        if(width == 0  ||  height == 0) SDL_GetRendererOutputSize(_renderer, &width, &height);
+        float scaleX = float(width) / float(SCREEN_WIDTH);
+        float scaleY = float(height) / float(SCREEN_HEIGHT);
+
+        SDL_Rect nativeSrc = {0, 0, NATIVE_WIDTH, (_nativeRes == 1) ? SCREEN_HEIGHT : GIGA_HEIGHT};
+        SDL_Rect nativeDst = {0, 0, int(NATIVE_WIDTH*3 * scaleX + 0.5f), height};
+        SDL_Rect menuSrc = {NATIVE_WIDTH*3, 0, SCREEN_WIDTH - NATIVE_WIDTH*3, SCREEN_HEIGHT};
+        SDL_Rect menuDst = {nativeDst.w, 0, width - nativeDst.w, height};
+
+        SDL_UpdateTexture(_nativeTexture, &nativeSrc, frame._native, NATIVE_WIDTH * sizeof uint32_t);
+        SDL_UpdateTexture(_screenTexture, &menuSrc, &frame._pixels[NATIVE_WIDTH*3], SCREEN_WIDTH * sizeof uint32_t);
+        SDL_RenderCopy(_renderer, _nativeTexture, &nativeSrc, &nativeDst);
+        SDL_RenderCopy(_renderer, _screenTexture, &menuSrc, &menuDst);
+
+        // Blank 4th line of every Gigatron pixel, 160x120 leaves it out of the framebuffer
+        if(_nativeRes == 2  &&  _scanlineGap)
+        {
+            SDL_Rect gaps[GIGA_HEIGHT];
+            for(int i=0; i<GIGA_HEIGHT; i++)
+            {
+                int y0 = int((i*4 + 3) * scaleY + 0.5f);
+                int y1 = int((i*4 + 4) * scaleY + 0.5f);
+                gaps[i] = {0, y0, nativeDst.w, std::max(y1 - y0, 1)};
+            }
+            SDL_SetRenderDrawColor(_renderer, 0x00, 0x00, 0x00, 0xFF);
+            SDL_RenderFillRects(_renderer, gaps, GIGA_HEIGHT);
+        }
+    }
 
-        SDL_UpdateTexture(_screenTexture, NULL, _pixels, SCREEN_WIDTH * sizeof uint32_t);
-        SDL_RenderCopy(_renderer, _screenTexture, NULL, NULL);
+    // Main thread, uploads and presents the newest published frame, returns false if there wasn't a new one
+    bool present(void)
+    {
+        if(!_frames.update()) return false;
+
+        const Frame& frame = _frames.front();
+        if(_nativeRes)
+        {
+            presentNative(frame);
+        }
+        else
+        {
+            SDL_UpdateTexture(_screenTexture, NULL, frame._pixels, SCREEN_WIDTH * sizeof uint32_t);
+            SDL_RenderCopy(_renderer, _screenTexture, NULL, NULL);
+        }
         renderHelpScreen();
         SDL_RenderPresent(_renderer);
-        if(synchronise) Timing::synchronise();
+
+        return true;
     }
 
 
@@ -12,6 +12,7 @@
 #define SCREEN_HEIGHT    480
 #define GIGA_WIDTH       160
 #define GIGA_HEIGHT      120
+#define NATIVE_WIDTH     (GIGA_WIDTH+1) // Gigatron pixels plus the horizontal timing column
 #define GIGA_VRAM        0x0800
 #define GIGA_VTABLE      0x0100
 #define FONT_BMP_WIDTH   96
@@ -55,6 +56,7 @@ namespace Graphics
     int getWidth(void);
     int getHeight(void);
 
+    int getNativeRes(void);
     uint32_t* getPixels(void);
     uint32_t* getColours(void);
 
@@ -78,7 +80,8 @@ namespace Graphics
     void resetVTable(void);
 
     void refreshTimingPixel(const Cpu::State& S, int vgaX, int pixelY, uint32_t colour, bool debugging);
-    void refreshPixel(const Cpu::State& S, int vgaX, int vgaY, bool debugging);
+    // Expands a whole scanline of captured OUT bytes, (see Gigatron::Machine::_scanline), in one pass
+    void refreshScanline(const uint8_t* scanline, int vgaY, bool debugging);
     void refreshScreen(void);
 
     void drawLeds(void);
@@ -88,6 +91,7 @@ namespace Graphics
     void renderText(void);
     void renderTextWindow(void);
     void render(bool synchronise=true);
+    bool present(void);
 
     void drawLine(int x, int y, int x2, int y2, uint32_t colour);
     void drawLineGiga(uint16_t x, uint16_t y, uint16_t x2, uint16_t y2, uint8_t colour);
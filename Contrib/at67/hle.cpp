@@ -0,0 +1,967 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "memory.h"
+#include "cpu.h"
+#include "machine.h"
+#include "hle.h"
+
+
+namespace Hle
+{
+    // Handlers are literal transcriptions of the native instruction sequences that run between NEXT's dispatch and the next
+    // NEXT, including the order of reads and writes, so self modifying and overlapping zero page accesses behave identically
+    typedef bool (*VcpuHandler)(Cpu::State& S, uint8_t p, uint8_t d);
+
+    struct VcpuOp
+    {
+        VcpuHandler _handler = nullptr;
+        int _cycles = 0;      // NEXT to NEXT, always even, the native code arrives back at NEXT with AC = -_cycles/2, 0 for SYS
+        bool _reloadY = false; // returns through REENTER or NEXTY, which reload Y from vPC+1
+    };
+
+    struct VcpuRom
+    {
+        const char* _name;
+        uint32_t _signature;
+        VcpuOp* _ops;
+    };
+
+    VcpuOp _romv1Ops[256];
+    VcpuOp _devromOps[256];
+
+    // FNV-1a of ROM words VCPU_ROM_START to VCPU_ROM_END, ROMv2, ROMv3 and ROMv4 share an identical interpreter,
+    // ROMv1 only differs by the page of EXIT's return into the video loop, the DEVROM signature is dev.rom at the time of writing
+    std::vector<VcpuRom> _vCpuRoms =
+    {
+        {"ROMv1",    0x994CB7AF, _romv1Ops },
+        {"ROMv2-v4", 0xF4EBFC0E, _romv1Ops },
+        {"DEVROM",   0x7D2AB69D, _devromOps},
+    };
+
+    bool _enabled = false;
+    bool _verify = false;
+    bool _sysEnabled = false;
+
+    // Per thread, as each thread runs its own machine, (see Cpu::setMachine())
+    thread_local uint64_t _vCpuCount = 0;
+    thread_local uint64_t _verifyErrors = 0;
+
+    thread_local VcpuOp* _vCpuOps = nullptr;
+
+    thread_local Gigatron::Machine* _machine = nullptr;
+    thread_local uint8_t* _ram = nullptr;
+    thread_local uint16_t _ramMask = 0xFFFF;
+
+
+    bool getEnabled(void) {return _enabled;}
+    bool getVerify(void) {return _verify;}
+    bool getSysEnabled(void) {return _sysEnabled;}
+    bool getActive(void) {return _enabled  &&  _vCpuOps != nullptr;}
+    uint64_t getVcpuCount(void) {return _vCpuCount;}
+    uint64_t getVerifyErrors(void) {return _verifyErrors;}
+
+    void setEnabled(bool enabled) {_enabled = enabled;}
+    void setVerify(bool verify) {_verify = verify; if(verify) _enabled = true;}
+    void setSysEnabled(bool sysEnabled) {_sysEnabled = sysEnabled; if(sysEnabled) _enabled = true;}
+
+
+    inline uint8_t peek(uint16_t address) {return _ram[address & _ramMask];}
+    inline void poke(uint16_t address, uint8_t data) {_ram[address & _ramMask] = data; Gigatron::markDirty(*_machine, address & _ramMask);}
+    inline uint16_t yx(uint8_t y, uint8_t x) {return uint16_t((y <<8) | x);}
+
+
+    // ROMv1 through ROMv4 instruction set, entered after .next2 with vPC already advanced to p and X = p+1
+    bool LDWI(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_AC, d);
+        poke(VCPU_AC+1, peek(yx(S._Y, uint8_t(p + 2))));
+        poke(VCPU_PC, peek(VCPU_PC) + 1);
+        S._X = 0xF6;
+        return true;
+    }
+
+    bool LD(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_AC, peek(d));
+        poke(VCPU_AC+1, 0x00);
+        S._X = 0xF7;
+        return true;
+    }
+
+    bool LDW(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d + 1);
+        poke(VCPU_AC, peek(d));
+        uint8_t x = peek(VCPU_TMP);
+        poke(VCPU_AC+1, peek(x));
+        S._X = x;
+        return true;
+    }
+
+    bool STW(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d + 1);
+        poke(d, peek(VCPU_AC));
+        uint8_t x = peek(VCPU_TMP);
+        poke(x, peek(VCPU_AC+1));
+        S._X = x;
+        return true;
+    }
+
+    bool BCC(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        // Condition operands are entry points into the interpreter page, anything else is left to the native code
+        switch(d)
+        {
+            case 0x3F: case 0x4D: case 0x50: case 0x53: case 0x56: case 0x72: break;
+            default: return false;
+        }
+
+        uint8_t h = peek(VCPU_AC+1);
+        poke(VCPU_TMP, h);
+        if(h == 0  &&  peek(VCPU_AC) != 0) poke(VCPU_TMP, 0x01);
+
+        int8_t c = int8_t(peek(VCPU_TMP));
+        bool taken = false;
+        switch(d)
+        {
+            case 0x3F: taken = (c == 0); break; // EQ
+            case 0x4D: taken = (c >  0); break; // GT
+            case 0x50: taken = (c <  0); break; // LT
+            case 0x53: taken = (c >= 0); break; // GE
+            case 0x56: taken = (c <= 0); break; // LE
+            case 0x72: taken = (c != 0); break; // NE
+        }
+
+        if(taken)
+        {
+            S._X = p + 2;
+            poke(VCPU_PC, peek(yx(S._Y, S._X)));
+        }
+        else
+        {
+            S._X = p + 1;
+            poke(VCPU_PC, peek(VCPU_PC) + 1);
+        }
+        return true;
+    }
+
+    bool LDI(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_AC, d);
+        poke(VCPU_AC+1, 0x00);
+        S._X = 0xF8;
+        return true;
+    }
+
+    bool ST(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(d, peek(VCPU_AC));
+        S._X = peek(VCPU_SP);
+        return true;
+    }
+
+    bool POP(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_LR, peek(peek(VCPU_SP)));
+        uint8_t x = peek(VCPU_SP) + 1;
+        poke(VCPU_LR+1, peek(x));
+        poke(VCPU_SP, peek(VCPU_SP) + 2);
+        poke(VCPU_PC, peek(VCPU_PC) - 1);
+        S._X = x;
+        return true;
+    }
+
+    bool PUSH(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(uint8_t(peek(VCPU_SP) - 1), peek(VCPU_LR+1));
+        uint8_t x = peek(VCPU_SP) - 2;
+        poke(VCPU_SP, x);
+        poke(x, peek(VCPU_LR));
+        poke(VCPU_PC, peek(VCPU_PC) - 1);
+        S._X = x;
+        return true;
+    }
+
+    bool ANDI(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_AC, d & peek(VCPU_AC));
+        poke(VCPU_AC+1, 0x00);
+        return true;
+    }
+
+    bool ORI(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_AC, d | peek(VCPU_AC));
+        return true;
+    }
+
+    bool XORI(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_AC, d ^ peek(VCPU_AC));
+        return true;
+    }
+
+    bool BRA(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_PC, d);
+        S._X = 0xF9;
+        return true;
+    }
+
+    bool INC(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(d, peek(d) + 1);
+        S._X = d;
+        return true;
+    }
+
+    // Word add and subtract derive the carry from the sign bits and read it back from the constants at 0x0000 and 0x0080
+    bool ADDW(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d + 1);
+        uint8_t a = peek(VCPU_AC) + peek(d);
+        poke(VCPU_AC, a);
+        uint8_t c = (a & 0x80) ? (a - peek(d)) & peek(d) : (a - peek(d)) | peek(d);
+        a = peek(c & 0x80) + peek(VCPU_AC+1);
+        uint8_t x = peek(VCPU_TMP);
+        poke(VCPU_AC+1, a + peek(x));
+        S._X = x;
+        return true;
+    }
+
+    bool PEEK(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_PC, peek(VCPU_PC) - 1);
+        uint8_t x = peek(VCPU_AC);
+        poke(VCPU_AC, peek(yx(peek(VCPU_AC+1), x)));
+        poke(VCPU_AC+1, 0x00);
+        S._X = x;
+        return true;
+    }
+
+    bool SUBW(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d + 1);
+        uint8_t l = peek(VCPU_AC);
+        uint8_t a = l - peek(d);
+        poke(VCPU_AC, a);
+        uint8_t c = (l & 0x80) ? a & peek(d) : a | peek(d);
+        a = peek(VCPU_AC+1) - peek(c & 0x80);
+        uint8_t x = peek(VCPU_TMP);
+        poke(VCPU_AC+1, a - peek(x));
+        S._X = x;
+        return true;
+    }
+
+    bool DEF(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d);
+        poke(VCPU_AC, peek(VCPU_PC) + 2);
+        poke(VCPU_AC+1, peek(VCPU_PC+1));
+        poke(VCPU_PC, peek(VCPU_TMP));
+        return true;
+    }
+
+    bool CALL(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d);
+        poke(VCPU_LR, peek(VCPU_PC) + 2);
+        poke(VCPU_LR+1, peek(VCPU_PC+1));
+        poke(VCPU_PC, peek(peek(VCPU_TMP)) - 2);
+        uint8_t x = peek(VCPU_TMP) + 1;
+        uint8_t y = peek(x);
+        poke(VCPU_PC+1, y);
+        S._X = x;
+        S._Y = y;
+        return true;
+    }
+
+    bool ALLOC(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_SP, d + peek(VCPU_SP));
+        return true;
+    }
+
+    bool ADDI(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d);
+        uint8_t a = d + peek(VCPU_AC);
+        poke(VCPU_AC, a);
+        uint8_t c = (a & 0x80) ? (a - peek(VCPU_TMP)) & peek(VCPU_TMP) : (a - peek(VCPU_TMP)) | peek(VCPU_TMP);
+        uint8_t x = c & 0x80;
+        poke(VCPU_AC+1, peek(x) + peek(VCPU_AC+1));
+        S._X = x;
+        return true;
+    }
+
+    bool SUBI(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d);
+        uint8_t l = peek(VCPU_AC);
+        uint8_t a = l - peek(VCPU_TMP);
+        poke(VCPU_AC, a);
+        uint8_t c = (l & 0x80) ? a & peek(VCPU_TMP) : a | peek(VCPU_TMP);
+        uint8_t x = c & 0x80;
+        poke(VCPU_AC+1, peek(VCPU_AC+1) - peek(x));
+        S._X = x;
+        return true;
+    }
+
+    bool LSLW(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        uint8_t l = peek(VCPU_AC);
+        uint8_t x = l & 0x80;
+        poke(VCPU_AC, l + peek(VCPU_AC));
+        uint8_t a = peek(x) + peek(VCPU_AC+1);
+        poke(VCPU_AC+1, a + peek(VCPU_AC+1));
+        poke(VCPU_PC, peek(VCPU_PC) - 1);
+        S._X = x;
+        return true;
+    }
+
+    bool STLW(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        uint8_t t = d + peek(VCPU_SP);
+        poke(VCPU_TMP, t);
+        poke(uint8_t(t + 1), peek(VCPU_AC+1));
+        uint8_t x = peek(VCPU_TMP);
+        poke(x, peek(VCPU_AC));
+        S._X = x;
+        return true;
+    }
+
+    bool LDLW(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        uint8_t t = d + peek(VCPU_SP);
+        poke(VCPU_TMP, t);
+        poke(VCPU_AC+1, peek(uint8_t(t + 1)));
+        uint8_t x = peek(VCPU_TMP);
+        poke(VCPU_AC, peek(x));
+        S._X = x;
+        return true;
+    }
+
+    bool POKE(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d);
+        uint8_t y = peek(uint8_t(d + 1));
+        uint8_t x = peek(peek(VCPU_TMP));
+        poke(yx(y, x), peek(VCPU_AC));
+        S._X = x;
+        return true;
+    }
+
+    bool DOKE(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d);
+        uint8_t y = peek(uint8_t(d + 1));
+        uint8_t x = peek(peek(VCPU_TMP));
+        poke(yx(y, x), peek(VCPU_AC));
+        x++;
+        poke(yx(y, x), peek(VCPU_AC+1));
+        S._X = x;
+        return true;
+    }
+
+    bool DEEK(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_PC, peek(VCPU_PC) - 1);
+        uint8_t x = peek(VCPU_AC);
+        uint8_t y = peek(VCPU_AC+1);
+        poke(VCPU_AC, peek(yx(y, x++)));
+        poke(VCPU_AC+1, peek(yx(y, x)));
+        S._X = x;
+        return true;
+    }
+
+    bool ANDW(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d);
+        poke(VCPU_AC+1, peek(uint8_t(d + 1)) & peek(VCPU_AC+1));
+        uint8_t x = peek(VCPU_TMP);
+        poke(VCPU_AC, peek(x) & peek(VCPU_AC));
+        poke(VCPU_TMP, 0xF2);
+        S._X = x;
+        return true;
+    }
+
+    bool ORW(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d);
+        poke(VCPU_AC+1, peek(uint8_t(d + 1)) | peek(VCPU_AC+1));
+        uint8_t x = peek(VCPU_TMP);
+        poke(VCPU_AC, peek(x) | peek(VCPU_AC));
+        S._X = 0xF3;
+        return true;
+    }
+
+    bool XORW(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d);
+        poke(VCPU_AC+1, peek(uint8_t(d + 1)) ^ peek(VCPU_AC+1));
+        uint8_t x = peek(VCPU_TMP);
+        poke(VCPU_AC, peek(x) ^ peek(VCPU_AC));
+        S._X = x;
+        return true;
+    }
+
+    bool RET(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_PC, peek(VCPU_LR) - 2);
+        poke(VCPU_PC+1, peek(VCPU_LR+1));
+        return true;
+    }
+
+    // DEVROM moved part of the instruction set out of page 3, these are the ones whose side effects differ from ROMv1,
+    // ANDW and ORW jump back through the delay slot of their neighbour, which leaks into vTmp and X respectively
+    bool LD_DEVROM(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_AC, peek(d));
+        poke(VCPU_AC+1, 0x00);
+        S._X = d;
+        return true;
+    }
+
+    bool ST_DEVROM(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(d, peek(VCPU_AC));
+        S._X = d;
+        return true;
+    }
+
+    bool LDI_DEVROM(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_AC, d);
+        poke(VCPU_AC+1, 0x00);
+        return true;
+    }
+
+    bool BRA_DEVROM(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_PC, d);
+        return true;
+    }
+
+    bool ANDW_DEVROM(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d);
+        poke(VCPU_AC+1, peek(uint8_t(d + 1)) & peek(VCPU_AC+1));
+        uint8_t x = peek(VCPU_TMP);
+        uint8_t a = peek(x) & peek(VCPU_AC);
+        poke(VCPU_AC, a);
+        poke(VCPU_TMP, a);
+        S._X = x;
+        return true;
+    }
+
+    bool ORW_DEVROM(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        poke(VCPU_TMP, d);
+        poke(VCPU_AC+1, peek(uint8_t(d + 1)) | peek(VCPU_AC+1));
+        uint8_t x = peek(VCPU_TMP);
+        uint8_t a = peek(x) | peek(VCPU_AC);
+        poke(VCPU_AC, a);
+        S._X = a + 1;
+        return true;
+    }
+
+
+    // SYS functions, entered as the native code would enter them from SYS's 'jmp y,[sysFn]' with X = AC = operand + vTicks,
+    // each returns the number of cycles the native code would take from NEXT to NEXT, or 0 before touching any state if the
+    // call must run natively, they all return through REENTER
+    typedef int (*SysHandler)(Cpu::State& S);
+
+    struct SysFn
+    {
+        const char* _name;
+        uint16_t _address;
+        uint16_t _length;
+        uint16_t _extraAddress; // code outside the entry point that the function relies on, e.g. a trampoline target or lookup table
+        uint16_t _extraLength;
+        uint32_t _signature;
+        SysHandler _handler;
+    };
+
+    inline uint8_t shiftTable(uint8_t index) {return Cpu::getROM(0x0500 | index, ROM_DATA);}
+
+    int SYS_Random_34(Cpu::State& S)
+    {
+        uint8_t a = peek(0x000E) ^ peek(0x0007) ^ peek(0x000F);
+        a += peek(0x0006);
+        poke(0x0006, a);
+        poke(VCPU_AC, a);
+        a += peek(0x0008);
+        poke(0x0008, a);
+        a ^= (a & 0x80) ? 0x6C : 0x53;
+        a += peek(0x0007);
+        poke(0x0007, a);
+        poke(VCPU_AC+1, a);
+        return 34;
+    }
+
+    // Right shifts are ROM lookups, (the table at 0x0500 holds i >> n where n is one more than the position of i's lowest zero bit)
+    int lsrw(uint8_t n, uint8_t vTmp)
+    {
+        uint8_t mask = uint8_t(0xFF << n), ones = uint8_t((1 << (n - 1)) - 1);
+        poke(VCPU_AC, shiftTable((peek(VCPU_AC) & mask) | ones));
+        poke(VCPU_AC, uint8_t(peek(VCPU_AC+1) << (8 - n)) | peek(VCPU_AC));
+        poke(VCPU_TMP, vTmp);
+        poke(VCPU_AC+1, shiftTable((peek(VCPU_AC+1) & mask) | ones));
+        return 0;
+    }
+
+    int SYS_LSRW1_48(Cpu::State& S) {lsrw(1, 0x15); return 48;}
+    int SYS_LSRW2_52(Cpu::State& S) {lsrw(2, 0x32); return 52;}
+    int SYS_LSRW3_52(Cpu::State& S) {lsrw(3, 0x4E); return 52;}
+    int SYS_LSRW4_50(Cpu::State& S) {lsrw(4, 0x69); return 50;}
+    int SYS_LSRW5_50(Cpu::State& S) {lsrw(5, 0x83); return 50;}
+    int SYS_LSRW6_48(Cpu::State& S) {lsrw(6, 0x9C); return 48;}
+
+    int SYS_LSRW7_30(Cpu::State& S)
+    {
+        uint8_t x = peek(VCPU_AC) & 0x80;
+        poke(VCPU_AC, uint8_t(peek(VCPU_AC+1) << 1) | peek(x));
+        x = peek(VCPU_AC+1) & 0x80;
+        poke(VCPU_AC+1, peek(x));
+        S._X = x;
+        return 30;
+    }
+
+    int SYS_LSRW8_24(Cpu::State& S)
+    {
+        poke(VCPU_AC, peek(VCPU_AC+1));
+        poke(VCPU_AC+1, 0x00);
+        return 24;
+    }
+
+    int SYS_LSLW4_46(Cpu::State& S)
+    {
+        poke(VCPU_TMP, 0xAE);
+        poke(VCPU_AC+1, uint8_t(peek(VCPU_AC+1) << 4));
+        poke(VCPU_AC+1, shiftTable((peek(VCPU_AC) & 0xF0) | 0x07) | peek(VCPU_AC+1));
+        poke(VCPU_AC, uint8_t(peek(VCPU_AC) << 4));
+        return 46;
+    }
+
+    int SYS_LSLW8_24(Cpu::State& S)
+    {
+        poke(VCPU_AC+1, peek(VCPU_AC));
+        poke(VCPU_AC, 0x00);
+        return 24;
+    }
+
+    int SYS_Draw4_30(Cpu::State& S)
+    {
+        uint8_t x = peek(VCPU_SYS_ARGS+4);
+        uint8_t y = peek(VCPU_SYS_ARGS+5);
+        for(int i=0; i<4; i++) poke(yx(y, x++), peek(VCPU_SYS_ARGS+i));
+        S._X = x;
+        return 30;
+    }
+
+    // The loop counter lives in vTmp and is re-read every iteration, a column that crosses vTmp runs natively
+    int SYS_VDrawBits_134(Cpu::State& S)
+    {
+        uint8_t x = peek(VCPU_SYS_ARGS+4);
+        if(x == VCPU_TMP) return 0;
+
+        for(uint8_t i=0; i<8; i++)
+        {
+            poke(VCPU_TMP, i);
+            uint8_t y = i + peek(VCPU_SYS_ARGS+5);
+            uint8_t colour = (peek(VCPU_SYS_ARGS+2) & 0x80) ? peek(VCPU_SYS_ARGS+1) : peek(VCPU_SYS_ARGS+0);
+            poke(yx(y, x), colour);
+            poke(VCPU_SYS_ARGS+2, peek(VCPU_SYS_ARGS+2) << 1);
+        }
+
+        S._X = x;
+        return 134;
+    }
+
+    // Unpacks 3 bytes into 4 pixels using the >>2 sound table in RAM page 7, (the native code never touches the ROM here)
+    int SYS_Unpack_56(Cpu::State& S)
+    {
+        uint8_t x = peek(VCPU_SYS_ARGS+2) | 0x03;
+        poke(VCPU_SYS_ARGS+3, peek(yx(0x07, x)));
+        poke(VCPU_SYS_ARGS+2, uint8_t((peek(VCPU_SYS_ARGS+2) & 0x03) << 4));
+        x = peek(VCPU_SYS_ARGS+1) | 0x03;
+        x = peek(yx(0x07, x)) | 0x03;
+        poke(VCPU_SYS_ARGS+2, peek(yx(0x07, x)) | peek(VCPU_SYS_ARGS+2));
+        poke(VCPU_SYS_ARGS+1, uint8_t((peek(VCPU_SYS_ARGS+1) & 0x0F) << 2));
+        x = peek(VCPU_SYS_ARGS+0) | 0x03;
+        x = peek(yx(0x07, x)) | 0x03;
+        x = peek(yx(0x07, x)) | 0x03;
+        poke(VCPU_SYS_ARGS+1, peek(yx(0x07, x)) | peek(VCPU_SYS_ARGS+1));
+        poke(VCPU_SYS_ARGS+0, peek(VCPU_SYS_ARGS+0) & 0x3F);
+        S._X = x;
+        return 56;
+    }
+
+    // Sets up to 4 bytes per invocation, restarts itself by backing up vPC until the count reaches zero
+    int SYS_SetMemory_v2_54(Cpu::State& S)
+    {
+        static const int cycles[4] = {32, 38, 44, 50};
+
+        uint8_t x = peek(VCPU_SYS_ARGS+2);
+        uint8_t y = peek(VCPU_SYS_ARGS+3);
+        for(int i=0; i<4; i++)
+        {
+            poke(VCPU_SYS_ARGS+0, peek(VCPU_SYS_ARGS+0) - 1);
+            poke(yx(y, x++), peek(VCPU_SYS_ARGS+1));
+            if(peek(VCPU_SYS_ARGS+0) == 0)
+            {
+                S._X = x;
+                return cycles[i];
+            }
+        }
+
+        poke(VCPU_PC, peek(VCPU_PC) - 2);
+        poke(VCPU_SYS_ARGS+2, peek(VCPU_SYS_ARGS+2) + 4);
+        S._X = x;
+        return 54;
+    }
+
+    // One 6 pixel row per invocation, a negative byte in the source terminates the sprite and adjusts the source and destination,
+    // mirrored sprites are read into sysArgs backwards and written forwards, flipped sprites are drawn upwards
+    int sprite6(Cpu::State& S, bool mirror, bool flip)
+    {
+        uint8_t x = peek(VCPU_SYS_ARGS+0);
+        uint8_t y = peek(VCPU_SYS_ARGS+1);
+        uint8_t a = peek(yx(y, x++));
+        if(a & 0x80)
+        {
+            if(flip) a = (a ^ 0xFF) + 1;
+            poke(VCPU_AC+1, a + peek(VCPU_AC+1));
+            poke(VCPU_AC, (mirror) ? peek(VCPU_AC) - 6 : peek(VCPU_AC) + 6);
+            poke(VCPU_SYS_ARGS+0, peek(VCPU_SYS_ARGS+0) + 1);
+            S._X = x;
+            return (flip) ? 36 : 34;
+        }
+
+        // Sources are copied through sysArgs2-7, the native code also writes each source byte back to itself unchanged
+        if(mirror)
+        {
+            poke(VCPU_SYS_ARGS+7, a);
+            for(int i=6; i>=3; i--) poke(VCPU_SYS_ARGS+i, peek(yx(y, x++)));
+            a = peek(yx(y, x++));
+        }
+        else
+        {
+            poke(VCPU_SYS_ARGS+2, a);
+            for(int i=3; i<=7; i++) poke(VCPU_SYS_ARGS+i, peek(yx(y, x++)));
+        }
+
+        x = peek(VCPU_AC);
+        y = peek(VCPU_AC+1);
+        if(mirror) poke(yx(y, x++), a);
+        for(int i=(mirror) ? 3 : 2; i<=7; i++) poke(yx(y, x++), peek(VCPU_SYS_ARGS+i));
+
+        poke(VCPU_SYS_ARGS+0, peek(VCPU_SYS_ARGS+0) + 6);
+        poke(VCPU_AC+1, (flip) ? peek(VCPU_AC+1) - 1 : peek(VCPU_AC+1) + 1);
+        poke(VCPU_PC, peek(VCPU_PC) - 2);
+        S._X = x;
+        return (mirror) ? 62 : 64;
+    }
+
+    int SYS_Sprite6_v3_64(Cpu::State& S)   {return sprite6(S, false, false);}
+    int SYS_Sprite6x_v3_64(Cpu::State& S)  {return sprite6(S, true,  false);}
+    int SYS_Sprite6y_v3_64(Cpu::State& S)  {return sprite6(S, false, true );}
+    int SYS_Sprite6xy_v3_64(Cpu::State& S) {return sprite6(S, true,  true );}
+
+    // Signatures are FNV-1a of the function's ROM words followed by its extra range, functions are only emulated where the
+    // code in the loaded ROM matches, (ROMv1 has no SetMemory and no Sprite6, ROMv2 has no Sprite6, DEVROM's VDrawBits and
+    // SetMemory differ), SYS_Exec_88, SYS_Read3_40 and the I/O functions always run natively
+    std::vector<SysFn> _sysFnRegistry =
+    {
+        {"SYS_Random_34",       0x04A7, 18, 0x0000,   0, 0xC7DDDD45, SYS_Random_34      },
+        {"SYS_LSRW7_30",        0x04B9, 13, 0x0000,   0, 0xA2F176D2, SYS_LSRW7_30       },
+        {"SYS_LSRW8_24",        0x04C6,  7, 0x0000,   0, 0xCBED462C, SYS_LSRW8_24       },
+        {"SYS_LSLW8_24",        0x04CD,  7, 0x0000,   0, 0xB3D1C8C3, SYS_LSLW8_24       },
+        {"SYS_Draw4_30",        0x04D4, 13, 0x0000,   0, 0x1BB632A1, SYS_Draw4_30       },
+        {"SYS_VDrawBits_134",   0x04E1, 20, 0x0000,   0, 0xEFEA7208, SYS_VDrawBits_134  },
+        {"SYS_LSRW1_48",        0x0600, 25, 0x0500, 257, 0x795FFE3D, SYS_LSRW1_48       },
+        {"SYS_LSRW2_52",        0x0619, 29, 0x0500, 257, 0xE3FE3101, SYS_LSRW2_52       },
+        {"SYS_LSRW3_52",        0x0636, 28, 0x0500, 257, 0xB5F63C62, SYS_LSRW3_52       },
+        {"SYS_LSRW4_50",        0x0652, 27, 0x0500, 257, 0xCC927DDA, SYS_LSRW4_50       },
+        {"SYS_LSRW5_50",        0x066D, 26, 0x0500, 257, 0xF769E407, SYS_LSRW5_50       },
+        {"SYS_LSRW6_48",        0x0687, 25, 0x0500, 257, 0x47D69263, SYS_LSRW6_48       },
+        {"SYS_LSLW4_46",        0x06A0, 25, 0x0500, 257, 0xC7FECBB3, SYS_LSLW4_46       },
+        {"SYS_Unpack_56",       0x06C0, 39, 0x0000,   0, 0xF56E6F89, SYS_Unpack_56      },
+        {"SYS_SetMemory_v2_54", 0x0B03,  3, 0x0B30,  47, 0xBB533728, SYS_SetMemory_v2_54},
+        {"SYS_Sprite6_v3_64",   0x0C00, 59, 0x0000,   0, 0x2F9813EF, SYS_Sprite6_v3_64  },
+        {"SYS_Sprite6x_v3_64",  0x0C40, 57, 0x0000,   0, 0x711D3BDF, SYS_Sprite6x_v3_64 },
+        {"SYS_Sprite6y_v3_64",  0x0C80, 61, 0x0000,   0, 0x0C6E8510, SYS_Sprite6y_v3_64 },
+        {"SYS_Sprite6xy_v3_64", 0x0CC0, 59, 0x0000,   0, 0x29588898, SYS_Sprite6xy_v3_64},
+    };
+
+    thread_local std::vector<const SysFn*> _sysFns;
+    thread_local int _sysCycles = 0;
+
+    bool SYS(Cpu::State& S, uint8_t p, uint8_t d)
+    {
+        if(!_sysEnabled) return false;
+
+        // Not enough ticks left, the native code backs up vPC and retries in the next time slice
+        uint8_t a = d + peek(VCPU_TICKS);
+        if(a & 0x80) return false;
+
+        uint16_t address = yx(peek(VCPU_SYS_FN+1), peek(VCPU_SYS_FN));
+        for(int i=0; i<int(_sysFns.size()); i++)
+        {
+            if(_sysFns[i]->_address == address)
+            {
+                S._X = a;
+                _sysCycles = _sysFns[i]->_handler(S);
+                return _sysCycles != 0;
+            }
+        }
+
+        return false;
+    }
+
+
+    void setOp(VcpuOp* ops, uint8_t opcode, VcpuHandler handler, int cycles, bool reloadY)
+    {
+        ops[opcode]._handler = handler;
+        ops[opcode]._cycles = cycles;
+        ops[opcode]._reloadY = reloadY;
+    }
+
+    // LUP is not emulated, it runs natively, as do DEVROM's CMPHS, CALLI and CMPHU, SYS is only emulated for registered functions
+    void initialise(void)
+    {
+        VcpuOp* ops = _romv1Ops;
+        setOp(ops, 0x11, LDWI,  20, false);
+        setOp(ops, 0x1A, LD,    18, false);
+        setOp(ops, 0x21, LDW,   20, false);
+        setOp(ops, 0x2B, STW,   20, false);
+        setOp(ops, 0x35, BCC,   28, false);
+        setOp(ops, 0x59, LDI,   16, false);
+        setOp(ops, 0x5E, ST,    16, false);
+        setOp(ops, 0x63, POP,   26, false);
+        setOp(ops, 0x75, PUSH,  26, false);
+        setOp(ops, 0x82, ANDI,  16, false);
+        setOp(ops, 0x88, ORI,   14, false);
+        setOp(ops, 0x8C, XORI,  14, false);
+        setOp(ops, 0x90, BRA,   14, false);
+        setOp(ops, 0x93, INC,   16, false);
+        setOp(ops, 0x99, ADDW,  28, false);
+        setOp(ops, 0xAD, PEEK,  26, true );
+        setOp(ops, 0xB4, SYS,    0, true );
+        setOp(ops, 0xB8, SUBW,  28, true );
+        setOp(ops, 0xCD, DEF,   26, true );
+        setOp(ops, 0xCF, CALL,  26, false);
+        setOp(ops, 0xDF, ALLOC, 14, false);
+        setOp(ops, 0xE3, ADDI,  28, true );
+        setOp(ops, 0xE6, SUBI,  28, true );
+        setOp(ops, 0xE9, LSLW,  28, true );
+        setOp(ops, 0xEC, STLW,  26, true );
+        setOp(ops, 0xEE, LDLW,  26, true );
+        setOp(ops, 0xF0, POKE,  26, true );
+        setOp(ops, 0xF3, DOKE,  28, true );
+        setOp(ops, 0xF6, DEEK,  28, true );
+        setOp(ops, 0xF8, ANDW,  28, true );
+        setOp(ops, 0xFA, ORW,   28, true );
+        setOp(ops, 0xFC, XORW,  26, true );
+        setOp(ops, 0xFF, RET,   20, true );
+
+        ops = _devromOps;
+        for(int i=0; i<256; i++) ops[i] = _romv1Ops[i];
+        setOp(ops, 0x1A, LD_DEVROM,   22, true);
+        setOp(ops, 0x59, LDI_DEVROM,  16, true);
+        setOp(ops, 0x5E, ST_DEVROM,   16, true);
+        setOp(ops, 0x63, POP,         26, true);
+        setOp(ops, 0x75, PUSH,        26, true);
+        setOp(ops, 0x82, ANDI,        22, true);
+        setOp(ops, 0x90, BRA_DEVROM,  14, true);
+        setOp(ops, 0x93, INC,         20, true);
+        setOp(ops, 0xCD, DEF,         24, true);
+        setOp(ops, 0xF8, ANDW_DEVROM, 28, true);
+        setOp(ops, 0xFA, ORW_DEVROM,  28, true);
+
+        detectRom();
+    }
+
+    uint32_t romSignature(uint16_t address, int length, uint32_t hash=0x811C9DC5)
+    {
+        for(int i=address; i<address+length; i++)
+        {
+            hash = (hash ^ Cpu::getROM(uint16_t(i), ROM_INST)) * 0x01000193;
+            hash = (hash ^ Cpu::getROM(uint16_t(i), ROM_DATA)) * 0x01000193;
+        }
+
+        return hash;
+    }
+
+    // SYS functions are matched individually, so ROMs that share a function's code share its emulation
+    void detectSysFns(void)
+    {
+        _sysFns.clear();
+        if(!_sysEnabled) return;
+
+        for(int i=0; i<int(_sysFnRegistry.size()); i++)
+        {
+            const SysFn& sysFn = _sysFnRegistry[i];
+            uint32_t signature = romSignature(sysFn._address, sysFn._length);
+            signature = romSignature(sysFn._extraAddress, sysFn._extraLength, signature);
+            if(signature == sysFn._signature) _sysFns.push_back(&sysFn);
+        }
+    }
+
+    // Only ROMs whose interpreter matches a known signature are emulated, anything else runs natively
+    void detectRom(void)
+    {
+        uint32_t signature = romSignature(VCPU_ROM_START, VCPU_ROM_END - VCPU_ROM_START + 1);
+
+        VcpuOp* vCpuOps = nullptr;
+        const char* name = nullptr;
+        for(int i=0; i<int(_vCpuRoms.size()); i++)
+        {
+            if(_vCpuRoms[i]._signature == signature)
+            {
+                vCpuOps = _vCpuRoms[i]._ops;
+                name = _vCpuRoms[i]._name;
+                break;
+            }
+        }
+
+        if(_enabled  &&  vCpuOps != _vCpuOps)
+        {
+            if(vCpuOps)
+            {
+                fprintf(stderr, "Hle::detectRom() : vCPU interpreter matches %s : signature 0x%08x\n", name, signature);
+            }
+            else
+            {
+                fprintf(stderr, "Hle::detectRom() : unknown vCPU interpreter : signature 0x%08x : running natively\n", signature);
+            }
+        }
+
+        _vCpuOps = vCpuOps;
+
+        detectSysFns();
+    }
+
+    void romWritten(uint16_t address)
+    {
+        if(address >= VCPU_ROM_START  &&  address <= VCPU_ROM_END)
+        {
+            detectRom();
+            return;
+        }
+
+        for(int i=0; i<int(_sysFnRegistry.size()); i++)
+        {
+            const SysFn& sysFn = _sysFnRegistry[i];
+            if((address >= sysFn._address  &&  address < sysFn._address + sysFn._length)  ||
+               (address >= sysFn._extraAddress  &&  address < sysFn._extraAddress + sysFn._extraLength))
+            {
+                detectSysFns();
+                return;
+            }
+        }
+    }
+
+    int execute(Cpu::State& S)
+    {
+        uint8_t ticks = S._AC + peek(VCPU_TICKS);
+        if(ticks & 0x80) return 0; // EXIT back to the video loop
+
+        // .next2, the stores come first as the instruction may overlap vTicks or vPC in page 0
+        uint8_t oldTicks = peek(VCPU_TICKS);
+        uint8_t oldPC = peek(VCPU_PC);
+        uint8_t p = oldPC + 2;
+        poke(VCPU_TICKS, ticks);
+        poke(VCPU_PC, p);
+
+        uint8_t opcode = peek(yx(S._Y, p));
+        const VcpuOp& op = _vCpuOps[opcode];
+        if(op._handler == nullptr)
+        {
+            poke(VCPU_TICKS, oldTicks);
+            poke(VCPU_PC, oldPC);
+            return 0;
+        }
+        uint8_t d = peek(yx(S._Y, uint8_t(p + 1)));
+
+        Cpu::State T = S;
+        T._X = p + 1;
+        if(!op._handler(T, p, d))
+        {
+            poke(VCPU_TICKS, oldTicks);
+            poke(VCPU_PC, oldPC);
+            return 0;
+        }
+
+        int cycles = (op._cycles) ? op._cycles : _sysCycles;
+        if(op._reloadY) T._Y = peek(VCPU_PC+1);
+        T._AC = uint8_t(-(cycles >> 1));
+        S = T;
+
+        return cycles;
+    }
+
+    // Runs the native code for the same instruction from the same state and reports any divergence, the native result is kept
+    int verify(Cpu::State& S)
+    {
+        static thread_local std::vector<uint8_t> ramBefore, ramHle;
+        int ramSize = _ramMask + 1;
+        ramBefore.assign(_ram, _ram + ramSize);
+
+        uint8_t opcode = peek(yx(S._Y, uint8_t(peek(VCPU_PC) + 2)));
+        uint16_t vPC = yx(peek(VCPU_PC+1), peek(VCPU_PC));
+        Cpu::State H = S;
+        int hleCycles = execute(H);
+        if(hleCycles == 0) return 0;
+
+        ramHle.assign(_ram, _ram + ramSize);
+        memcpy(_ram, &ramBefore[0], ramSize);
+
+        Cpu::State N = S, T;
+        int cycles = 0;
+        do
+        {
+            Cpu::cycle(N, T);
+            N = T;
+            cycles++;
+        }
+        while(N._PC != VCPU_NEXT_EXEC  &&  cycles < 10000);
+
+        bool error = (hleCycles != cycles  ||  H._AC != N._AC  ||  H._X != N._X  ||  H._Y != N._Y  ||  H._PC != N._PC);
+        int address = -1;
+        for(int i=0; i<ramSize; i++)
+        {
+            if(_ram[i] != ramHle[i]) {address = i; error = true; break;}
+        }
+
+        if(error)
+        {
+            _verifyErrors++;
+            fprintf(stderr, "Hle::verify() : opcode 0x%02x at vPC 0x%04x : cycles %d/%d : AC %02x/%02x : X %02x/%02x : Y %02x/%02x", opcode, vPC,
+                            hleCycles, cycles, H._AC, N._AC, H._X, N._X, H._Y, N._Y);
+            if(address >= 0) fprintf(stderr, " : RAM[0x%04x] %02x/%02x", address, ramHle[address], _ram[address]);
+            fprintf(stderr, "\n");
+        }
+
+        S = N;
+
+        return cycles;
+    }
+
+    int vCpuStep(Cpu::State& S, uint16_t& vPC)
+    {
+        int ramSize = 0;
+        _machine = &Cpu::getMachine();
+        _ram = Cpu::getPtrToRAM(ramSize);
+        _ramMask = uint16_t(ramSize - 1);
+
+        vPC = yx(peek(VCPU_PC+1), uint8_t(peek(VCPU_PC) + 2));
+        int cycles = (_verify) ? verify(S) : execute(S);
+        if(cycles) _vCpuCount++;
+
+        return cycles;
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef HLE_H
+#define HLE_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+
+// vCPU interpreter entry points and zero page registers, shared by ROMv1 through DEVROM
+#define VCPU_NEXT        0x0301
+#define VCPU_NEXT_EXEC   0x0302 // native PC when NEXT's first instruction is about to execute
+#define VCPU_ROM_START   0x0300
+#define VCPU_ROM_END     0x04FF
+#define VCPU_MAX_CYCLES  28
+
+#define VCPU_TICKS  0x0015
+#define VCPU_PC     0x0016
+#define VCPU_AC     0x0018
+#define VCPU_LR     0x001A
+#define VCPU_SP     0x001C
+#define VCPU_TMP    0x001D
+#define VCPU_SYS_FN    0x0022
+#define VCPU_SYS_ARGS  0x0024
+
+
+namespace Hle
+{
+    bool getEnabled(void);
+    bool getVerify(void);
+    bool getSysEnabled(void);
+    bool getActive(void);
+    uint64_t getVcpuCount(void);
+    uint64_t getVerifyErrors(void);
+
+    void setEnabled(bool enabled);
+    void setVerify(bool verify);
+    void setSysEnabled(bool sysEnabled);
+
+    void initialise(void);
+    void detectRom(void);
+    void romWritten(uint16_t address);
+
+    // Executes the vCPU instruction at vPC in C++ when the native CPU is at NEXT, S is left exactly as the native code would
+    // leave it when it arrives back at NEXT, returns the number of native cycles consumed or 0 if the native code must run
+    int vCpuStep(Cpu::State& S, uint16_t& vPC);
+}
+
+#endif
@@ -9,8 +9,10 @@
 #include "editor.h"
 #include "timing.h"
 #include "graphics.h"
+#include "machine.h"
 #include "inih/INIReader.h"
 #include "rs232/rs232.h"
+#include "babelfish.h"
 
 #if defined(_WIN32)
 #include <direct.h>
@@ -40,6 +42,10 @@
 #define DEFAULT_COM_PORT      0
 #define DEFAULT_GIGA_TIMEOUT  5.0
 #define MAX_GT1_SIZE          (1<<16)
+#define MENU_DOWN_PRESSES     10 // 'Loader' is at the bottom of every ROM's menu
+#define MENU_PRESS_FRAMES     2
+#define MENU_KEY_FRAMES       5  // press and release, (BabelFish waits 50ms between presses)
+#define MENU_READY_FRAMES     60 // Loader's start up
 
 
 namespace Loader
@@ -273,10 +279,6 @@ namespace Loader
 
 
 #ifndef STAND_ALONE
-    enum LoaderState {FirstByte=0, MsgLength, LowAddress, HighAddress, Message, LastByte, ResetIN, NumLoaderStates};
-    enum FrameState {Resync=0, Frame, Execute, NumFrameStates};
-
-
     UploadTarget _uploadTarget = None;
     bool _disableUploads = false;
 
@@ -288,7 +290,10 @@ namespace Loader
 
     int _configBaudRate = DEFAULT_COM_BAUD_RATE;
     int _configComPort = DEFAULT_COM_PORT;
+    std::string _configComDevice;
     double _configTimeOut = DEFAULT_GIGA_TIMEOUT;
+    int _configPipeline = BABELFISH_PIPELINE;
+    int _configRetries = BABELFISH_RETRIES;
     
     std::string _configGclBuild = ".";
     bool _configGclBuildFound = false;
@@ -296,6 +301,11 @@ namespace Loader
     std::vector<ConfigRom> _configRoms;
 
     std::string _currentGame = "";
+    thread_local Gt1File _bootGt1File; // one per machine, batch jobs load gt1s in parallel
+
+    // gt1 file being streamed through the ROM's Loader, repacked into PAYLOAD_SIZE byte packets
+    std::vector<Gt1Segment> _loaderPackets;
+    uint16_t _loaderStart = 0;
 
     INIReader _configIniReader;
     INIReader _highScoresIniReader;
@@ -306,7 +316,14 @@ namespace Loader
     void setCurrentGame(std::string& currentGame) {_currentGame = currentGame;}
 
     UploadTarget getUploadTarget(void) {return _uploadTarget;}
-    void setUploadTarget(UploadTarget target) {_uploadTarget = target;}
+    void uploadHook(void) {upload(Cpu::getMachine()._vgaY);}
+
+    // The upload runs from the CPU's scanline hook, which is only registered while there is something to upload
+    void setUploadTarget(UploadTarget target)
+    {
+        _uploadTarget = target;
+        if(_uploadTarget != None) Cpu::addHook(Cpu::ScanlineHook, uploadHook);
+    }
 
     int getConfigRomsSize(void) {return int(_configRoms.size());}
     ConfigRom* getConfigRom(int index)
@@ -358,13 +375,17 @@ namespace Loader
                          getKeyAsString(_configIniReader, sectionString, "BaudRate", "115200", result);   
                         _configBaudRate = strtol(result.c_str(), nullptr, 10);
  
-                        // Com port
+                        // Com port, an index, a name or a device path
                         char *endPtr;
-                        getKeyAsString(_configIniReader, sectionString, "ComPort", "0", result);   
+                        getKeyAsString(_configIniReader, sectionString, "ComPort", "0", result, false);   
                         _configComPort = strtol(result.c_str(), &endPtr, 10);
-                        if((endPtr - &result[0]) != result.size())
+                        if(result.size()  &&  result[0] == '/')
                         {
-                            _configComPort = comFindPort(result.c_str());
+                            _configComDevice = result;
+                        }
+                        else if((endPtr - &result[0]) != result.size())
+                        {
+                            _configComPort = comFindPort(Expression::strToUpper(result).c_str());
                             if(_configComPort < 0) _configComPort = DEFAULT_COM_PORT;
                         }
 
@@ -372,6 +393,12 @@ namespace Loader
                         getKeyAsString(_configIniReader, sectionString, "TimeOut", "5.0", result);
                         _configTimeOut = strtod(result.c_str(), nullptr);
 
+                        // Upload pipelining and retries
+                        getKeyAsString(_configIniReader, sectionString, "Pipeline", std::to_string(BABELFISH_PIPELINE), result);
+                        _configPipeline = std::max(int(strtol(result.c_str(), nullptr, 10)), 0);
+                        getKeyAsString(_configIniReader, sectionString, "Retries", std::to_string(BABELFISH_RETRIES), result);
+                        _configRetries = std::max(int(strtol(result.c_str(), nullptr, 10)), 0);
+
                         // GCL tools build path
                         _configGclBuildFound = getKeyAsString(_configIniReader, sectionString, "GclBuild", ".", result, false);
                         _configGclBuild = result;
@@ -464,43 +491,60 @@ namespace Loader
         return int(names.size());
     }
 
+    void setComDevice(const std::string& device) {_configComDevice = device;}
+
+    // Opens the configured device path, or the COM port at index comPort, (-1 searches for an Arduino on Linux and MacOS)
     bool openComPort(int comPort)
     {
-        if(_numComPorts == 0)
+        std::string device = _configComDevice;
+        if(device.empty())
         {
-            _numComPorts = comEnumerate();
             if(_numComPorts == 0)
             {
-                fprintf(stderr, "Loader::openComPort() : no COM ports found.\n");
-                return false;
+                _numComPorts = comEnumerate();
+                if(_numComPorts == 0)
+                {
+                    fprintf(stderr, "Loader::openComPort() : no COM ports found.\n");
+                    return false;
+                }
             }
-        }
 
-        _currentComPort = comPort;
+            _currentComPort = comPort;
 
 #ifdef _WIN32
-        if(_currentComPort == -1) _currentComPort = 0;
+            if(_currentComPort == -1) _currentComPort = 0;
 #else
-        if(_currentComPort == -1)
-        {
-            _currentComPort = 0;
-            std::vector<std::string> names;
-            matchFileSystemName("/dev/", "tty.usbmodem", names);
-            if(names.size() == 0) matchFileSystemName("/dev/", "ttyACM", names);
-            if(names.size()) _currentComPort = comFindPort(names[0].c_str());
-        }
+            if(_currentComPort == -1)
+            {
+                _currentComPort = 0;
+                std::vector<std::string> names;
+                matchFileSystemName("/dev/", "tty.usbmodem", names);
+                if(names.size() == 0) matchFileSystemName("/dev/", "ttyACM", names);
+                if(names.size()) device = names[0];
+            }
 #endif        
 
-        if(_currentComPort < 0)
-        {
-            _numComPorts = 0;
-            fprintf(stderr, "Loader::openComPort() : couldn't open any COM port.\n");
-            return false;
-        } 
-        else if(comOpen(_currentComPort, _configBaudRate) == 0)
+            if(device.empty())
+            {
+#ifdef _WIN32
+                const char* name = comGetPortName(_currentComPort);
+#else
+                const char* name = comGetInternalName(_currentComPort);
+#endif
+                if(name == nullptr)
+                {
+                    _numComPorts = 0;
+                    fprintf(stderr, "Loader::openComPort() : couldn't open any COM port.\n");
+                    return false;
+                }
+                device = name;
+            }
+        }
+
+        if(!BabelFish::open(device, _configBaudRate))
         {
             _numComPorts = 0;
-            fprintf(stderr, "Loader::openComPort() : couldn't open COM port '%s'\n", comGetPortName(_currentComPort));
+            fprintf(stderr, "Loader::openComPort() : couldn't open COM port '%s'\n", device.c_str());
             return false;
         } 
 
@@ -509,134 +553,88 @@ namespace Loader
 
     void closeComPort(void)
     {
-        comClose(_currentComPort);
-    }
-
-    bool readLineGiga(std::string& line)
-    {
-        line.clear();
-        char buffer = 0;
-        uint64_t prevFrameCounter = SDL_GetPerformanceCounter();
-
-        while(buffer != '\n')
-        {
-            if(comRead(_currentComPort, &buffer, 1)) line.push_back(buffer);
-            double frameTime = double(SDL_GetPerformanceCounter() - prevFrameCounter) / double(SDL_GetPerformanceFrequency());
-            if(frameTime > _configTimeOut) return false;
-        }
-
-        // Replace '\n'
-        line.back() = 0;
-
-        return true;
-    }
-
-    bool waitForPromptGiga(std::string& line)
-    {
-        do
-        {
-            if(!readLineGiga(line))
-            {
-                fprintf(stderr, "Loader::waitForPromptGiga() : timed out on serial port : '%s'\n", comGetPortName(_currentComPort));
-                return false;
-            }
-
-            if(size_t e = line.find('!') != std::string::npos)
-            {
-                fprintf(stderr, "Loader::waitForPromptGiga() : Arduino Error : '%s'\n", &line[e]);
-                return false;
-            }
-        }
-        while(line.find('?') == std::string::npos);
-
-        return true;
-    }
-    
-
-    void sendCommandToGiga(char cmd, std::string& line, bool wait)
-    {
-        char command[2] = {cmd, '\n'};
-        comWrite(_currentComPort, command, 2);
-
-        // Wait for ready prompt
-        if(wait) waitForPromptGiga(line);
+        BabelFish::close();
     }
 
     void sendCommandToGiga(char cmd, bool wait)
     {
         if(!openComPort(_configComPort)) return;
 
-        std::string line;
-        sendCommandToGiga(cmd, line, false);
+        uint8_t command[2] = {uint8_t(cmd), '\n'};
+        BabelFish::write(command, 2);
 
         closeComPort();
     }
 
-    int uploadToGigaThread(void* userData)
+    void updateUploadBar(float upload) {Graphics::updateUploadBar(upload);}
+
+    bool uploadToGiga(int gt1Size, bool uploadBar)
     {
-        if(!openComPort(_configComPort)) return -1;
+        if(!openComPort(_configComPort)) return false;
 
-        Graphics::enableUploadBar(true);
+        if(uploadBar) Graphics::enableUploadBar(true);
 
-        std::string line;
-        sendCommandToGiga('R', line, true);
-        sendCommandToGiga('L', line, true);
-        sendCommandToGiga('U', line, true);
+        // Reset, start the Loader from the menu and stream the gt1
+        BabelFish::Stats stats;
+        std::vector<uint8_t> gt1(_gt1Buffer, _gt1Buffer + gt1Size);
+        bool success = BabelFish::command('R', _configTimeOut)  &&  BabelFish::command('L', _configTimeOut)  &&
+                       BabelFish::sendGt1(gt1, _configPipeline, _configRetries, _configTimeOut, stats, (uploadBar) ? updateUploadBar : nullptr);
 
-        int gt1Size = *((int*)userData);
+        if(uploadBar) Graphics::enableUploadBar(false);
+        closeComPort();
 
-        int index = 0;
-        while(std::isdigit(line[0]))
+        if(success)
         {
-            int n = strtol(line.c_str(), nullptr, 10);
-            comWrite(_currentComPort, &_gt1Buffer[index], n);
-            index += n;
-
-            if(!waitForPromptGiga(line))
-            {
-                Graphics::enableUploadBar(false);
-                closeComPort();
-                //fprintf(stderr, "\n");
-                return -1;
-            }
-
-            float upload = float(index) / float(gt1Size);
-            Graphics::updateUploadBar(upload);
-            //fprintf(stderr, "Loader::uploadToGiga() : Uploading...%3d%%\r", int(upload * 100.0f));
+            fprintf(stderr, "Loader::uploadToGiga() : %d bytes in %.2fs : %.0f bytes/s : %d requests : latency %.1f/%.1f/%.1f ms min/mean/max : %d retries\n",
+                    stats._bytes, stats._elapsed, (stats._elapsed > 0.0) ? double(stats._bytes) / stats._elapsed : 0.0, stats._requests,
+                    stats._latencyMin * 1000.0, stats._latencyMean * 1000.0, stats._latencyMax * 1000.0, stats._retries);
         }
 
-        Graphics::enableUploadBar(false);
-        closeComPort();
-        //fprintf(stderr, "\n");
-
-        return 0;
+        return success;
     }
 
-    void uploadToGiga(const std::string& filepath, const std::string& filename)
+    int uploadToGigaThread(void* userData)
     {
-        // An upload is already in progress
-        if(Graphics::getUploadBarEnabled()) return;
+        return (uploadToGiga(*((int*)userData), true)) ? 0 : -1;
+    }
 
+    bool readGt1Buffer(const std::string& filepath, int& gt1Size)
+    {
         std::ifstream gt1file(filepath, std::ios::binary | std::ios::in);
         if(!gt1file.is_open())
         {
             fprintf(stderr, "Loader::uploadToGiga() : failed to open '%s'\n", filepath.c_str());
-            return;
+            return false;
         }
 
         gt1file.read(_gt1Buffer, MAX_GT1_SIZE);
         if(gt1file.bad())
         {
             fprintf(stderr, "Loader::uploadToGiga() : failed to read GT1 file '%s'\n", filepath.c_str());
-            return;
+            return false;
         }
 
+        gt1Size = int(gt1file.gcount());
+        return true;
+    }
+
+    void uploadToGiga(const std::string& filepath, const std::string& filename)
+    {
+        // An upload is already in progress
+        if(Graphics::getUploadBarEnabled()) return;
+
+        if(!readGt1Buffer(filepath, _gt1UploadSize)) return;
+
         Graphics::setUploadFilename(filename);
 
-        _gt1UploadSize = int(gt1file.gcount());
         SDL_Thread* uploadThread = SDL_CreateThread(uploadToGigaThread, VERSION_STR, (void*)&_gt1UploadSize);
     }
 
+    bool uploadFileToGiga(const std::string& filepath)
+    {
+        return readGt1Buffer(filepath, _gt1UploadSize)  &&  uploadToGiga(_gt1UploadSize, false);
+    }
+
     void disableUploads(bool disable)
     {
         _disableUploads = disable;
@@ -980,6 +978,110 @@ namespace Loader
         return true;
     }
 
+    // Writes every segment straight into the machine, ROM address segments are patched into the ROM. With switchRAM a gt1
+    // that reaches above 32K switches a 32K machine to 64K in place, (a reset would wipe the ROM's state), and the ROM's
+    // memSize is updated to match, otherwise segments that don't fit are skipped
+    void writeGt1Segments(const Gt1File& gt1File, bool switchRAM)
+    {
+        for(int j=0; j<gt1File._segments.size()  &&  switchRAM; j++)
+        {
+            const Gt1Segment& segment = gt1File._segments[j];
+            int address = segment._loAddress + (segment._hiAddress <<8);
+            if(!segment._isRomAddress  &&  address + int(segment._dataBytes.size()) > RAM_SIZE_LO  &&  Cpu::getMachine()._sizeRAM == RAM_SIZE_LO)
+            {
+                Cpu::setSizeRAM(RAM_SIZE_HI);
+                Cpu::setRAM(MEM_SIZE_ADDRESS, 0x00); // 256 pages
+                fprintf(stderr, "Loader::writeGt1Segments() : segment 0x%04x needs 64K RAM : switched to 64K.\n", address);
+            }
+        }
+
+        for(int j=0; j<gt1File._segments.size(); j++)
+        {
+            const Gt1Segment& segment = gt1File._segments[j];
+            uint16_t address = segment._loAddress + (segment._hiAddress <<8);
+            if(!segment._isRomAddress  &&  address + int(segment._dataBytes.size()) > Cpu::getMachine()._sizeRAM) continue;
+
+            for(int i=0; i<segment._dataBytes.size(); i++)
+            {
+                if(segment._isRomAddress)
+                {
+                    Cpu::setROM(address, address + uint16_t(i), segment._dataBytes[i]);
+                }
+                else
+                {
+                    Cpu::setRAM(address + uint16_t(i), segment._dataBytes[i]);
+                }
+            }
+        }
+    }
+
+    // vCPU's NEXT pre-increments vPC, the scanline hooks run outside the vCPU time slice so no instruction is in flight
+    void executeGt1(uint16_t executeAddress)
+    {
+        Cpu::setRAM(0x0016, LO_BYTE(executeAddress-2));
+        Cpu::setRAM(0x0017, HI_BYTE(executeAddress));
+        Cpu::setRAM(0x001a, LO_BYTE(executeAddress-2));
+        Cpu::setRAM(0x001b, HI_BYTE(executeAddress));
+    }
+
+    void bootUploadHook(void)
+    {
+        // Wait for the ROM to boot into its menu, (the same point the emulator initialises audio)
+        if(Cpu::getClock() <= STARTUP_DELAY_CLOCKS*10.0) return;
+
+        Cpu::removeHook(Cpu::ScanlineHook, bootUploadHook);
+        writeGt1Segments(_bootGt1File, true);
+        executeGt1(_bootGt1File._loStart + (_bootGt1File._hiStart <<8));
+        fprintf(stderr, "Loader::bootUploadHook() : gt1 loaded at frame %" PRIu64 "\n", Cpu::getFrameCount());
+    }
+
+    bool uploadGt1OnBoot(const std::string& filename)
+    {
+        _bootGt1File = Gt1File();
+        if(!loadGt1File(filename, _bootGt1File)) return false;
+
+        Cpu::addHook(Cpu::ScanlineHook, bootUploadHook);
+
+        return true;
+    }
+
+    bool uploadGt1Loader(const std::string& filename)
+    {
+        Gt1File gt1File;
+        if(!loadGt1File(filename, gt1File)) return false;
+
+        // The Loader only knows 1 to PAYLOAD_SIZE byte frames, so segments are split, (consecutive packets keep the
+        // checksum running, there's no need to resync between segments)
+        _loaderPackets.clear();
+        for(int j=0; j<gt1File._segments.size(); j++)
+        {
+            const Gt1Segment& segment = gt1File._segments[j];
+            uint16_t address = segment._loAddress + (segment._hiAddress <<8);
+            for(int i=0; i<segment._dataBytes.size(); i+=PAYLOAD_SIZE)
+            {
+                Gt1Segment packet;
+                int size = std::min(int(segment._dataBytes.size()) - i, PAYLOAD_SIZE);
+                packet._loAddress = LO_BYTE(address + i);
+                packet._hiAddress = HI_BYTE(address + i);
+                packet._segmentSize = uint8_t(size);
+                packet._dataBytes.assign(segment._dataBytes.begin() + i, segment._dataBytes.begin() + i + size);
+                _loaderPackets.push_back(packet);
+            }
+        }
+        _loaderStart = gt1File._loStart + (gt1File._hiStart <<8);
+
+        FrameUpload& frameUpload = Cpu::getMachine()._frameUpload;
+        frameUpload = FrameUpload();
+        frameUpload._uploading = true;
+        frameUpload._frameState = FrameState::Boot;
+
+        Graphics::setUploadFilename(filename);
+        Graphics::enableUploadBar(true);
+        Cpu::addHook(Cpu::ScanlineHook, uploadHook);
+
+        return true;
+    }
+
     void uploadDirect(UploadTarget uploadTarget)
     {
         Gt1File gt1File;
@@ -1072,21 +1174,7 @@ namespace Loader
             executeAddress = gt1File._loStart + (gt1File._hiStart <<8);
             Editor::setLoadBaseAddress(executeAddress);
 
-            if(uploadTarget == Emulator)
-            {
-                for(int j=0; j<gt1File._segments.size(); j++)
-                {
-                    // Ignore if address will not fit in current RAM
-                    uint16_t address = gt1File._segments[j]._loAddress + (gt1File._segments[j]._hiAddress <<8);
-                    if((address + gt1File._segments[j]._dataBytes.size() - 1) < Memory::getSizeRAM())
-                    {
-                        for(int i=0; i<gt1File._segments[j]._dataBytes.size(); i++)
-                        {
-                            Cpu::setRAM(address+i, gt1File._segments[j]._dataBytes[i]);
-                        }
-                    }
-                }
-            }
+            if(uploadTarget == Emulator) writeGt1Segments(gt1File, false);
 
             isGt1File = true;
             hasRamCode = true;
@@ -1192,13 +1280,7 @@ namespace Loader
             }
 
             // Execute code
-            if(!_disableUploads  &&  hasRamCode)
-            {
-                Cpu::setRAM(0x0016, LO_BYTE(executeAddress-2));
-                Cpu::setRAM(0x0017, HI_BYTE(executeAddress));
-                Cpu::setRAM(0x001a, LO_BYTE(executeAddress-2));
-                Cpu::setRAM(0x001b, HI_BYTE(executeAddress));
-            }
+            if(!_disableUploads  &&  hasRamCode) executeGt1(executeAddress);
 
             //Editor::startDebugger();
         }
@@ -1228,10 +1310,10 @@ namespace Loader
         checksum += value;
     }
 
-    bool sendFrame(int vgaY, uint8_t firstByte, uint8_t* message, uint8_t len, uint16_t address, uint8_t& checksum)
+    bool sendFrame(FrameUpload& frameUpload, int vgaY, uint8_t firstByte, uint8_t* message, uint8_t len, uint16_t address, uint8_t& checksum)
     {
-        static LoaderState loaderState = LoaderState::FirstByte;
-        static uint8_t payload[PAYLOAD_SIZE];
+        LoaderState& loaderState = frameUpload._loaderState;
+        uint8_t* payload = frameUpload._framePayload;
 
         bool sending = true;
 
@@ -1281,7 +1363,7 @@ namespace Loader
 
             case LoaderState::Message: // 8*PAYLOAD_SIZE bits
             {
-                static int msgIdx = 0;
+                int& msgIdx = frameUpload._msgIdx;
                 if(vgaY == VSYNC_START+38+msgIdx*8)
                 {
                     sendByte(payload[msgIdx], checksum);
@@ -1321,61 +1403,127 @@ namespace Loader
         return sending;
     }
 
-    // TODO: fix the Gigatron version of upload so that it can send more than 60 total bytes, (i.e. break up the payload into multiple packets of 60, 1 packet per frame)
+    // Selects 'Loader' from the ROM's menu the way BabelFish does, one controller code per frame
+    bool startLoader(FrameUpload& frameUpload, int vgaY)
+    {
+        if(vgaY != VSYNC_START+8) return true;
+
+        int frame = frameUpload._frames++;
+        if(frame < MENU_DOWN_PRESSES*MENU_KEY_FRAMES)
+        {
+            Cpu::setIN((frame % MENU_KEY_FRAMES < MENU_PRESS_FRAMES) ? uint8_t(~INPUT_DOWN) : 0xFF);
+        }
+        else
+        {
+            frame -= MENU_DOWN_PRESSES*MENU_KEY_FRAMES;
+            Cpu::setIN((frame < MENU_PRESS_FRAMES) ? uint8_t(~INPUT_A) : 0xFF);
+            if(frame == MENU_PRESS_FRAMES + MENU_READY_FRAMES) return false;
+        }
+
+        return true;
+    }
+
+    void loadPacket(FrameUpload& frameUpload)
+    {
+        const Gt1Segment& packet = _loaderPackets[frameUpload._packet];
+        frameUpload._payloadSize = packet._segmentSize;
+        for(int i=0; i<packet._segmentSize; i++) frameUpload._payload[i] = packet._dataBytes[i];
+    }
+
     void upload(int vgaY)
     {
-        static bool frameUploading = false;
-        static FILE* fileToUpload = NULL;
-        static FILE* fileToSave = NULL;
-        static uint8_t payload[RAM_SIZE_HI];
-        static uint8_t payloadSize = 0;
+        FrameUpload& frameUpload = Cpu::getMachine()._frameUpload;
+        bool& frameUploading = frameUpload._uploading;
+        uint8_t* payload = frameUpload._payload;
+        uint8_t& payloadSize = frameUpload._payloadSize;
+
+        if(_uploadTarget == None  &&  !frameUploading)
+        {
+            Cpu::removeHook(Cpu::ScanlineHook, uploadHook);
+            return;
+        }
+
+        if(_uploadTarget != None)
+        {
+            uploadDirect(_uploadTarget);
+            _uploadTarget = None;
+
+            return;
+        }
+
+        // A snapshot or rewind can restore a stream whose packets are gone
+        if(_loaderPackets.size() == 0)
+        {
+            frameUploading = false;
+            return;
+        }
 
-        if(_uploadTarget != None  ||  frameUploading)
+        uint8_t& checksum = frameUpload._checksum;
+        FrameState& frameState = frameUpload._frameState;
+        switch(frameState)
         {
-            uint16_t executeAddress = Editor::getLoadBaseAddress();
-            if(_uploadTarget != None)
+            // Wait for the ROM to boot into its menu, (the same point the emulator initialises audio)
+            case FrameState::Boot:
             {
-                uploadDirect(_uploadTarget);
-                _uploadTarget = None;
+                if(Cpu::getClock() > STARTUP_DELAY_CLOCKS*10.0) frameState = FrameState::Menu;
+            }
+            break;
 
-                return;
+            case FrameState::Menu:
+            {
+                if(!startLoader(frameUpload, vgaY)) frameState = FrameState::Resync;
             }
+            break;
 
-            frameUploading = true;            
-            static uint8_t checksum = 0;
-            static FrameState frameState = FrameState::Resync;
-            switch(frameState)
+            // A bad frame resets the Loader's checksum
+            case FrameState::Resync:
             {
-                case FrameState::Resync:
+                if(!sendFrame(frameUpload, vgaY, -1, payload, 0, _loaderStart, checksum))
                 {
-                    if(!sendFrame(vgaY, -1, payload, payloadSize, executeAddress, checksum))
-                    {
-                        checksum = 'g'; // loader resets checksum
-                        frameState = FrameState::Frame;
-                    }
+                    checksum = 'g'; // loader resets checksum
+                    frameUpload._packet = 0;
+                    loadPacket(frameUpload);
+                    frameState = FrameState::Frame;
                 }
-                break;
+            }
+            break;
 
-                case FrameState::Frame:
+            // One packet per frame, the Loader copies a packet's payload into place while it receives the next one
+            case FrameState::Frame:
+            {
+                const Gt1Segment& packet = _loaderPackets[frameUpload._packet];
+                uint16_t address = packet._loAddress + (packet._hiAddress <<8);
+                if(!sendFrame(frameUpload, vgaY, 'L', payload, payloadSize, address, checksum))
                 {
-                    if(!sendFrame(vgaY,'L', payload, payloadSize, executeAddress, checksum))
+                    Graphics::updateUploadBar(float(++frameUpload._packet) / float(_loaderPackets.size()));
+                    if(frameUpload._packet < int(_loaderPackets.size()))
+                    {
+                        loadPacket(frameUpload);
+                    }
+                    else
                     {
                         frameState = FrameState::Execute;
                     }
                 }
-                break;
+            }
+            break;
 
-                case FrameState::Execute:
+            // A zero length frame sets vPC and vLR to the start address
+            case FrameState::Execute:
+            {
+                if(!sendFrame(frameUpload, vgaY, 'L', payload, 0, _loaderStart, checksum))
                 {
-                    if(!sendFrame(vgaY, 'L', payload, 0, executeAddress, checksum))
-                    {
-                        checksum = 0;
-                        frameState = FrameState::Resync;
-                        frameUploading = false;
-                    }
+                    fprintf(stderr, "Loader::upload() : %d packets sent through the Loader, executing 0x%04x at frame %" PRIu64 "\n", int(_loaderPackets.size()), _loaderStart, Cpu::getFrameCount());
+                    _loaderPackets.clear();
+                    Graphics::enableUploadBar(false);
+                    checksum = 0;
+                    frameState = FrameState::Resync;
+                    frameUploading = false;
                 }
-                break;
             }
+            break;
+
+            default: break;
         }
     }
 #endif
@@ -16,6 +16,7 @@
 
 #define ZERO_CONST_ADDRESS        0x00
 #define ONE_CONST_ADDRESS         0x80
+#define MEM_SIZE_ADDRESS          0x01 // ROM's memSize, RAM pages found at boot, (0 is 256)
 
 #define LOADER_CONFIG_INI  "loader_config.ini"
 #define HIGH_SCORES_INI    "high_scores.ini"
@@ -49,6 +50,23 @@ namespace Loader
 #ifndef STAND_ALONE
     enum Endianness {Little, Big};
     enum UploadTarget {None, Emulator, Hardware};
+    enum LoaderState {FirstByte=0, MsgLength, LowAddress, HighAddress, Message, LastByte, ResetIN, NumLoaderStates};
+    enum FrameState {Resync=0, Frame, Execute, Boot, Menu, NumFrameStates};
+
+    // Serial loader protocol state, owned by each machine
+    struct FrameUpload
+    {
+        bool _uploading = false;
+        uint8_t _checksum = 0;
+        uint8_t _payloadSize = 0;
+        uint8_t _payload[PAYLOAD_SIZE];
+        uint8_t _framePayload[PAYLOAD_SIZE];
+        int _msgIdx = 0;
+        int _packet = 0; // packet being sent
+        int _frames = 0; // frames spent navigating the menu
+        LoaderState _loaderState = LoaderState::FirstByte;
+        FrameState _frameState = FrameState::Resync;
+    };
 
     struct SaveData
     {
@@ -83,12 +101,29 @@ namespace Loader
     void disableUploads(bool disable);
     void sendCommandToGiga(char cmd, bool wait);
 
+    // Overrides loader_config.ini's ComPort with a device path, (e.g. a pseudo terminal standing in for a BabelFish)
+    void setComDevice(const std::string& device);
+
+    // Resets the Gigatron through the BabelFish, starts its Loader and streams a gt1 file to it, blocks until the
+    // BabelFish has executed it and prints the transfer's throughput, latency and retries
+    bool uploadFileToGiga(const std::string& filepath);
+
     bool loadDataFile(SaveData& saveData);
     bool saveDataFile(const SaveData& saveData);
     void loadHighScore(void);
     bool saveHighScore(void);
     void updateHighScore(void);
 
+    // Loads a gt1 file now, once the ROM has booted into its menu every segment is written straight into the calling
+    // thread's machine and it's started, bypassing the Loader's serial protocol, (a 32K machine is switched to 64K in
+    // place for a gt1 that needs it)
+    bool uploadGt1OnBoot(const std::string& filename);
+
+    // Loads a gt1 file now and streams it into the calling thread's machine through the ROM's Loader app, exactly as
+    // BabelFish does, once the ROM has booted the Loader is started from the menu and the gt1 is sent as consecutive
+    // PAYLOAD_SIZE byte packets, one per frame, (~3.6 Kbytes/s of emulated time)
+    bool uploadGt1Loader(const std::string& filename);
+
     void upload(int vgaY);
 #endif
 }
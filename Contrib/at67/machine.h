@@ -0,0 +1,87 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "memory.h"
+#include "cpu.h"
+#include "timing.h"
+#include "loader.h"
+
+
+namespace Gigatron
+{
+    struct Machine;
+
+    using OpcodeHandler = void (*)(Machine& m, const Cpu::State& S, Cpu::State& T);
+
+    // Everything that one emulated Gigatron owns, the Cpu namespace always operates on the calling thread's current
+    // machine, (see Cpu::setMachine()), so any number of machines can run in parallel on separate threads
+    struct Machine
+    {
+        // Memory, RAM is always the 64K maximum, _sizeRAM selects the memory model
+        alignas(64) uint8_t _RAM[RAM_SIZE_HI];
+        int _sizeRAM = RAM_SIZE_LO;
+        uint8_t _ROM[ROM_SIZE][2];
+        int _romIndex = 0;
+        Cpu::RomType _romType = Cpu::ROMERR;
+
+        // One bit per 256 byte RAM page written since the last rewind capture
+        uint64_t _dirtyPages[RAM_SIZE_HI/256/64] = {};
+
+        // Native CPU
+        const OpcodeHandler* _opcodeTable = nullptr; // specialised for _sizeRAM
+        Cpu::State _stateS, _stateT;
+        uint8_t _IN = 0xFF, _XOUT = 0x00;
+
+        // Video beam and timing, OUT is captured for each visible pixel of the current scanline and expanded at hSync
+        int _vgaX = 0, _vgaY = 0;
+        uint8_t _scanline[HPIXELS_END - HPIXELS_START] = {};
+        int _hSync = 0, _vSync = 0;
+        int64_t _clockStall = CLOCK_RESET;
+        int64_t _clock = CLOCK_RESET;
+        uint64_t _frameCount = 0;
+        bool _isInReset = false;
+        bool _checkRomType = true;
+
+        // vCPU
+        uint16_t _vPC = 0x0200;
+        int _vCpuInstPerFrame = 0;
+        int _vCpuInstPerFrameMax = 0;
+        float _vCpuUtilisation = 0.0f;
+
+        // Event hooks, (see Cpu::addHook())
+        std::vector<Cpu::HookFunction> _hooks[Cpu::NumHookTriggers];
+
+        // Profiler's fetch count per ROM address, null unless profiling
+        uint64_t* _romCounts = nullptr;
+
+        // Scanline modes, ROMv1 only
+        std::vector<uint8_t> _scanlinesRom0;
+        std::vector<uint8_t> _scanlinesRom1;
+        int _scanlineMode = Cpu::ScanlineMode::Normal;
+
+        // Power on garbage and the undefined bus value come from the machine's own xorshift32 generator, so that a
+        // machine's run only depends on its seed, (see Cpu::seedRandom())
+        uint32_t _random = 1;
+
+#ifndef STAND_ALONE
+        // Serial loader
+        Loader::FrameUpload _frameUpload;
+#endif
+
+        // Headless mode and it's exit conditions, (-1 disables a condition), headless machines never touch the
+        // editor, graphics, audio or loader, which all belong to the main machine
+        bool _headless = false;
+        bool _exitVpcReached = false;
+        int64_t _exitFrames = -1;
+        int64_t _exitClocks = -1;
+        int32_t _exitVpc = -1;
+    };
+
+    // Every RAM write path calls this with the address already masked to the memory model
+    inline void markDirty(Machine& m, uint16_t address) {m._dirtyPages[address >> 14] |= uint64_t(1) << ((address >> 8) & 63);}
+}
+
+#endif
@@ -9,6 +9,14 @@
 /*******************************************************************************/
 
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+
+#include <SDL.h>
+
 #include "memory.h"
 #include "cpu.h"
 #include "audio.h"
@@ -16,16 +24,223 @@
 #include "loader.h"
 #include "timing.h"
 #include "graphics.h"
+#include "hle.h"
+#include "batch.h"
+#include "snapshot.h"
+#include "profiler.h"
+#include "capture.h"
 #include "expression.h"
 #include "assembler.h"
 #include "compiler.h"
 
 
+void usage(void)
+{
+    fprintf(stderr, "%s\n", VERSION_STR);
+    fprintf(stderr, "Usage:   gtemuAT67 [--headless] [--frames <n>] [--clocks <n>] [--vpc <hex address>] [--benchmark] [--hle] [--hle-sys] [--hle-verify] [--seed <n>]\n");
+    fprintf(stderr, "                 [--batch <ini file>] [--jobs <n>] [--load-state <file>] [--save-state <file>] [--profile <file>] [--profile-labels <file>]\n");
+    fprintf(stderr, "                 [--capture <file>] [--capture-format <raw|y4m|png>] [--capture-every <n>] [--wav <file>] [--wav-rate <n>] [--wav-filter]\n");
+    fprintf(stderr, "                 [--gt1 <file>] [--gt1-loader <file>] [--upload <file>] [--port <device>]\n");
+    fprintf(stderr, "         --headless      : no window or audio, runs as fast as the host allows, (implied by the exit conditions)\n");
+    fprintf(stderr, "         --frames <n>    : headless, exit after n frames\n");
+    fprintf(stderr, "         --clocks <n>    : headless, exit after n native clocks\n");
+    fprintf(stderr, "         --vpc <address> : headless, exit when vPC reaches address, (non zero exit code on timeout)\n");
+    fprintf(stderr, "         --benchmark     : time the native decoders on each internal ROM for --clocks clocks and exit\n");
+    fprintf(stderr, "         --batch <file>  : run every job in an INI file on its own headless machine and exit\n");
+    fprintf(stderr, "         --jobs <n>      : number of threads --batch runs jobs on, (default is one per hardware thread)\n");
+    fprintf(stderr, "         --load-state <f>: start from snapshot file f, (see the SaveState key), --frames and --clocks count from it\n");
+    fprintf(stderr, "         --save-state <f>: headless, save a snapshot to file f on exit\n");
+    fprintf(stderr, "         --profile <f>   : headless, profile the whole run and write f_native.txt, f_vcpu.txt and .folded files\n");
+    fprintf(stderr, "         --profile-labels: vCPU labels for --profile and CTRL+P, assembled from a .gasm or .vasm file\n");
+    fprintf(stderr, "         --capture <f>   : headless, write frames to file f, ('-' is stdout), or to f_<frame>.png\n");
+    fprintf(stderr, "         --capture-format: raw RGBA, y4m for piping into an encoder or png, (default is from f's extension, else raw)\n");
+    fprintf(stderr, "         --capture-every : only capture every nth frame\n");
+    fprintf(stderr, "         --wav <f>       : headless, record the audio output and write it to WAV file f on exit\n");
+    fprintf(stderr, "         --wav-rate <n>  : resample the WAV file to n Hz, (default is the Gigatron's 31260Hz)\n");
+    fprintf(stderr, "         --wav-filter    : pass the WAV file through the Gigatron's 700Hz low pass and 160Hz high pass filters\n");
+    fprintf(stderr, "         --gt1 <f>       : load gt1 file f straight into RAM once the ROM has booted and run it\n");
+    fprintf(stderr, "         --gt1-loader <f>: start the ROM's Loader from the menu and send gt1 file f through it one packet per frame\n");
+    fprintf(stderr, "         --upload <f>    : send gt1 file f to real hardware through a BabelFish and exit, (prints throughput stats)\n");
+    fprintf(stderr, "         --port <device> : --upload, serial device path to use instead of loader_config.ini's ComPort\n");
+    fprintf(stderr, "         --seed <n>      : seed for the power on RAM and undefined bus values, (default is the time), for repeatable runs\n");
+    fprintf(stderr, "         --hle           : execute vCPU instructions in C++ instead of through the native interpreter\n");
+    fprintf(stderr, "         --hle-sys       : --hle, also execute the common SYS functions in C++\n");
+    fprintf(stderr, "         --hle-verify    : --hle, but every emulated instruction is checked against the native interpreter\n");
+}
+
+struct CaptureArgs
+{
+    std::string _filename;
+    std::string _format;
+    int _every = 1;
+
+    std::string _wavFilename;
+    int _wavRate = 0;
+    bool _wavFilter = false;
+};
+
+bool parseArgs(int argc, char* argv[], int32_t& exitVpc, bool& benchmark, std::string& batch, int& jobs, std::string& loadState, std::string& saveState, std::string& profile, std::string& gt1, std::string& gt1Loader, std::string& upload, std::string& port, CaptureArgs& capture)
+{
+    for(int i=1; i<argc; i++)
+    {
+        bool hasValue = (i+1 < argc);
+        if(strcmp(argv[i], "--headless") == 0)
+        {
+            Cpu::setHeadless(true);
+        }
+        else if(strcmp(argv[i], "--benchmark") == 0)
+        {
+            benchmark = true;
+            Cpu::setHeadless(true);
+        }
+        else if(strcmp(argv[i], "--hle") == 0)
+        {
+            Hle::setEnabled(true);
+        }
+        else if(strcmp(argv[i], "--hle-sys") == 0)
+        {
+            Hle::setSysEnabled(true);
+        }
+        else if(strcmp(argv[i], "--hle-verify") == 0)
+        {
+            Hle::setVerify(true);
+        }
+        else if(strcmp(argv[i], "--batch") == 0  &&  hasValue)
+        {
+            batch = argv[++i];
+            Cpu::setHeadless(true);
+        }
+        else if(strcmp(argv[i], "--jobs") == 0  &&  hasValue)
+        {
+            jobs = int(strtol(argv[++i], nullptr, 10));
+        }
+        else if(strcmp(argv[i], "--load-state") == 0  &&  hasValue)
+        {
+            loadState = argv[++i];
+        }
+        else if(strcmp(argv[i], "--save-state") == 0  &&  hasValue)
+        {
+            saveState = argv[++i];
+            Cpu::setHeadless(true);
+        }
+        else if(strcmp(argv[i], "--profile") == 0  &&  hasValue)
+        {
+            profile = argv[++i];
+            Cpu::setHeadless(true);
+        }
+        else if(strcmp(argv[i], "--profile-labels") == 0  &&  hasValue)
+        {
+            Profiler::setLabelsFile(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--capture") == 0  &&  hasValue)
+        {
+            capture._filename = argv[++i];
+            Cpu::setHeadless(true);
+        }
+        else if(strcmp(argv[i], "--capture-format") == 0  &&  hasValue)
+        {
+            capture._format = argv[++i];
+        }
+        else if(strcmp(argv[i], "--capture-every") == 0  &&  hasValue)
+        {
+            capture._every = int(strtol(argv[++i], nullptr, 10));
+        }
+        else if(strcmp(argv[i], "--wav") == 0  &&  hasValue)
+        {
+            capture._wavFilename = argv[++i];
+            Cpu::setHeadless(true);
+        }
+        else if(strcmp(argv[i], "--wav-rate") == 0  &&  hasValue)
+        {
+            capture._wavRate = int(strtol(argv[++i], nullptr, 10));
+        }
+        else if(strcmp(argv[i], "--wav-filter") == 0)
+        {
+            capture._wavFilter = true;
+        }
+        else if(strcmp(argv[i], "--gt1") == 0  &&  hasValue)
+        {
+            gt1 = argv[++i];
+        }
+        else if(strcmp(argv[i], "--gt1-loader") == 0  &&  hasValue)
+        {
+            gt1Loader = argv[++i];
+        }
+        else if(strcmp(argv[i], "--seed") == 0  &&  hasValue)
+        {
+            Cpu::setSeed(uint32_t(strtoul(argv[++i], nullptr, 0)));
+        }
+        else if(strcmp(argv[i], "--upload") == 0  &&  hasValue)
+        {
+            upload = argv[++i];
+        }
+        else if(strcmp(argv[i], "--port") == 0  &&  hasValue)
+        {
+            port = argv[++i];
+        }
+        else if(strcmp(argv[i], "--frames") == 0  &&  hasValue)
+        {
+            Cpu::setExitFrames(strtoll(argv[++i], nullptr, 10));
+            Cpu::setHeadless(true);
+        }
+        else if(strcmp(argv[i], "--clocks") == 0  &&  hasValue)
+        {
+            Cpu::setExitClocks(strtoll(argv[++i], nullptr, 10));
+            Cpu::setHeadless(true);
+        }
+        else if(strcmp(argv[i], "--vpc") == 0  &&  hasValue)
+        {
+            exitVpc = int32_t(strtol(argv[++i], nullptr, 16) & 0xFFFF);
+            Cpu::setExitVpc(exitVpc);
+            Cpu::setHeadless(true);
+        }
+        else
+        {
+            usage();
+            return false;
+        }
+    }
+
+    return true;
+}
+
 int main(int argc, char* argv[])
 {
+    int32_t exitVpc = -1;
+    bool benchmark = false;
+    std::string batch;
+    int jobs = 0;
+    std::string loadState, saveState, profile, gt1, gt1Loader, upload, port;
+    CaptureArgs capture;
+    if(!parseArgs(argc, argv, exitVpc, benchmark, batch, jobs, loadState, saveState, profile, gt1, gt1Loader, upload, port, capture)) return 1;
+
     Memory::intitialise();
     Loader::initialise();
+
+    // Real hardware only, no machine is needed
+    if(upload.size())
+    {
+        if(port.size()) Loader::setComDevice(port);
+        return (Loader::uploadFileToGiga(upload)) ? 0 : 1;
+    }
     Cpu::initialise();
+    Hle::initialise();
+
+    if(benchmark)
+    {
+        int64_t clocks = (Cpu::getExitClocks() > 0) ? Cpu::getExitClocks() : int64_t(CLOCK_FREQ) * 10;
+        bool lockstep = Cpu::benchmark(clocks);
+        Cpu::shutdown();
+        return (lockstep) ? 0 : 1;
+    }
+
+    if(batch.size())
+    {
+        bool passed = Batch::run(batch, jobs);
+        Cpu::shutdown();
+        return (passed) ? 0 : 1;
+    }
+
     Audio::initialise();
     Graphics::initialise();
     Editor::initialise();
@@ -35,7 +250,107 @@ int main(int argc, char* argv[])
 
     //Compiler::compile("gbas/test.gbas", "gbas/test.gasm");
 
-    while(Cpu::process());
+    if(loadState.size())
+    {
+        if(!Snapshot::loadFile(loadState))
+        {
+            Cpu::shutdown();
+            return 1;
+        }
+
+        // Exit conditions are relative to the snapshot
+        if(Cpu::getExitFrames() >= 0) Cpu::setExitFrames(Cpu::getExitFrames() + int64_t(Cpu::getFrameCount()));
+        if(Cpu::getExitClocks() >= 0) Cpu::setExitClocks(Cpu::getExitClocks() + Cpu::getClock());
+    }
+
+    if(profile.size()) Profiler::start();
+
+    if(capture._filename.size())
+    {
+        Capture::Format format = Capture::Raw;
+        std::string extension = (capture._filename.size() > 4) ? capture._filename.substr(capture._filename.size() - 4) : "";
+        if(extension.size()  &&  extension[0] == '.') Capture::getFormat(extension.substr(1), format);
+        if(capture._format.size()  &&  !Capture::getFormat(capture._format, format))
+        {
+            fprintf(stderr, "main() : unknown capture format '%s'\n", capture._format.c_str());
+            Cpu::shutdown();
+            return 1;
+        }
+        if(!Capture::start(capture._filename, format, capture._every))
+        {
+            Cpu::shutdown();
+            return 1;
+        }
+    }
+    if(capture._wavFilename.size()) Audio::startWav(capture._wavFilename, capture._wavRate, capture._wavFilter);
+    if((gt1.size()  &&  !Loader::uploadGt1OnBoot(gt1))  ||  (gt1Loader.size()  &&  !Loader::uploadGt1Loader(gt1Loader)))
+    {
+        Cpu::shutdown();
+        return 1;
+    }
+
+    // The emulator runs on it's own thread so that presenting and vSync never steal emulation time, the main thread
+    // only polls SDL events and presents frames, (until the window is closed), audio is pulled by SDL's audio thread
+    if(!Cpu::getHeadless())
+    {
+        std::atomic<bool> running(true);
+        Gigatron::Machine* machine = &Cpu::getMachine();
+        std::thread emulation([&running, machine]()
+        {
+            Cpu::setMachine(machine);
+            while(Cpu::process());
+            running = false;
+        });
+
+        while(running)
+        {
+            Editor::pollEvents();
+            if(!Graphics::present()) SDL_Delay(1);
+        }
+
+        emulation.join();
+        Cpu::shutdown();
+
+        const Timing::JitterStats& jitter = Timing::getJitterTotal();
+        if(jitter._frames)
+        {
+            fprintf(stderr, "main() : frames paced %" PRIu64 " : jitter mean %0.1fus : max %0.1fus : late frames %" PRIu64 "\n",
+                            jitter._frames, jitter._mean*1.0e6, jitter._max*1.0e6, jitter._lateFrames);
+        }
+        if(Audio::getUnderruns()  ||  Audio::getOverruns())
+        {
+            fprintf(stderr, "main() : audio underruns %" PRIu64 " : samples dropped %" PRIu64 "\n", Audio::getUnderruns(), Audio::getOverruns());
+        }
+    }
+    else
+    {
+        int64_t startClock = std::max(Cpu::getClock(), int64_t(0));
+        uint64_t startCounter = SDL_GetPerformanceCounter();
+
+        while(Cpu::process());
+
+        double elapsed = double(SDL_GetPerformanceCounter() - startCounter) / double(SDL_GetPerformanceFrequency());
+        double mhz = double(Cpu::getClock() - startClock) / elapsed / 1.0e6;
+        double realTime = double(Cpu::getClock() - startClock) / double(CLOCK_FREQ) / elapsed;
+        fprintf(stderr, "main() : frames %" PRIu64 " : clocks %" PRId64 " : vPC 0x%04x : elapsed %0.3fs : %0.2fMHz : %0.1fx real time\n",
+                        Cpu::getFrameCount(), Cpu::getClock(), Cpu::getVPC(), elapsed, mhz, realTime);
+        if(Hle::getEnabled())
+        {
+            fprintf(stderr, "main() : vCPU instructions emulated %" PRIu64 " : verify errors %" PRIu64 "\n", Hle::getVcpuCount(), Hle::getVerifyErrors());
+        }
+        if(saveState.size()) Snapshot::saveFile(saveState);
+        if(profile.size()) Profiler::stop(profile);
+        bool captured = Capture::stop();
+        bool wavWritten = Audio::stopWav();
+        Cpu::shutdown();
+
+        if(exitVpc >= 0  &&  !Cpu::getExitVpcReached())
+        {
+            fprintf(stderr, "main() : vPC 0x%04x was not reached.\n", exitVpc);
+            return 1;
+        }
+        if(!captured  ||  !wavWritten) return 1;
+    }
 
     return 0;
-}
\ No newline at end of file
+}
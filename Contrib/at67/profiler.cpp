@@ -0,0 +1,492 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "memory.h"
+#include "cpu.h"
+#include "machine.h"
+#include "editor.h"
+#include "hle.h"
+#include "assembler.h"
+#include "profiler.h"
+
+
+namespace Profiler
+{
+    struct Routine
+    {
+        std::string _name;
+        uint64_t _clocks = 0;
+        uint64_t _inclusive = 0;
+        uint64_t _count = 0;
+    };
+
+    // One node per distinct call path, (parent plus callee entry address), so recursion and different callers of the
+    // same function are kept apart until they are merged by label on export
+    struct CallNode
+    {
+        int _parent = -1;
+        uint16_t _entry = 0x0000;
+        std::map<uint16_t, int> _children;
+        std::unordered_map<uint16_t, uint64_t> _clocks;
+    };
+
+    // Shadow of the vCPU's call stack, a frame is pushed by CALL/CALLI and popped by the RET that returns to _return
+    struct CallFrame
+    {
+        uint16_t _return;
+        uint8_t _vSP;
+        int _node;
+    };
+
+    bool _enabled = false;
+    std::string _labelsFile;
+
+    std::vector<uint64_t> _romCounts;
+    uint64_t _hleClocks = 0;
+    int64_t _startClock = 0;
+    uint64_t _startFrame = 0;
+
+    // vCPU instruction being timed, from .next2 to its return to NEXT
+    int64_t _vCpuStart = -1;
+    bool _vCpuPending = false;
+    uint16_t _vCpuVpc = 0x0000;
+    uint8_t _vCpuOpcode = 0x00;
+
+    std::vector<uint64_t> _vpcClocks;
+    std::vector<uint64_t> _vpcCounts;
+    std::vector<CallNode> _callNodes;
+    std::vector<CallFrame> _callFrames;
+
+
+    bool getEnabled(void) {return _enabled;}
+
+    void setLabelsFile(const std::string& labelsFile) {_labelsFile = labelsFile;}
+
+
+    void start(void)
+    {
+        Gigatron::Machine& m = Cpu::getMachine();
+
+        _romCounts.assign(ROM_SIZE, 0);
+        _hleClocks = 0;
+        _startClock = m._clock;
+        _startFrame = m._frameCount;
+
+        _vCpuStart = -1;
+        _vCpuPending = false;
+        _vpcClocks.assign(RAM_SIZE_HI, 0);
+        _vpcCounts.assign(RAM_SIZE_HI, 0);
+        _callNodes.assign(1, CallNode());
+        _callFrames.clear();
+
+        m._romCounts = &_romCounts[0];
+        _enabled = true;
+
+        fprintf(stderr, "Profiler::start() : profiling native and vCPU code.\n");
+    }
+
+    int getCallNode(int parent, uint16_t entry)
+    {
+        auto it = _callNodes[parent]._children.find(entry);
+        if(it != _callNodes[parent]._children.end()) return it->second;
+
+        int node = int(_callNodes.size());
+        _callNodes.emplace_back();
+        _callNodes[node]._parent = parent;
+        _callNodes[node]._entry = entry;
+        _callNodes[parent]._children[entry] = node;
+        return node;
+    }
+
+    // The instruction has completed, so vPC, vLR and vSP already hold its results
+    void retireInstruction(Gigatron::Machine& m, uint16_t vPC, uint8_t opcode, uint64_t clocks)
+    {
+        int node = (_callFrames.size()) ? _callFrames.back()._node : 0;
+        _callNodes[node]._clocks[vPC] += clocks;
+        _vpcClocks[vPC] += clocks;
+        _vpcCounts[vPC]++;
+
+        uint16_t vLR = Cpu::getRAM(VCPU_LR) | (Cpu::getRAM(VCPU_LR+1) <<8);
+        uint8_t vSP = Cpu::getRAM(VCPU_SP);
+        switch(opcode)
+        {
+            // NEXT adds 2 to vPC before the callee's first fetch, only within the page
+            case PROFILER_VCPU_CALL:
+            case PROFILER_VCPU_CALLI:
+            {
+                if(opcode == PROFILER_VCPU_CALLI  &&  m._romType != Cpu::DEVROM) break;
+
+                uint16_t target = (Cpu::getRAM(VCPU_PC+1) <<8) | uint8_t(Cpu::getRAM(VCPU_PC) + 2);
+                if(_callFrames.size() >= PROFILER_MAX_CALLS) _callFrames.erase(_callFrames.begin());
+                _callFrames.push_back({vLR, vSP, getCallNode(node, target)});
+            }
+            break;
+
+            // Unwind to the frame RET returns through, otherwise drop frames whose stack the program has discarded
+            case PROFILER_VCPU_RET:
+            {
+                int frame = int(_callFrames.size()) - 1;
+                while(frame >= 0  &&  _callFrames[frame]._return != vLR) frame--;
+                if(frame >= 0)
+                {
+                    _callFrames.resize(frame);
+                }
+                else
+                {
+                    while(_callFrames.size()  &&  _callFrames.back()._vSP < vSP) _callFrames.pop_back();
+                }
+            }
+            break;
+
+            default: break;
+        }
+    }
+
+    void sample(Gigatron::Machine& m)
+    {
+        uint16_t pc = m._stateS._PC;
+        m._romCounts[pc]++;
+
+        switch(pc)
+        {
+            case PROFILER_VCPU_NEXT2: _vCpuStart = m._clock; break;
+
+            case ROM_VCPU_DISPATCH:
+            {
+                if(_vCpuStart < 0) break;
+
+                _vCpuVpc = (Cpu::getRAM(VCPU_PC+1) <<8) | Cpu::getRAM(VCPU_PC);
+                _vCpuOpcode = Cpu::getRAM(_vCpuVpc);
+                _vCpuPending = true;
+            }
+            break;
+
+            case VCPU_NEXT:
+            {
+                if(!_vCpuPending) break;
+
+                // Plus NEXT's own adda and blt, which HLE also charges to the instruction
+                _vCpuPending = false;
+                retireInstruction(m, _vCpuVpc, _vCpuOpcode, uint64_t(m._clock - _vCpuStart) + 2);
+            }
+            break;
+
+            default: break;
+        }
+    }
+
+    void sampleHle(Gigatron::Machine& m, uint16_t vPC, int clocks)
+    {
+        _hleClocks += clocks;
+        retireInstruction(m, vPC, Cpu::getRAM(vPC), uint64_t(clocks));
+    }
+
+    bool isHexWord(const std::string& token)
+    {
+        return token.size() == 4  &&  token.find_first_not_of("0123456789abcdefABCDEF") == std::string::npos;
+    }
+
+    // Labels from a ROM listing, a line is either "label: AAAA IIDD ..." or "label:" alone with the code on the next
+    // line, or just "AAAA IIDD ...", local labels, (starting with '.'), are folded into the routine that contains them
+    bool loadRomSymbols(const std::string& romName, std::map<uint16_t, std::string>& symbols)
+    {
+        size_t dot = romName.rfind('.');
+        std::string lstName = romName.substr(0, dot) + ".lst";
+
+        std::ifstream infile(lstName);
+        if(!infile.is_open()) infile.open(PROFILER_LST_PATH + lstName);
+        if(!infile.is_open()) return false;
+
+        std::string line, label;
+        while(std::getline(infile, line))
+        {
+            if(line.size()  &&  line[0] != ' '  &&  line[0] != '\t')
+            {
+                size_t colon = line.find(':');
+                if(colon == std::string::npos  ||  line.find(' ') < colon) continue;
+
+                if(line[0] != '.') label = line.substr(0, colon);
+                line = line.substr(colon + 1);
+            }
+
+            std::string address, word;
+            std::istringstream stream(line);
+            if(!(stream >> address >> word)  ||  !isHexWord(address)  ||  !isHexWord(word)) continue;
+
+            if(label.size())
+            {
+                symbols[uint16_t(std::stoul(address, nullptr, 16))] = label;
+                label.clear();
+            }
+        }
+
+        return symbols.size() > 0;
+    }
+
+    // Labels of the last program the assembler built, either the labels file or whatever the editor loaded
+    bool loadVcpuSymbols(std::map<uint16_t, std::string>& symbols)
+    {
+        if(_labelsFile.size())
+        {
+            size_t slash = _labelsFile.find_last_of("\\/");
+            Assembler::setIncludePath((slash != std::string::npos) ? _labelsFile.substr(0, slash + 1) : std::string(""));
+            if(!Assembler::assemble(_labelsFile, DEFAULT_START_ADDRESS))
+            {
+                fprintf(stderr, "Profiler::loadVcpuSymbols() : failed to assemble labels from '%s'\n", _labelsFile.c_str());
+            }
+        }
+
+        uint16_t address;
+        std::string name;
+        for(int i=0; i<Assembler::getLabelsSize(); i++)
+        {
+            if(Assembler::getLabel(i, address, name)) symbols[address] = name;
+        }
+
+        return symbols.size() > 0;
+    }
+
+    // One symbol per 256 byte/word page for code without labels
+    void addPageSymbols(std::map<uint16_t, std::string>& symbols)
+    {
+        for(int i=0; i<ROM_SIZE; i+=256)
+        {
+            char name[16];
+            sprintf(name, "page_0x%02x", i >> 8);
+            if(symbols.find(uint16_t(i)) == symbols.end()) symbols[uint16_t(i)] = name;
+        }
+    }
+
+    const std::string& getSymbol(const std::map<uint16_t, std::string>& symbols, uint16_t address)
+    {
+        return std::prev(symbols.upper_bound(address))->second;
+    }
+
+    // Decoded from the instruction byte alone, the D operand is different for every address
+    std::string opcodeName(uint8_t ir)
+    {
+        static const char* ops[8] = {"ld", "anda", "ora", "xora", "adda", "suba", "st", "j"};
+        static const char* jumps[8] = {"jmp", "bgt", "blt", "bne", "beq", "bge", "ble", "bra"};
+        static const char* modes[8] = {"[D],AC", "[X],AC", "[Y,D],AC", "[Y,X],AC", "[D],X", "[D],Y", "[D],OUT", "[Y,X++],OUT"};
+        static const char* buses[4] = {"D", "RAM", "AC", "IN"};
+
+        int op = ir >> 5, mode = (ir >> 2) & 7, bus = ir & 3;
+        char name[64];
+        if(op == 7)
+        {
+            sprintf(name, "%-4s %s", jumps[mode], buses[bus]);
+        }
+        else
+        {
+            sprintf(name, "%-4s %-11s %s", ops[op], modes[mode], buses[bus]);
+        }
+
+        return std::string(name);
+    }
+
+    void sortRoutines(const std::map<std::string, Routine>& routines, std::vector<Routine>& sorted)
+    {
+        sorted.clear();
+        for(auto it=routines.begin(); it!=routines.end(); ++it) sorted.push_back(it->second);
+        std::sort(sorted.begin(), sorted.end(), [](const Routine& a, const Routine& b) {return a._clocks > b._clocks;});
+    }
+
+    FILE* openFile(const std::string& filename)
+    {
+        FILE* file = fopen(filename.c_str(), "w");
+        if(file == nullptr) fprintf(stderr, "Profiler::stop() : failed to open '%s'\n", filename.c_str());
+        return file;
+    }
+
+    bool writeNative(const std::string& filename, const std::string& romName, int64_t clocks, uint64_t frames)
+    {
+        Gigatron::Machine& m = Cpu::getMachine();
+
+        // Routines from the listing, otherwise one per 256 word page
+        std::map<uint16_t, std::string> symbols;
+        if(!loadRomSymbols(romName, symbols)) addPageSymbols(symbols);
+        if(symbols.begin()->first != 0x0000) symbols[0x0000] = "reset";
+
+        std::map<std::string, Routine> routines;
+        std::vector<Routine> opcodes(256);
+        uint64_t nativeClocks = 0;
+        for(int i=0; i<ROM_SIZE; i++)
+        {
+            uint64_t count = _romCounts[i];
+            if(count == 0) continue;
+
+            Routine& routine = routines[getSymbol(symbols, uint16_t(i))];
+            routine._name = getSymbol(symbols, uint16_t(i));
+            routine._clocks += count;
+
+            opcodes[m._ROM[i][ROM_INST]]._clocks += count;
+            nativeClocks += count;
+        }
+        if(_hleClocks) routines["vCPU (HLE)"]._name = "vCPU (HLE)", routines["vCPU (HLE)"]._clocks = _hleClocks;
+
+        std::vector<Routine> sorted;
+        sortRoutines(routines, sorted);
+        for(int i=0; i<int(opcodes.size()); i++) opcodes[i]._name = opcodeName(uint8_t(i));
+        std::sort(opcodes.begin(), opcodes.end(), [](const Routine& a, const Routine& b) {return a._clocks > b._clocks;});
+
+        FILE* file = openFile(filename + "_native.txt");
+        if(file == nullptr) return false;
+
+        double total = double(std::max(clocks, int64_t(1)));
+        double perFrame = double(std::max(frames, uint64_t(1)));
+        fprintf(file, "ROM %s : frames %" PRIu64 " : clocks %" PRId64 " : %0.1f clocks per frame\n", romName.c_str(), frames, clocks, double(clocks)/perFrame);
+        fprintf(file, "native clocks %" PRIu64 " : HLE clocks %" PRIu64 "\n\n", nativeClocks, _hleClocks);
+
+        fprintf(file, "%-32s %16s %8s %14s\n", "Routine", "Clocks", "%", "Clocks/frame");
+        for(int i=0; i<int(sorted.size()); i++)
+        {
+            fprintf(file, "%-32s %16" PRIu64 " %7.2f%% %14.1f\n", sorted[i]._name.c_str(), sorted[i]._clocks, double(sorted[i]._clocks)/total*100.0, double(sorted[i]._clocks)/perFrame);
+        }
+
+        fprintf(file, "\n%-32s %16s %8s\n", "Opcode", "Clocks", "%");
+        for(int i=0; i<int(opcodes.size())  &&  opcodes[i]._clocks; i++)
+        {
+            fprintf(file, "%-32s %16" PRIu64 " %7.2f%%\n", opcodes[i]._name.c_str(), opcodes[i]._clocks, double(opcodes[i]._clocks)/total*100.0);
+        }
+        fclose(file);
+
+        // One stack per routine, "ROM;routine clocks", as consumed by flamegraph.pl
+        file = openFile(filename + "_native.folded");
+        if(file == nullptr) return false;
+
+        std::string root = romName.substr(0, romName.rfind('.'));
+        for(int i=0; i<int(sorted.size()); i++) fprintf(file, "%s;%s %" PRIu64 "\n", root.c_str(), sorted[i]._name.c_str(), sorted[i]._clocks);
+        fclose(file);
+
+        return true;
+    }
+
+    bool writeVcpu(const std::string& filename, uint64_t frames)
+    {
+        std::map<uint16_t, std::string> symbols;
+        loadVcpuSymbols(symbols);
+        addPageSymbols(symbols);
+
+        // Self clocks go to the label of the vPC, inclusive clocks to every distinct function on the call path
+        std::map<std::string, Routine> functions;
+        std::map<std::string, uint64_t> stacks;
+        uint64_t vCpuClocks = 0;
+        for(int i=0; i<int(_callNodes.size()); i++)
+        {
+            if(_callNodes[i]._clocks.empty()) continue;
+
+            std::vector<std::string> path;
+            for(int node=i; node>0; node=_callNodes[node]._parent) path.push_back(getSymbol(symbols, _callNodes[node]._entry));
+            std::reverse(path.begin(), path.end());
+
+            std::string stack = "vCPU";
+            for(int j=0; j<int(path.size()); j++) stack += ";" + path[j];
+
+            for(auto it=_callNodes[i]._clocks.begin(); it!=_callNodes[i]._clocks.end(); ++it)
+            {
+                const std::string& leaf = getSymbol(symbols, it->first);
+                Routine& function = functions[leaf];
+                function._name = leaf;
+                function._clocks += it->second;
+                vCpuClocks += it->second;
+
+                std::set<std::string> callers(path.begin(), path.end());
+                callers.insert(leaf);
+                for(auto caller=callers.begin(); caller!=callers.end(); ++caller)
+                {
+                    functions[*caller]._name = *caller;
+                    functions[*caller]._inclusive += it->second;
+                }
+
+                stacks[(path.size()  &&  path.back() == leaf) ? stack : stack + ";" + leaf] += it->second;
+            }
+        }
+        for(int i=0; i<RAM_SIZE_HI; i++)
+        {
+            if(_vpcCounts[i]) functions[getSymbol(symbols, uint16_t(i))]._count += _vpcCounts[i];
+        }
+
+        std::vector<Routine> sorted;
+        sortRoutines(functions, sorted);
+
+        FILE* file = openFile(filename + "_vcpu.txt");
+        if(file == nullptr) return false;
+
+        double total = double(std::max(vCpuClocks, uint64_t(1)));
+        double perFrame = double(std::max(frames, uint64_t(1)));
+        fprintf(file, "vCPU : frames %" PRIu64 " : clocks %" PRIu64 " : %0.1f clocks per frame\n\n", frames, vCpuClocks, double(vCpuClocks)/perFrame);
+
+        fprintf(file, "%-32s %14s %8s %14s %8s %12s %8s\n", "Function", "Self", "%", "Inclusive", "%", "Instructions", "Clk/Inst");
+        for(int i=0; i<int(sorted.size()); i++)
+        {
+            fprintf(file, "%-32s %14" PRIu64 " %7.2f%% %14" PRIu64 " %7.2f%% %12" PRIu64 " %8.1f\n", sorted[i]._name.c_str(), sorted[i]._clocks, double(sorted[i]._clocks)/total*100.0,
+                          sorted[i]._inclusive, double(sorted[i]._inclusive)/total*100.0, sorted[i]._count, double(sorted[i]._clocks)/double(std::max(sorted[i]._count, uint64_t(1))));
+        }
+
+        std::vector<uint16_t> hot;
+        for(int i=0; i<RAM_SIZE_HI; i++) if(_vpcCounts[i]) hot.push_back(uint16_t(i));
+        std::sort(hot.begin(), hot.end(), [](uint16_t a, uint16_t b) {return _vpcClocks[a] > _vpcClocks[b];});
+        if(hot.size() > PROFILER_HOT_VPCS) hot.resize(PROFILER_HOT_VPCS);
+
+        fprintf(file, "\n%-6s %-32s %6s %14s %8s %12s %8s\n", "vPC", "Label", "Opcode", "Clocks", "%", "Instructions", "Clk/Inst");
+        for(int i=0; i<int(hot.size()); i++)
+        {
+            uint16_t vPC = hot[i];
+            uint16_t base = std::prev(symbols.upper_bound(vPC))->first;
+            char label[64];
+            snprintf(label, sizeof label, "%s+0x%x", getSymbol(symbols, vPC).c_str(), vPC - base);
+            fprintf(file, "0x%04x %-32s   0x%02x %14" PRIu64 " %7.2f%% %12" PRIu64 " %8.1f\n", vPC, label, Cpu::getRAM(vPC), _vpcClocks[vPC], double(_vpcClocks[vPC])/total*100.0,
+                          _vpcCounts[vPC], double(_vpcClocks[vPC])/double(_vpcCounts[vPC]));
+        }
+        fclose(file);
+
+        file = openFile(filename + "_vcpu.folded");
+        if(file == nullptr) return false;
+
+        for(auto it=stacks.begin(); it!=stacks.end(); ++it) fprintf(file, "%s %" PRIu64 "\n", it->first.c_str(), it->second);
+        fclose(file);
+
+        return true;
+    }
+
+    bool stop(const std::string& filename)
+    {
+        Gigatron::Machine& m = Cpu::getMachine();
+        if(!_enabled) return false;
+
+        m._romCounts = nullptr;
+        _enabled = false;
+
+        int64_t clocks = m._clock - _startClock;
+        uint64_t frames = m._frameCount - _startFrame;
+        std::string romName = *Editor::getRomEntryName(m._romIndex);
+
+        bool success = writeNative(filename, romName, clocks, frames)  &&  writeVcpu(filename, frames);
+
+        _romCounts.clear();
+        _romCounts.shrink_to_fit();
+        _vpcClocks.clear();
+        _vpcClocks.shrink_to_fit();
+        _vpcCounts.clear();
+        _vpcCounts.shrink_to_fit();
+        _callNodes.clear();
+        _callFrames.clear();
+
+        if(success) fprintf(stderr, "Profiler::stop() : %" PRId64 " clocks profiled, written to '%s_native.txt' and '%s_vcpu.txt'\n", clocks, filename.c_str(), filename.c_str());
+
+        return success;
+    }
+
+    void toggle(const std::string& filename)
+    {
+        (_enabled) ? (void)stop(filename) : start();
+    }
+}
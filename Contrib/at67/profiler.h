@@ -0,0 +1,53 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include <string>
+
+
+#define PROFILER_LST_PATH  "../../" // ROMv1.lst to ROMv4.lst live in the repository root
+
+#define PROFILER_VCPU_NEXT2     0x0303 // every vCPU instruction's fetch starts here, either from NEXT or from ENTER
+#define PROFILER_VCPU_CALL      0xCF
+#define PROFILER_VCPU_CALLI     0x85
+#define PROFILER_VCPU_RET       0xFF
+#define PROFILER_MAX_CALLS      256
+#define PROFILER_HOT_VPCS       32
+
+
+namespace Gigatron
+{
+    struct Machine;
+}
+
+namespace Profiler
+{
+    bool getEnabled(void);
+
+    // Optional .gasm/.vasm file that vCPU labels are assembled from when profiling stops, otherwise the labels of
+    // whatever the editor last assembled are used
+    void setLabelsFile(const std::string& labelsFile);
+
+    // Starts profiling the calling thread's machine, every native instruction fetched is counted in a flat array
+    // indexed by ROM address and every vCPU instruction's native clocks are charged to its vPC and call stack, when
+    // not profiling the CPU's only cost is a null pointer test per clock
+    void start(void);
+
+    // Stops profiling and writes, (routines come from the ROM's .lst file, or are 256 word pages without one):
+    // <filename>_native.txt     native routines sorted by clocks and an opcode histogram
+    // <filename>_native.folded  collapsed native stacks for flamegraph.pl
+    // <filename>_vcpu.txt       vCPU functions with self and inclusive clocks, then the hottest vPCs
+    // <filename>_vcpu.folded    collapsed vCPU call stacks for flamegraph.pl
+    bool stop(const std::string& filename);
+
+    // Toggles profiling, writing the files on stop
+    void toggle(const std::string& filename);
+
+    // Called by the CPU for every native clock while profiling
+    void sample(Gigatron::Machine& m);
+
+    // Called by the CPU for every vCPU instruction run through HLE while profiling
+    void sampleHle(Gigatron::Machine& m, uint16_t vPC, int clocks);
+}
+
+#endif
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <deque>
+
+#include "memory.h"
+#include "cpu.h"
+#include "machine.h"
+#include "timing.h"
+#include "loader.h"
+#include "rewind.h"
+
+
+#define REWIND_PAGE_SIZE  256
+
+
+namespace Rewind
+{
+    // Everything a frame needs apart from RAM, ROM isn't recorded, a ROM or memory model change clears the history
+    struct Frame
+    {
+        Cpu::State _stateS, _stateT;
+        uint32_t _random;
+        uint8_t _IN, _XOUT;
+        int _vgaX, _vgaY;
+        int _hSync, _vSync;
+        int64_t _clockStall;
+        int64_t _clock;
+        uint64_t _frameCount;
+        bool _isInReset;
+        bool _checkRomType;
+        uint16_t _vPC;
+        Loader::FrameUpload _frameUpload;
+
+        // Pages that changed since the previous frame, each is a page number followed by the page XOR its previous
+        // contents, a control byte below 0x80 is followed by control+1 literals, otherwise control-0x7F bytes are unchanged
+        std::vector<uint8_t> _delta;
+    };
+
+    bool _enabled = true;
+
+    std::deque<Frame> _frames;
+    size_t _numBytes = 0;
+
+    // RAM as of the newest frame, XORing a frame's delta into it steps it back one frame
+    uint8_t _shadowRAM[RAM_SIZE_HI];
+    int _romIndex = -1;
+    int _sizeRAM = 0;
+
+
+    bool getEnabled(void) {return _enabled;}
+    int getNumFrames(void) {return int(_frames.size());}
+    size_t getNumBytes(void) {return _numBytes;}
+
+    void setEnabled(bool enabled) {_enabled = enabled; if(!enabled) reset();}
+
+
+    void reset(void)
+    {
+        _frames.clear();
+        _numBytes = 0;
+        _romIndex = -1;
+        _sizeRAM = 0;
+    }
+
+    void encodePage(int page, const uint8_t* ram, uint8_t* shadow, std::vector<uint8_t>& delta)
+    {
+        uint8_t diff[REWIND_PAGE_SIZE];
+        uint8_t changed = 0;
+        for(int i=0; i<REWIND_PAGE_SIZE; i++)
+        {
+            diff[i] = ram[i] ^ shadow[i];
+            changed |= diff[i];
+        }
+        if(!changed) return;
+
+        memcpy(shadow, ram, REWIND_PAGE_SIZE);
+        delta.push_back(uint8_t(page));
+
+        int i = 0;
+        while(i < REWIND_PAGE_SIZE)
+        {
+            int start = i;
+            if(diff[i] == 0)
+            {
+                while(i < REWIND_PAGE_SIZE  &&  i - start < 128  &&  diff[i] == 0) i++;
+                delta.push_back(uint8_t(0x7F + i - start));
+            }
+            else
+            {
+                while(i < REWIND_PAGE_SIZE  &&  i - start < 128  &&  diff[i] != 0) i++;
+                delta.push_back(uint8_t(i - start - 1));
+                delta.insert(delta.end(), &diff[start], &diff[i]);
+            }
+        }
+    }
+
+    // XORs a frame's delta into both the shadow and the machine's RAM, only touching bytes that changed
+    void applyDelta(Gigatron::Machine& m, const std::vector<uint8_t>& delta)
+    {
+        size_t index = 0;
+        while(index < delta.size())
+        {
+            int base = delta[index++] * REWIND_PAGE_SIZE;
+            int offset = 0;
+            while(offset < REWIND_PAGE_SIZE)
+            {
+                uint8_t control = delta[index++];
+                if(control >= 0x80)
+                {
+                    offset += control - 0x7F;
+                    continue;
+                }
+
+                for(int i=0; i<=control; i++, offset++)
+                {
+                    uint8_t diff = delta[index++];
+                    _shadowRAM[base + offset] ^= diff;
+                    m._RAM[base + offset] ^= diff;
+                }
+            }
+        }
+    }
+
+    void capture(void)
+    {
+        Gigatron::Machine& m = Cpu::getMachine();
+        if(!_enabled  ||  m._headless) return;
+
+        // History starts again from a complete copy of RAM
+        if(m._romIndex != _romIndex  ||  m._sizeRAM != _sizeRAM  ||  _frames.empty())
+        {
+            reset();
+            _romIndex = m._romIndex;
+            _sizeRAM = m._sizeRAM;
+            memcpy(_shadowRAM, m._RAM, m._sizeRAM);
+            memset(m._dirtyPages, 0, sizeof m._dirtyPages);
+        }
+
+        _frames.emplace_back();
+        Frame& frame = _frames.back();
+        frame._stateS = m._stateS;
+        frame._stateT = m._stateT;
+        frame._random = m._random;
+        frame._IN = m._IN;
+        frame._XOUT = m._XOUT;
+        frame._vgaX = m._vgaX;
+        frame._vgaY = m._vgaY;
+        frame._hSync = m._hSync;
+        frame._vSync = m._vSync;
+        frame._clockStall = m._clockStall;
+        frame._clock = m._clock;
+        frame._frameCount = m._frameCount;
+        frame._isInReset = m._isInReset;
+        frame._checkRomType = m._checkRomType;
+        frame._vPC = m._vPC;
+        frame._frameUpload = m._frameUpload;
+
+        // The newest frame's delta takes the shadow from the previous frame to this one
+        int numPages = m._sizeRAM / REWIND_PAGE_SIZE;
+        for(int i=0; i<numPages/64; i++)
+        {
+            uint64_t dirty = m._dirtyPages[i];
+            m._dirtyPages[i] = 0;
+            for(int j=0; dirty; j++, dirty >>= 1)
+            {
+                int page = i*64 + j;
+                if(dirty & 1) encodePage(page, &m._RAM[page*REWIND_PAGE_SIZE], &_shadowRAM[page*REWIND_PAGE_SIZE], frame._delta);
+            }
+        }
+        frame._delta.shrink_to_fit();
+        _numBytes += sizeof(Frame) + frame._delta.size();
+
+        // The oldest frame's delta is never applied, so dropping it loses nothing that can still be restored
+        while(_frames.size() > 1  &&  (_frames.size() > REWIND_SECONDS*VSYNC_RATE  ||  _numBytes > REWIND_MAX_BYTES))
+        {
+            _numBytes -= sizeof(Frame) + _frames.front()._delta.size();
+            _frames.pop_front();
+        }
+    }
+
+    bool stepBack(void)
+    {
+        Gigatron::Machine& m = Cpu::getMachine();
+        if(_frames.empty()  ||  m._romIndex != _romIndex  ||  m._sizeRAM != _sizeRAM) return false;
+
+        // Undo the RAM written since the newest frame, (by the CPU or by the editor while paused)
+        int numPages = m._sizeRAM / REWIND_PAGE_SIZE;
+        for(int page=0; page<numPages; page++)
+        {
+            if((m._dirtyPages[page >> 6] >> (page & 63)) & 1) memcpy(&m._RAM[page*REWIND_PAGE_SIZE], &_shadowRAM[page*REWIND_PAGE_SIZE], REWIND_PAGE_SIZE);
+        }
+        memset(m._dirtyPages, 0, sizeof m._dirtyPages);
+
+        // Already at the newest frame, so step back to the one before it
+        if(m._clock == _frames.back()._clock  &&  _frames.size() > 1)
+        {
+            applyDelta(m, _frames.back()._delta);
+            _numBytes -= sizeof(Frame) + _frames.back()._delta.size();
+            _frames.pop_back();
+        }
+
+        const Frame& frame = _frames.back();
+        m._stateS = frame._stateS;
+        m._stateT = frame._stateT;
+        m._random = frame._random;
+        m._IN = frame._IN;
+        m._XOUT = frame._XOUT;
+        m._vgaX = frame._vgaX;
+        m._vgaY = frame._vgaY;
+        m._hSync = frame._hSync;
+        m._vSync = frame._vSync;
+        m._clockStall = frame._clockStall;
+        m._clock = frame._clock;
+        m._frameCount = frame._frameCount;
+        m._isInReset = frame._isInReset;
+        m._checkRomType = frame._checkRomType;
+        m._vPC = frame._vPC;
+        m._frameUpload = frame._frameUpload;
+
+        return true;
+    }
+}
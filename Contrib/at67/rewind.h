@@ -0,0 +1,32 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+#define REWIND_SECONDS    60
+#define REWIND_MAX_BYTES  (8*1024*1024)
+
+
+namespace Rewind
+{
+    bool getEnabled(void);
+    int getNumFrames(void);
+    size_t getNumBytes(void);
+
+    void setEnabled(bool enabled);
+
+    void reset(void);
+
+    // Records the main machine at the start of a frame, RAM is stored as an XOR/RLE delta of only the pages written since
+    // the previous capture, the oldest frames are dropped after REWIND_SECONDS or once REWIND_MAX_BYTES is reached
+    void capture(void);
+
+    // Restores the start of the current frame, or of the previous frame if the machine is already there, at a cost
+    // proportional to the RAM that changed, must be called from the same point in Cpu::process() as capture(),
+    // returns false if there is nothing to rewind to
+    bool stepBack(void);
+}
+
+#endif
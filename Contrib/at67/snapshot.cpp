@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+
+#include "memory.h"
+#include "cpu.h"
+#include "machine.h"
+#include "audio.h"
+#include "loader.h"
+#include "snapshot.h"
+
+
+#define SNAPSHOT_HEADER_SIZE  16
+
+
+namespace Snapshot
+{
+    // Everything is stored little endian, field by field, so snapshots are portable between hosts
+    struct Writer
+    {
+        std::vector<uint8_t>& _buffer;
+
+        void put8(uint8_t data) {_buffer.push_back(data);}
+        void put16(uint16_t data) {put8(uint8_t(data)); put8(uint8_t(data >>8));}
+        void put32(uint32_t data) {put16(uint16_t(data)); put16(uint16_t(data >>16));}
+        void put64(uint64_t data) {put32(uint32_t(data)); put32(uint32_t(data >>32));}
+        void putBytes(const uint8_t* data, int length) {_buffer.insert(_buffer.end(), data, data + length);}
+    };
+
+    struct Reader
+    {
+        const uint8_t* _data;
+        size_t _size;
+        size_t _index = 0;
+        bool _valid = true;
+
+        uint8_t get8(void)
+        {
+            if(_index >= _size) {_valid = false; return 0;}
+            return _data[_index++];
+        }
+        uint16_t get16(void) {uint16_t lo = get8(); return lo | uint16_t(get8() <<8);}
+        uint32_t get32(void) {uint32_t lo = get16(); return lo | (uint32_t(get16()) <<16);}
+        uint64_t get64(void) {uint64_t lo = get32(); return lo | (uint64_t(get32()) <<32);}
+        void getBytes(uint8_t* data, int length)
+        {
+            if(length < 0  ||  _index + length > _size) {_valid = false; return;}
+            memcpy(data, &_data[_index], length);
+            _index += length;
+        }
+    };
+
+    // Machine contents of a snapshot, parsed and validated completely before any of it is applied
+    struct Image
+    {
+        uint8_t _romIndex;
+        uint8_t _romType;
+        uint32_t _romSignature;
+        std::vector<uint32_t> _romPatches; // address <<16 | instruction <<8 | data
+
+        int _sizeRAM;
+        uint8_t _RAM[RAM_SIZE_HI];
+
+        Cpu::State _stateS, _stateT;
+        uint8_t _IN, _XOUT;
+        uint32_t _random;
+        int _vgaX, _vgaY;
+        int _hSync, _vSync;
+        int64_t _clockStall;
+        int64_t _clock;
+        uint64_t _frameCount;
+        bool _isInReset;
+        bool _checkRomType;
+        uint16_t _vPC;
+        int _vCpuInstPerFrame;
+        int _vCpuInstPerFrameMax;
+        int _scanlineMode;
+        std::vector<uint8_t> _scanlinesRom0;
+        std::vector<uint8_t> _scanlinesRom1;
+
+        Loader::FrameUpload _frameUpload;
+
+        int32_t _audioIndex;
+        std::vector<uint16_t> _audioSamples;
+    };
+
+
+    // FNV-1a over 32 bit words of an unpatched ROM image
+    uint32_t romSignature(const uint8_t* rom)
+    {
+        uint32_t hash = 0x811C9DC5;
+        for(int i=0; i<ROM_SIZE*2; i+=4)
+        {
+            uint32_t word = rom[i] | (rom[i+1] <<8) | (rom[i+2] <<16) | (uint32_t(rom[i+3]) <<24);
+            hash = (hash ^ word) * 0x01000193;
+        }
+
+        return hash;
+    }
+
+    // Byte oriented run length encoding, a control byte below 0x80 is followed by control+1 literals, otherwise the
+    // next byte is repeated control-0x80+3 times, RAM is mostly runs of zeroes so this is all the compression it needs
+    void compressRle(const uint8_t* src, size_t size, std::vector<uint8_t>& dst)
+    {
+        size_t i = 0;
+        while(i < size)
+        {
+            size_t run = 1;
+            while(i + run < size  &&  run < 130  &&  src[i + run] == src[i]) run++;
+            if(run >= 3)
+            {
+                dst.push_back(uint8_t(0x80 + run - 3));
+                dst.push_back(src[i]);
+                i += run;
+                continue;
+            }
+
+            // Literals until the next run of three or more
+            size_t start = i;
+            while(i < size  &&  i - start < 128)
+            {
+                if(i + 2 < size  &&  src[i] == src[i+1]  &&  src[i] == src[i+2]) break;
+                i++;
+            }
+            dst.push_back(uint8_t(i - start - 1));
+            dst.insert(dst.end(), &src[start], &src[i]);
+        }
+    }
+
+    bool decompressRle(const uint8_t* src, size_t size, std::vector<uint8_t>& dst, size_t rawSize)
+    {
+        dst.reserve(rawSize);
+
+        size_t i = 0;
+        while(i < size)
+        {
+            uint8_t control = src[i++];
+            if(control >= 0x80)
+            {
+                if(i >= size) return false;
+                dst.insert(dst.end(), control - 0x80 + 3, src[i++]);
+            }
+            else
+            {
+                if(i + control + 1 > size) return false;
+                dst.insert(dst.end(), &src[i], &src[i + control + 1]);
+                i += control + 1;
+            }
+
+            if(dst.size() > rawSize) return false;
+        }
+
+        return dst.size() == rawSize;
+    }
+
+
+    void putState(Writer& writer, const Cpu::State& state)
+    {
+        writer.put16(state._PC);
+        writer.put8(state._IR); writer.put8(state._D); writer.put8(state._AC);
+        writer.put8(state._X); writer.put8(state._Y); writer.put8(state._OUT); writer.put8(state._undef);
+    }
+
+    void getState(Reader& reader, Cpu::State& state)
+    {
+        state._PC = reader.get16();
+        state._IR = reader.get8(); state._D = reader.get8(); state._AC = reader.get8();
+        state._X = reader.get8(); state._Y = reader.get8(); state._OUT = reader.get8(); state._undef = reader.get8();
+    }
+
+    void save(std::vector<uint8_t>& buffer, bool compress)
+    {
+        const Gigatron::Machine& m = Cpu::getMachine();
+
+        std::vector<uint8_t> payload;
+        payload.reserve(RAM_SIZE_HI + 4096);
+        Writer writer = {payload};
+
+        // ROM identity, only words that differ from the ROM file, (ROMv1's patches, scanline modes, edits), are stored
+        const uint8_t* romFile = Cpu::getRomFile(m._romIndex);
+        writer.put8(uint8_t(m._romIndex));
+        writer.put8(uint8_t(m._romType));
+        writer.put32(romSignature(romFile));
+        std::vector<uint32_t> patches;
+        for(int i=0; i<ROM_SIZE; i++)
+        {
+            uint8_t inst = m._ROM[i][ROM_INST], data = m._ROM[i][ROM_DATA];
+            if(inst != romFile[i*2 + ROM_INST]  ||  data != romFile[i*2 + ROM_DATA]) patches.push_back((i <<16) | (inst <<8) | data);
+        }
+        writer.put32(uint32_t(patches.size()));
+        for(int i=0; i<int(patches.size()); i++) writer.put32(patches[i]);
+
+        // RAM
+        writer.put32(uint32_t(m._sizeRAM));
+        writer.putBytes(m._RAM, m._sizeRAM);
+
+        // CPU, video beam and timing
+        putState(writer, m._stateS);
+        putState(writer, m._stateT);
+        writer.put8(m._IN); writer.put8(m._XOUT);
+        writer.put32(m._random);
+        writer.put32(uint32_t(m._vgaX)); writer.put32(uint32_t(m._vgaY));
+        writer.put32(uint32_t(m._hSync)); writer.put32(uint32_t(m._vSync));
+        writer.put64(uint64_t(m._clockStall));
+        writer.put64(uint64_t(m._clock));
+        writer.put64(m._frameCount);
+        writer.put8(m._isInReset); writer.put8(m._checkRomType);
+        writer.put16(m._vPC);
+        writer.put32(uint32_t(m._vCpuInstPerFrame)); writer.put32(uint32_t(m._vCpuInstPerFrameMax));
+
+        // Scanline modes
+        writer.put32(uint32_t(m._scanlineMode));
+        writer.put32(uint32_t(m._scanlinesRom0.size()));
+        writer.putBytes(m._scanlinesRom0.data(), int(m._scanlinesRom0.size()));
+        writer.putBytes(m._scanlinesRom1.data(), int(m._scanlinesRom1.size()));
+
+        // Serial loader
+        const Loader::FrameUpload& frameUpload = m._frameUpload;
+        writer.put8(frameUpload._uploading);
+        writer.put8(frameUpload._checksum);
+        writer.put8(frameUpload._payloadSize);
+        writer.putBytes(frameUpload._payload, PAYLOAD_SIZE);
+        writer.putBytes(frameUpload._framePayload, PAYLOAD_SIZE);
+        writer.put32(uint32_t(frameUpload._msgIdx));
+        writer.put32(uint32_t(frameUpload._packet));
+        writer.put32(uint32_t(frameUpload._frames));
+        writer.put8(uint8_t(frameUpload._loaderState));
+        writer.put8(uint8_t(frameUpload._frameState));
+
+        // Samples of the current frame that haven't been queued yet, headless machines have no audio
+        int numSamples = 0;
+        uint16_t* samples = (m._headless) ? nullptr : Audio::getPtrToAudioSamples(numSamples);
+        writer.put32(uint32_t((m._headless) ? 0 : Audio::getAudioIndex()));
+        writer.put32(uint32_t(numSamples));
+        for(int i=0; i<numSamples; i++) writer.put16(samples[i]);
+
+        // Header
+        buffer.clear();
+        buffer.reserve(SNAPSHOT_HEADER_SIZE + payload.size());
+        Writer header = {buffer};
+        header.putBytes((const uint8_t*)SNAPSHOT_MAGIC, 4);
+        header.put16(SNAPSHOT_VERSION);
+        header.put16((compress) ? SNAPSHOT_FLAG_RLE : 0);
+        header.put32(uint32_t(payload.size()));
+        header.put32(0); // stored size, filled in below
+
+        if(compress)
+        {
+            compressRle(payload.data(), payload.size(), buffer);
+        }
+        else
+        {
+            buffer.insert(buffer.end(), payload.begin(), payload.end());
+        }
+
+        uint32_t storedSize = uint32_t(buffer.size() - SNAPSHOT_HEADER_SIZE);
+        for(int i=0; i<4; i++) buffer[12 + i] = uint8_t(storedSize >> (i*8));
+    }
+
+    bool parse(const std::vector<uint8_t>& buffer, Image& image)
+    {
+        Reader header = {buffer.data(), buffer.size()};
+        uint8_t magic[4];
+        header.getBytes(magic, 4);
+        uint16_t version = header.get16();
+        uint16_t flags = header.get16();
+        uint32_t rawSize = header.get32();
+        uint32_t storedSize = header.get32();
+        if(!header._valid  ||  memcmp(magic, SNAPSHOT_MAGIC, 4) != 0)
+        {
+            fprintf(stderr, "Snapshot::parse() : not a snapshot\n");
+            return false;
+        }
+        if(version != SNAPSHOT_VERSION)
+        {
+            fprintf(stderr, "Snapshot::parse() : snapshot version %d is not supported, expected version %d\n", version, SNAPSHOT_VERSION);
+            return false;
+        }
+        if(SNAPSHOT_HEADER_SIZE + storedSize != buffer.size())
+        {
+            fprintf(stderr, "Snapshot::parse() : snapshot is truncated\n");
+            return false;
+        }
+
+        std::vector<uint8_t> payload;
+        const uint8_t* stored = &buffer[SNAPSHOT_HEADER_SIZE];
+        if(flags & SNAPSHOT_FLAG_RLE)
+        {
+            if(!decompressRle(stored, storedSize, payload, rawSize))
+            {
+                fprintf(stderr, "Snapshot::parse() : snapshot is corrupt\n");
+                return false;
+            }
+        }
+        else
+        {
+            payload.assign(stored, stored + storedSize);
+        }
+
+        Reader reader = {payload.data(), payload.size()};
+
+        // ROM identity
+        image._romIndex = reader.get8();
+        image._romType = reader.get8();
+        image._romSignature = reader.get32();
+        uint32_t numPatches = reader.get32();
+        if(numPatches > ROM_SIZE) reader._valid = false;
+        for(uint32_t i=0; i<numPatches  &&  reader._valid; i++) image._romPatches.push_back(reader.get32());
+
+        // RAM
+        image._sizeRAM = int(reader.get32());
+        if(image._sizeRAM != RAM_SIZE_LO  &&  image._sizeRAM != RAM_SIZE_HI) reader._valid = false;
+        if(reader._valid) reader.getBytes(image._RAM, image._sizeRAM);
+
+        // CPU, video beam and timing
+        getState(reader, image._stateS);
+        getState(reader, image._stateT);
+        image._IN = reader.get8(); image._XOUT = reader.get8();
+        image._random = reader.get32();
+        image._vgaX = int32_t(reader.get32()); image._vgaY = int32_t(reader.get32());
+        image._hSync = int32_t(reader.get32()); image._vSync = int32_t(reader.get32());
+        image._clockStall = int64_t(reader.get64());
+        image._clock = int64_t(reader.get64());
+        image._frameCount = reader.get64();
+        image._isInReset = reader.get8() != 0; image._checkRomType = reader.get8() != 0;
+        image._vPC = reader.get16();
+        image._vCpuInstPerFrame = int32_t(reader.get32()); image._vCpuInstPerFrameMax = int32_t(reader.get32());
+
+        // Scanline modes
+        image._scanlineMode = int32_t(reader.get32());
+        uint32_t numScanlines = reader.get32();
+        if(numScanlines > 0x100) reader._valid = false;
+        if(reader._valid)
+        {
+            image._scanlinesRom0.resize(numScanlines);
+            image._scanlinesRom1.resize(numScanlines);
+            reader.getBytes(image._scanlinesRom0.data(), numScanlines);
+            reader.getBytes(image._scanlinesRom1.data(), numScanlines);
+        }
+
+        // Serial loader
+        Loader::FrameUpload& frameUpload = image._frameUpload;
+        frameUpload._uploading = reader.get8() != 0;
+        frameUpload._checksum = reader.get8();
+        frameUpload._payloadSize = reader.get8();
+        reader.getBytes(frameUpload._payload, PAYLOAD_SIZE);
+        reader.getBytes(frameUpload._framePayload, PAYLOAD_SIZE);
+        frameUpload._msgIdx = int32_t(reader.get32());
+        frameUpload._packet = int32_t(reader.get32());
+        frameUpload._frames = int32_t(reader.get32());
+        frameUpload._loaderState = Loader::LoaderState(reader.get8() % Loader::NumLoaderStates);
+        frameUpload._frameState = Loader::FrameState(reader.get8() % Loader::NumFrameStates);
+
+        // Audio
+        image._audioIndex = int32_t(reader.get32());
+        uint32_t numSamples = reader.get32();
+        if(numSamples > 0x10000) reader._valid = false;
+        for(uint32_t i=0; i<numSamples  &&  reader._valid; i++) image._audioSamples.push_back(reader.get16());
+
+        if(!reader._valid  ||  reader._index != payload.size())
+        {
+            fprintf(stderr, "Snapshot::parse() : snapshot is corrupt\n");
+            return false;
+        }
+
+        if(image._romIndex >= Cpu::getNumRoms()  ||  romSignature(Cpu::getRomFile(image._romIndex)) != image._romSignature)
+        {
+            fprintf(stderr, "Snapshot::parse() : snapshot was taken with a ROM that isn't loaded, (ROM index %d)\n", image._romIndex);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool load(const std::vector<uint8_t>& buffer)
+    {
+        static thread_local Image image;
+        image._romPatches.clear();
+        image._audioSamples.clear();
+        if(!parse(buffer, image)) return false;
+
+        Gigatron::Machine& m = Cpu::getMachine();
+        if(m._romIndex != image._romIndex) Cpu::loadRom(image._romIndex);
+        if(m._sizeRAM != image._sizeRAM) Cpu::setSizeRAM(image._sizeRAM);
+
+        // Rebuild the ROM from its file and the patches, only differing words are rewritten so the HLE signatures
+        // stay coherent
+        static thread_local uint8_t rom[ROM_SIZE][2];
+        memcpy(rom, Cpu::getRomFile(image._romIndex), sizeof rom);
+        for(int i=0; i<int(image._romPatches.size()); i++)
+        {
+            uint32_t patch = image._romPatches[i];
+            rom[(patch >>16) & (ROM_SIZE-1)][ROM_INST] = uint8_t(patch >>8);
+            rom[(patch >>16) & (ROM_SIZE-1)][ROM_DATA] = uint8_t(patch);
+        }
+        for(int i=0; i<ROM_SIZE; i++)
+        {
+            if(m._ROM[i][ROM_INST] != rom[i][ROM_INST]) Cpu::writeROM(uint16_t(i), ROM_INST, rom[i][ROM_INST]);
+            if(m._ROM[i][ROM_DATA] != rom[i][ROM_DATA]) Cpu::writeROM(uint16_t(i), ROM_DATA, rom[i][ROM_DATA]);
+        }
+        m._romType = Cpu::RomType(image._romType);
+
+        memcpy(m._RAM, image._RAM, image._sizeRAM);
+        for(int i=0; i<RAM_SIZE_HI/256/64; i++) m._dirtyPages[i] = ~uint64_t(0);
+
+        m._stateS = image._stateS;
+        m._stateT = image._stateT;
+        m._IN = image._IN;
+        m._XOUT = image._XOUT;
+        m._random = image._random;
+        m._vgaX = image._vgaX;
+        m._vgaY = image._vgaY;
+        m._hSync = image._hSync;
+        m._vSync = image._vSync;
+        m._clockStall = image._clockStall;
+        m._clock = image._clock;
+        m._frameCount = image._frameCount;
+        m._isInReset = image._isInReset;
+        m._checkRomType = image._checkRomType;
+        m._vPC = image._vPC;
+        m._vCpuInstPerFrame = image._vCpuInstPerFrame;
+        m._vCpuInstPerFrameMax = image._vCpuInstPerFrameMax;
+        m._scanlineMode = image._scanlineMode;
+        m._scanlinesRom0 = image._scanlinesRom0;
+        m._scanlinesRom1 = image._scanlinesRom1;
+        m._frameUpload = image._frameUpload;
+
+        if(!m._headless)
+        {
+            int numSamples = 0;
+            uint16_t* samples = Audio::getPtrToAudioSamples(numSamples);
+            for(int i=0; i<numSamples  &&  i<int(image._audioSamples.size()); i++) samples[i] = image._audioSamples[i];
+            Audio::setAudioIndex(image._audioIndex);
+        }
+
+        return true;
+    }
+
+    bool saveFile(const std::string& filename, bool compress)
+    {
+        std::vector<uint8_t> buffer;
+        save(buffer, compress);
+
+        std::ofstream outfile(filename, std::ios::binary | std::ios::out);
+        if(!outfile.is_open())
+        {
+            fprintf(stderr, "Snapshot::saveFile() : failed to open '%s'\n", filename.c_str());
+            return false;
+        }
+
+        outfile.write((char *)buffer.data(), buffer.size());
+        if(outfile.bad() || outfile.fail())
+        {
+            fprintf(stderr, "Snapshot::saveFile() : write error in '%s'\n", filename.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    bool loadFile(const std::string& filename)
+    {
+        std::ifstream infile(filename, std::ios::binary | std::ios::in);
+        if(!infile.is_open())
+        {
+            fprintf(stderr, "Snapshot::loadFile() : failed to open '%s'\n", filename.c_str());
+            return false;
+        }
+
+        infile.seekg(0, infile.end);
+        std::vector<uint8_t> buffer(size_t(infile.tellg()));
+        infile.seekg(0, infile.beg);
+        infile.read((char *)buffer.data(), buffer.size());
+        if(infile.bad() || infile.fail())
+        {
+            fprintf(stderr, "Snapshot::loadFile() : read error in '%s'\n", filename.c_str());
+            return false;
+        }
+
+        if(!load(buffer))
+        {
+            fprintf(stderr, "Snapshot::loadFile() : failed to load '%s'\n", filename.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    std::string getQuickFilename(void)
+    {
+        std::string game = Loader::getCurrentGame();
+        return ((game.size()) ? game : std::string("gtemuAT67")) + SNAPSHOT_EXTENSION;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+#define SNAPSHOT_MAGIC      "GTSS"
+#define SNAPSHOT_VERSION    3
+#define SNAPSHOT_EXTENSION  ".gtstate"
+
+#define SNAPSHOT_FLAG_RLE  0x0001
+
+
+namespace Snapshot
+{
+    // Serialises the calling thread's machine, (CPU state, RAM, IN/XOUT, clock, video beam, loader and pending audio
+    // samples), the ROM is identified by its index and a signature of the unpatched image plus a list of patched words
+    void save(std::vector<uint8_t>& buffer, bool compress=true);
+
+    // Restores a snapshot into the calling thread's machine, switching ROM and memory model if needed, nothing is
+    // changed if the snapshot is malformed or its ROM doesn't match
+    bool load(const std::vector<uint8_t>& buffer);
+
+    bool saveFile(const std::string& filename, bool compress=true);
+    bool loadFile(const std::string& filename);
+
+    // Snapshot file for the hotkeys, named after the current game
+    std::string getQuickFilename(void);
+}
+
+#endif
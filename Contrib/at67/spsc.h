@@ -0,0 +1,88 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+
+namespace Spsc
+{
+    // Lock free ring between exactly one producer thread and one consumer thread, SIZE must be a power of two, a full
+    // ring rejects pushes rather than overwriting, so the producer never waits on the consumer
+    template<typename T, size_t SIZE> struct Ring
+    {
+        static_assert((SIZE & (SIZE - 1)) == 0, "Spsc::Ring SIZE must be a power of two");
+
+        alignas(64) std::atomic<size_t> _head{0}; // written by the producer only
+        alignas(64) std::atomic<size_t> _tail{0}; // written by the consumer only
+        alignas(64) T _items[SIZE];
+
+        bool push(const T& item)
+        {
+            size_t head = _head.load(std::memory_order_relaxed);
+            if(head - _tail.load(std::memory_order_acquire) == SIZE) return false;
+
+            _items[head & (SIZE - 1)] = item;
+            _head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T& item)
+        {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            if(tail == _head.load(std::memory_order_acquire)) return false;
+
+            item = _items[tail & (SIZE - 1)];
+            _tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Pops up to count items in one go, returns the number popped
+        size_t pop(T* items, size_t count)
+        {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            size_t available = _head.load(std::memory_order_acquire) - tail;
+            if(count > available) count = available;
+
+            for(size_t i=0; i<count; i++) items[i] = _items[(tail + i) & (SIZE - 1)];
+            _tail.store(tail + count, std::memory_order_release);
+            return count;
+        }
+
+        // Only exact when called from the producer or the consumer while the other is idle
+        size_t size(void) const {return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);}
+    };
+
+    // Lock free triple buffer, the producer always owns a back buffer to fill and publish, the consumer always owns a
+    // front buffer holding the newest published one, neither ever waits and unconsumed frames are simply replaced
+    template<typename T> struct TripleBuffer
+    {
+        static const uint8_t FRESH = 0x04;
+
+        T _buffers[3];
+        uint8_t _back = 0;                   // producer only
+        uint8_t _front = 1;                  // consumer only
+        std::atomic<uint8_t> _middle{2};     // index of the spare buffer, FRESH if it holds an unconsumed publish
+
+        T& back(void) {return _buffers[_back];}
+        T& front(void) {return _buffers[_front];}
+
+        // Producer, hands the back buffer over and takes the spare one in its place
+        void publish(void)
+        {
+            _back = _middle.exchange(_back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+        }
+
+        // Consumer, swaps in the newest published buffer, returns false if nothing has been published since the last update
+        bool update(void)
+        {
+            if((_middle.load(std::memory_order_relaxed) & FRESH) == 0) return false;
+
+            _front = _middle.exchange(_front, std::memory_order_acq_rel) & ~FRESH;
+            return true;
+        }
+    };
+}
+
+#endif
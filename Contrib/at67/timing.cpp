@@ -1,6 +1,9 @@
 #include <algorithm>
+#include <chrono>
+#include <thread>
 
 #include <SDL.h>
+#include "audio.h"
 #include "timing.h"
 
 
@@ -10,31 +13,99 @@ namespace Timing
     uint64_t _frameCount = 0;
     double _frameTime = 0.0;
     double _timingAdjust = VSYNC_TIMING_60;
+    bool _syncToAudio = false;
+
+    uint64_t _prevFrameCounter = 0;
+    uint64_t _deadline = 0;
+    double _oversleep = 0.0;
+
+    JitterStats _jitterRecent, _jitterWindow, _jitterTotal;
 
 
     bool getFrameUpdate(void) {return _frameUpdate;}
     uint64_t getFrameCount(void) {return _frameCount;}
     double getFrameTime(void) {return _frameTime;}
     double getTimingHack(void) {return _timingAdjust;}
+    bool getSyncToAudio(void) {return _syncToAudio;}
+    const JitterStats& getJitterRecent(void) {return _jitterRecent;}
+    const JitterStats& getJitterTotal(void) {return _jitterTotal;}
 
     void setFrameUpdate(bool update) {_frameUpdate = update;}
     void setTimingHack(double hack) {_timingAdjust = hack;}
+    void setSyncToAudio(bool syncToAudio) {_syncToAudio = syncToAudio;}
+
+
+    void addJitter(JitterStats& stats, double jitter)
+    {
+        stats._frames++;
+        if(jitter > TIMING_LATE_TIME) stats._lateFrames++;
+        stats._mean += (jitter - stats._mean) / double(stats._frames);
+        stats._max = std::max(stats._max, jitter);
+    }
+
+    // Sleeps until the deadline is within the spin margin, (widened by how late recent sleeps have woken up), then spins
+    // for the rest, so the wait is accurate to the performance counter without spinning a core for the whole frame
+    void waitUntil(uint64_t deadline)
+    {
+        double frequency = double(SDL_GetPerformanceFrequency());
+
+        for(;;)
+        {
+            uint64_t counter = SDL_GetPerformanceCounter();
+            if(counter >= deadline) break;
+
+            double sleep = double(deadline - counter) / frequency - TIMING_SPIN_TIME - _oversleep;
+            if(sleep <= 0.0) continue;
 
+            std::this_thread::sleep_for(std::chrono::duration<double>(sleep));
+
+            // Decays slowly, so one late wake up doesn't force spinning for long
+            double slept = double(SDL_GetPerformanceCounter() - counter) / frequency;
+            _oversleep = std::min(std::max(slept - sleep, _oversleep * 0.99), TIMING_MAX_OVERSLEEP);
+        }
+    }
 
     void synchronise(void)
     {
-        static uint64_t prevFrameCounter = 0;
+        double frequency = double(SDL_GetPerformanceFrequency());
+        uint64_t counter = SDL_GetPerformanceCounter();
+
+        uint64_t deadline;
+        if(_syncToAudio)
+        {
+            // Due when the audio device has consumed all but TIMING_AUDIO_LATENCY of what's queued, (capped in case the
+            // device has stopped)
+            double excess = std::min(Audio::getQueuedTime() - TIMING_AUDIO_LATENCY, VSYNC_TIMING_60*2.0);
+            deadline = counter + uint64_t(std::max(excess, 0.0) * frequency);
+        }
+        else
+        {
+            // Frames are due a period apart, a frame that starts more than a whole period late restarts the schedule
+            // rather than racing to catch up
+            uint64_t period = uint64_t(_timingAdjust * frequency);
+            deadline = _deadline + period;
+            if(counter > deadline + period) deadline = counter;
+        }
 
-        do
+        waitUntil(deadline);
+        _deadline = deadline;
+
+        counter = SDL_GetPerformanceCounter();
+        double jitter = double(counter - deadline) / frequency;
+        addJitter(_jitterTotal, jitter);
+        addJitter(_jitterWindow, jitter);
+        if(_jitterWindow._frames >= TIMING_JITTER_FRAMES)
         {
-            _frameTime = double(SDL_GetPerformanceCounter() - prevFrameCounter) / double(SDL_GetPerformanceFrequency());
+            _jitterRecent = _jitterWindow;
+            _jitterWindow = JitterStats();
         }
-        while(_frameTime < _timingAdjust);
-        prevFrameCounter = SDL_GetPerformanceCounter();
+
+        _frameTime = double(counter - _prevFrameCounter) / frequency;
+        _prevFrameCounter = counter;
 
         _frameCount++;
 
         // Used for updating at a constant 60 times per second no matter what the FPS is
         _frameUpdate = ((_frameCount % int((VSYNC_TIMING_60)/std::min(_frameTime, (VSYNC_TIMING_60)))) == 0);
     }
-}
\ No newline at end of file
+}
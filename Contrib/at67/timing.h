@@ -22,17 +22,40 @@
 #define SINGLE_STEP_STALL_TIME  1000
 #define MAX_SINGLE_STEP_CYCLES  100
 
+// Frame pacer, sleeps for most of a frame and spins for the last TIMING_SPIN_TIME seconds
+#define TIMING_SPIN_TIME        0.0005
+#define TIMING_MAX_OVERSLEEP    0.004
+#define TIMING_LATE_TIME        0.001
+#define TIMING_AUDIO_LATENCY    (VSYNC_TIMING_60*2.0)
+#define TIMING_JITTER_FRAMES    60
+
 
 namespace Timing
 {
+    // How late synchronise() returned relative to when each frame was due, in seconds
+    struct JitterStats
+    {
+        uint64_t _frames = 0;
+        uint64_t _lateFrames = 0; // more than TIMING_LATE_TIME late
+        double _mean = 0.0;
+        double _max = 0.0;
+    };
+
     bool getFrameUpdate(void);
     uint64_t getFrameCount(void);
     double getFrameTime(void);
     double getTimingHack(void);
+    bool getSyncToAudio(void);
+    const JitterStats& getJitterRecent(void); // the last complete TIMING_JITTER_FRAMES frames
+    const JitterStats& getJitterTotal(void);
 
     void setFrameUpdate(bool update);
     void setTimingHack(double hack);
 
+    // Paces frames by how quickly the audio device consumes samples instead of by the performance counter, which keeps
+    // the emulator and a sound card with a slightly different idea of 60Hz from drifting apart
+    void setSyncToAudio(bool syncToAudio);
+
     void synchronise(void);
 }
 
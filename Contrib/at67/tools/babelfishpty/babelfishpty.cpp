@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <chrono>
+#include <thread>
+
+
+#define BABELFISHPTY_MAJOR_VERSION "0.1"
+#define BABELFISHPTY_MINOR_VERSION "0"
+#define BABELFISHPTY_VERSION_STR "babelfishpty v" BABELFISHPTY_MAJOR_VERSION "." BABELFISHPTY_MINOR_VERSION
+
+#define SERIAL_TIMEOUT   5.0    // BabelFish's nextSerial() gives up after 5 seconds
+#define VSYNC_RATE       59.98
+#define PAYLOAD_SIZE     60
+#define RESET_FRAMES     150    // 'R' holds Start, then waits 1.5 seconds
+#define RESET_DELAY      1.5
+#define LOADER_DELAY     1.0    // 'L' presses Down 10 times and A, then waits 1 second
+
+
+struct Segment
+{
+    uint8_t _hi, _lo;
+    std::vector<uint8_t> _data;
+};
+
+int _master = -1;
+std::deque<uint8_t> _received;
+
+bool _quick = false;
+int _rxSize = 64;
+int _failEvery = 0;
+int _segmentCount = 0;
+int _dropped = 0;
+
+std::vector<Segment> _segments;
+
+
+void sleepSeconds(double seconds)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(int64_t(seconds * 1000000.0)));
+}
+
+void output(const std::string& line)
+{
+    std::string text = line + "\r\n";
+    const char* data = text.c_str();
+    size_t size = text.size();
+    while(size)
+    {
+        ssize_t n = write(_master, data, size);
+        if(n < 0)
+        {
+            if(errno == EAGAIN  ||  errno == EINTR) {sleepSeconds(0.001); continue;}
+            return;
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+// Reads whatever has arrived, keeping at most limit bytes queued like the Arduino's receive buffer
+void receive(int limit)
+{
+    uint8_t buffer[256];
+    ssize_t n;
+    while((n = read(_master, buffer, sizeof(buffer))) > 0)
+    {
+        for(int i=0; i<n; i++)
+        {
+            if(limit < 0  ||  int(_received.size()) < limit) _received.push_back(buffer[i]);
+            else _dropped++;
+        }
+    }
+}
+
+bool nextByte(uint8_t& byte, double timeOut)
+{
+    auto start = std::chrono::steady_clock::now();
+    while(_received.empty())
+    {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if(elapsed >= timeOut) return false;
+
+        struct pollfd pfd = {_master, POLLIN, 0};
+        poll(&pfd, 1, int((timeOut - elapsed) * 1000.0) + 1);
+        receive(-1);
+    }
+
+    byte = _received.front();
+    _received.pop_front();
+    return true;
+}
+
+void prompt(void)
+{
+    output(":Gigatron OK");
+    output("Cmd?");
+}
+
+void ask(int n)
+{
+    output(std::to_string(n) + "?");
+}
+
+// The BabelFish is deaf while it drives the Gigatron, only its receive buffer keeps bytes
+void sendToGigatron(int size)
+{
+    int frames = (size + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE + 1;
+    sleepSeconds(double(frames) / VSYNC_RATE);
+
+    int dropped = _dropped;
+    receive(_rxSize);
+    if(_dropped != dropped) fprintf(stderr, "babelfishpty : dropped %d bytes while sending to the Gigatron\n", _dropped - dropped);
+}
+
+void writeGt1(const std::string& filename, uint8_t startHi, uint8_t startLo)
+{
+    std::ofstream outfile(filename, std::ios::binary | std::ios::out);
+    if(!outfile.is_open())
+    {
+        fprintf(stderr, "babelfishpty : couldn't open '%s'\n", filename.c_str());
+        return;
+    }
+
+    for(int i=0; i<int(_segments.size()); i++)
+    {
+        uint8_t header[3] = {_segments[i]._hi, _segments[i]._lo, uint8_t(_segments[i]._data.size())};
+        outfile.write((char *)header, 3);
+        outfile.write((char *)&_segments[i]._data[0], _segments[i]._data.size());
+    }
+
+    uint8_t trailer[3] = {0x00, startHi, startLo};
+    outfile.write((char *)trailer, 3);
+}
+
+// Mirrors BabelFish's doTransfer(), returns true once a whole gt1 has been received
+bool doTransfer(const std::string& outFilename)
+{
+    output(":Sending from PROGMEM");
+
+    uint8_t hi, lo, len, byte;
+    ask(3);
+    if(!nextByte(hi, SERIAL_TIMEOUT))
+    {
+        output("!Timeout error (no data)");
+        return false;
+    }
+
+    do
+    {
+        if(!nextByte(lo, SERIAL_TIMEOUT)  ||  !nextByte(len, SERIAL_TIMEOUT))
+        {
+            output("!Timeout error (no data)");
+            return false;
+        }
+
+        int size = (len) ? len : 256;
+        if(lo + size > 256)
+        {
+            output("!Data error (page overflow)");
+            return false;
+        }
+
+        Segment segment = {hi, lo};
+        ask(size);
+        for(int i=0; i<size; i++)
+        {
+            if(!nextByte(byte, SERIAL_TIMEOUT))
+            {
+                output("!Timeout error (no data)");
+                return false;
+            }
+            segment._data.push_back(byte);
+        }
+
+        if(_failEvery  &&  (++_segmentCount % _failEvery) == 0)
+        {
+            output("!Data error (injected)");
+            return false;
+        }
+
+        char loading[64];
+        sprintf(loading, ":Loading %d bytes at $%02X%02X", size, hi, lo);
+        output(loading);
+        sendToGigatron(size);
+        _segments.push_back(segment);
+
+        ask(3);
+        if(!nextByte(hi, SERIAL_TIMEOUT))
+        {
+            output("!Timeout error (no data)");
+            return false;
+        }
+    }
+    while(hi);
+
+    uint8_t startHi, startLo;
+    if(!nextByte(startHi, SERIAL_TIMEOUT)  ||  !nextByte(startLo, SERIAL_TIMEOUT))
+    {
+        output("!Timeout error (no data)");
+        return false;
+    }
+
+    if(startHi  ||  startLo)
+    {
+        char executing[64];
+        sprintf(executing, ":Executing from $%02X%02X", startHi, startLo);
+        output(executing);
+        sendToGigatron(0);
+    }
+
+    fprintf(stderr, "babelfishpty : received %d segments\n", int(_segments.size()));
+    if(outFilename.size()) writeGt1(outFilename, startHi, startLo);
+    _segments.clear();
+
+    return true;
+}
+
+bool makeRaw(int fd)
+{
+    struct termios config;
+    if(tcgetattr(fd, &config) != 0) return false;
+    cfmakeraw(&config);
+    return tcsetattr(fd, TCSANOW, &config) == 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+    std::string linkName, outFilename;
+    bool once = false;
+
+    for(int i=1; i<argc; i++)
+    {
+        bool hasValue = (i+1 < argc);
+        if(strcmp(argv[i], "--link") == 0  &&  hasValue) linkName = argv[++i];
+        else if(strcmp(argv[i], "--out") == 0  &&  hasValue) outFilename = argv[++i];
+        else if(strcmp(argv[i], "--rx") == 0  &&  hasValue) _rxSize = strtol(argv[++i], nullptr, 10);
+        else if(strcmp(argv[i], "--fail") == 0  &&  hasValue) _failEvery = strtol(argv[++i], nullptr, 10);
+        else if(strcmp(argv[i], "--quick") == 0) _quick = true;
+        else if(strcmp(argv[i], "--once") == 0) once = true;
+        else
+        {
+            fprintf(stderr, "%s\n", BABELFISHPTY_VERSION_STR);
+            fprintf(stderr, "Usage:   babelfishpty [--link <path>] [--out <gt1 file>] [--rx <n>] [--fail <n>] [--quick] [--once]\n");
+            return 1;
+        }
+    }
+
+    _master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(_master < 0  ||  grantpt(_master) != 0  ||  unlockpt(_master) != 0)
+    {
+        fprintf(stderr, "babelfishpty : couldn't create a pseudo terminal : %s\n", strerror(errno));
+        return 1;
+    }
+    fcntl(_master, F_SETFL, fcntl(_master, F_GETFL) | O_NONBLOCK);
+
+    // Holding the slave open keeps the master readable between clients
+    std::string slaveName = ptsname(_master);
+    int slave = open(slaveName.c_str(), O_RDWR | O_NOCTTY);
+    if(slave < 0  ||  !makeRaw(slave))
+    {
+        fprintf(stderr, "babelfishpty : couldn't open '%s' : %s\n", slaveName.c_str(), strerror(errno));
+        return 1;
+    }
+
+    if(linkName.size())
+    {
+        unlink(linkName.c_str());
+        if(symlink(slaveName.c_str(), linkName.c_str()) != 0)
+        {
+            fprintf(stderr, "babelfishpty : couldn't link '%s' to '%s' : %s\n", linkName.c_str(), slaveName.c_str(), strerror(errno));
+            return 1;
+        }
+    }
+
+    fprintf(stdout, "%s\n", slaveName.c_str());
+    fflush(stdout);
+
+    // Command loop, one letter commands terminated by a newline
+    for(;;)
+    {
+        std::string line;
+        uint8_t byte = 0;
+        while(byte != '\n')
+        {
+            if(!nextByte(byte, 3600.0)) continue;
+            if(byte != '\n'  &&  byte != '\r') line.push_back(char(byte));
+        }
+
+        char cmd = (line.size()) ? line[0] : 0;
+        switch(cmd)
+        {
+            case 'R': if(!_quick) sleepSeconds(RESET_FRAMES / VSYNC_RATE + RESET_DELAY); break;
+            case 'L': if(!_quick) sleepSeconds(LOADER_DELAY);                             break;
+            case 'U':
+            {
+                if(doTransfer(outFilename)  &&  once)
+                {
+                    prompt();
+                    sleepSeconds(0.1);
+                    if(linkName.size()) unlink(linkName.c_str());
+                    return 0;
+                }
+            }
+            break;
+
+            default: break;
+        }
+
+        prompt();
+    }
+}